@@ -16,13 +16,18 @@
  * and follows modern kernel coding standards.
  */
 
+#include <linux/atomic.h>
+#include <linux/cred.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/kernel_stat.h>
+#include <linux/ktime.h>
 #include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/proc_fs.h>
+#include <linux/rcupdate.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
 #include <linux/seq_file.h>
 #include <linux/sysinfo.h>
 
@@ -32,6 +37,31 @@
 /** Module version information */
 #define MODULE_VERSION "1.0.0"
 
+/** Samples collected since the module was loaded, and the time they took */
+static atomic64_t collections = ATOMIC64_INIT(0);
+static atomic64_t collect_total_ns = ATOMIC64_INIT(0);
+
+/**
+ * task_cpu_ns - CPU time used by a whole process
+ * @task: Thread group leader
+ *
+ * Sums user and system time over the live threads and adds what the
+ * exited ones left in the signal struct, like /proc/PID/stat does.
+ *
+ * Return: CPU time in nanoseconds
+ */
+static u64 task_cpu_ns(struct task_struct *task)
+{
+    struct task_struct *t;
+    u64 cpu = task->signal->utime + task->signal->stime;
+
+    rcu_read_lock();
+    for_each_thread(task, t)
+        cpu += t->utime + t->stime;
+    rcu_read_unlock();
+    return cpu;
+}
+
 /**
  * proc_show - Callback function to display kernel monitor data
  * @m: seq_file structure for output
@@ -48,6 +78,8 @@ static int proc_show(struct seq_file *m, void *v)
     struct mm_struct *mm;
     struct sysinfo mem_info;
     u64 user_time, system_time, idle_time;
+    u64 sample_time = ktime_get_ns();
+    u64 collect_ns;
     unsigned long total_processes = 0;
 
     /* Print header */
@@ -55,6 +87,12 @@ static int proc_show(struct seq_file *m, void *v)
     seq_printf(m, "     Linux Kernel Monitor v%s\n", MODULE_VERSION);
     seq_printf(m, "===========================================\n\n");
 
+    /*
+     * CLOCK_MONOTONIC time of this sample, the same clock user space reads
+     * with clock_gettime(), so readers can tell how old the data is.
+     */
+    seq_printf(m, "Sample Time: %llu ns\n\n", sample_time);
+
     /* Collect and display CPU statistics */
     user_time = kcpustat_cpu(0).cpustat[CPUTIME_USER];
     system_time = kcpustat_cpu(0).cpustat[CPUTIME_SYSTEM];
@@ -77,17 +115,24 @@ static int proc_show(struct seq_file *m, void *v)
 
     /* Display process information */
     seq_printf(m, "Process Information:\n");
-    seq_printf(m, "%-20s %-8s %-12s\n", "Name", "PID", "Memory (KB)");
+    seq_printf(m, "%-20s %-8s %-12s %-12s %-16s %-16s %-8s %s\n", "Name", "PID",
+               "Memory (KB)", "RSS (KB)", "Start (ns)", "CPU (ns)", "PPID", "UID");
     seq_printf(m, "-------------------------------------------\n");
 
     /* Iterate through all processes */
     for_each_process(task) {
         mm = get_task_mm(task);
         if (mm) {
-            seq_printf(m, "%-20s %-8d %-12lu\n", 
+            seq_printf(m, "%-20s %-8d %-12lu %-12lu %-16llu %-16llu %-8d %u\n", 
                        task->comm, 
                        task->pid,
-                       (mm->total_vm * 4)); /* Convert pages to KB */
+                       (mm->total_vm * 4),      /* Convert pages to KB */
+                       (get_mm_rss(mm) * 4),    /* Resident pages to KB */
+                       (unsigned long long)task->start_time,  /* ns since boot */
+                       (unsigned long long)task_cpu_ns(task),
+                       task_ppid_nr(task),
+                       /* Effective uid as seen from the reader's namespace */
+                       from_kuid_munged(seq_user_ns(m), task_euid(task)));
             mmput(mm);  /* Release reference to mm_struct */
             total_processes++;
         }
@@ -95,6 +140,19 @@ static int proc_show(struct seq_file *m, void *v)
 
     seq_printf(m, "\nTotal Processes: %lu\n", total_processes);
 
+    /*
+     * Report what collecting cost, so the monitor can show its own
+     * overhead. seq_file calls this function again with a larger buffer
+     * when the output does not fit, and those retries count too.
+     */
+    collect_ns = ktime_get_ns() - sample_time;
+    atomic64_inc(&collections);
+    atomic64_add(collect_ns, &collect_total_ns);
+    seq_printf(m, "Collection Time: %llu ns\n", collect_ns);
+    seq_printf(m, "Collections: %lld, %lld ns total\n",
+               (long long)atomic64_read(&collections),
+               (long long)atomic64_read(&collect_total_ns));
+
     return 0;
 }
 
@@ -0,0 +1,1473 @@
+/**
+ * @file kmon.c
+ * @brief Snapshot API for Linux Kernel Monitor data (libkmon)
+ *
+ * Reads the kernel monitor module's text output, the standard procfs
+ * files, the fan-out daemon's binary frames and the shared memory
+ * snapshot into caller-provided buffers. Nothing in here allocates or
+ * prints while sampling; errors are reported through errno.
+ */
+
+#define _GNU_SOURCE
+
+#include "kmon.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#if defined(SYS_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define KMON_HAVE_URING     1
+#endif
+
+#define KMON_MIN_BUFFER     4096        /* First buffer size suggested for text */
+#define SHM_READ_RETRIES    1000        /* Attempts before declaring the writer dead */
+#define PROCFS_DENT_BUF     4096        /* Directory entries read per getdents64() */
+#define PROCFS_FILE_BUF     4096        /* Largest part of a procfs file parsed */
+#define PROCFS_SCRATCH      (PROCFS_DENT_BUF + PROCFS_FILE_BUF)
+#define PROCFS_MIN_TASKS    256         /* Task records of the first suggested buffer */
+#define URING_BATCH         64          /* /proc/PID/stat files read per submission */
+#define URING_FILE_BUF      1024        /* Registered buffer per file; stat lines are shorter */
+
+/* Kinds of source behind a struct kmon */
+enum kmon_kind {
+    KMON_TEXT,              /* Module text output, re-read from a file */
+    KMON_PROCFS,            /* Standard procfs files, read through a cached /proc fd */
+    KMON_SOCKET,            /* Fan-out daemon connection */
+    KMON_SHM,               /* Shared memory snapshot */
+};
+
+/* How a procfs source reads the per-process files */
+enum procfs_mode {
+    PROCFS_AUTO,            /* io_uring when the kernel allows it, else syscalls */
+    PROCFS_SYNC,            /* One openat() and read() per file */
+    PROCFS_URING,           /* io_uring or fail */
+};
+
+/* Encodings of the task rows held in a snapshot's buffer */
+enum kmon_format {
+    KMON_FORMAT_TEXT,
+    KMON_FORMAT_WIRE,
+};
+
+/*
+ * Numeric columns of the process table. Older modules omit some of them,
+ * so the header decides which ones are present and in which order.
+ */
+enum task_col {
+    TASK_COL_PID,
+    TASK_COL_MEM,
+    TASK_COL_RSS,
+    TASK_COL_START,
+    TASK_COL_CPU,
+    TASK_COL_PPID,
+    TASK_COL_UID,
+    TASK_COL_MAX
+};
+
+static const char *const task_col_names[TASK_COL_MAX] = {
+    [TASK_COL_PID] = "PID",
+    [TASK_COL_MEM] = "Memory",
+    [TASK_COL_RSS] = "RSS",
+    [TASK_COL_START] = "Start",
+    [TASK_COL_CPU] = "CPU",
+    [TASK_COL_PPID] = "PPID",
+    [TASK_COL_UID] = "UID",
+};
+
+/* Record returned by getdents64(); glibc only declares it from 2.30 on */
+struct procfs_dirent {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#ifdef KMON_HAVE_URING
+/**
+ * struct kmon_uring - io_uring instance of a procfs source
+ * @fd: Ring descriptor
+ * @sq_head: Submission queue head, advanced by the kernel
+ * @sq_tail: Submission queue tail, advanced by us
+ * @sq_mask: Submission queue index mask
+ * @sq_array: Submission queue slots, indices into @sqes
+ * @cq_head: Completion queue head, advanced by us
+ * @cq_tail: Completion queue tail, advanced by the kernel
+ * @cq_mask: Completion queue index mask
+ * @sqes: Submission queue entries
+ * @cqes: Completion queue entries
+ * @sq_ring: Mapping of the submission ring
+ * @cq_ring: Mapping of the completion ring
+ * @sq_ring_size: Size of @sq_ring
+ * @cq_ring_size: Size of @cq_ring, 0 if it shares @sq_ring
+ * @sqes_size: Size of @sqes
+ * @res: Result of each file's read in the current batch
+ * @paths: "PID/stat" of each file in the current batch
+ * @bufs: Registered buffer, one slot per file
+ *
+ * Lives in an anonymous mapping made when the source is opened, so that
+ * sampling itself does not allocate. Each file takes three linked
+ * requests: openat into a direct descriptor slot, a read into the
+ * registered buffer and a close of the slot.
+ */
+struct kmon_uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    int res[URING_BATCH];
+    int stx_res[URING_BATCH];
+    struct statx stx[URING_BATCH];
+    char paths[URING_BATCH][24];
+    char bufs[URING_BATCH][URING_FILE_BUF];
+};
+#endif
+
+/**
+ * monotonic_seconds - Read CLOCK_MONOTONIC
+ *
+ * Return: Current monotonic time in seconds
+ */
+static double monotonic_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * open_socket - Connect to a fan-out daemon
+ * @km: Handle to fill
+ * @path: Socket path
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int open_socket(struct kmon *km, const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    km->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (km->fd < 0)
+        return -1;
+    if (connect(km->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+
+        close(km->fd);
+        km->fd = -1;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * open_shm - Map a shared memory snapshot segment
+ * @km: Handle to fill
+ * @name: Object name, with or without the leading slash
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int open_shm(struct kmon *km, const char *name)
+{
+    char obj[NAME_MAX + 1];
+    const struct kmon_shm_header *hdr;
+    struct stat st;
+    int n, fd, err;
+    void *p;
+
+    n = snprintf(obj, sizeof(obj), "%s%s", name[0] == '/' ? "" : "/", name);
+    if (n < 2 || n > NAME_MAX || strchr(obj + 1, '/')) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = shm_open(obj, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(*hdr) + sizeof(struct kmon_wire_header)) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    err = errno;
+    close(fd);
+    if (p == MAP_FAILED) {
+        errno = err;
+        return -1;
+    }
+
+    hdr = p;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != KMON_SHM_MAGIC ||
+        hdr->version != KMON_SHM_VERSION || hdr->header_size != sizeof(*hdr) ||
+        (size_t)st.st_size < sizeof(*hdr) + sizeof(struct kmon_wire_header) +
+                             (size_t)hdr->capacity * sizeof(struct kmon_wire_task)) {
+        munmap(p, st.st_size);
+        errno = EPROTO;
+        return -1;
+    }
+    km->shm = hdr;
+    km->shm_size = st.st_size;
+    return 0;
+}
+
+/**
+ * uring_close - Tear down the io_uring instance of a procfs source
+ * @km: Handle
+ */
+static void uring_close(struct kmon *km)
+{
+#ifdef KMON_HAVE_URING
+    struct kmon_uring *u = km->uring;
+
+    if (!u)
+        return;
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring_size)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring)
+        munmap(u->sq_ring, u->sq_ring_size);
+    if (u->fd >= 0)
+        close(u->fd);
+    munmap(u, sizeof(*u));
+#endif
+    km->uring = NULL;
+}
+
+/**
+ * uring_open - Set up io_uring for batched /proc/PID/stat reads
+ * @km: Procfs source
+ *
+ * Needs direct descriptors for openat and close (Linux 5.15). Older
+ * kernels and sandboxes that forbid io_uring make this fail, and the
+ * caller then reads with plain syscalls.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int uring_open(struct kmon *km)
+{
+#ifdef KMON_HAVE_URING
+    struct io_uring_params p;
+    struct io_uring_rsrc_register files;
+    struct kmon_uring *u;
+    struct iovec iov;
+    int err;
+
+    u = mmap(NULL, sizeof(*u), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u == MAP_FAILED)
+        return -1;
+    km->uring = u;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(SYS_io_uring_setup, 4 * URING_BATCH, &p);
+    if (u->fd < 0)
+        goto fail;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = 0;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        goto fail;
+    }
+    u->cq_ring = u->sq_ring;
+    if (u->cq_ring_size) {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring_size = 0;
+            goto fail;
+        }
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    u->sq_head = (unsigned *)((char *)u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+    u->cq_head = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+
+    /* Pin the read buffers once instead of on every read */
+    iov.iov_base = u->bufs;
+    iov.iov_len = sizeof(u->bufs);
+    if (syscall(SYS_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+        goto fail;
+
+    /* Empty direct descriptor table for the opens to fill */
+    memset(&files, 0, sizeof(files));
+    files.nr = URING_BATCH;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(SYS_io_uring_register, u->fd, IORING_REGISTER_FILES2,
+                &files, sizeof(files)) < 0)
+        goto fail;
+    return 0;
+
+fail:
+    err = errno;
+    uring_close(km);
+    errno = err;
+    return -1;
+#else
+    (void)km;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * open_procfs - Prepare to build samples from the standard procfs files
+ * @km: Handle to fill
+ * @root: procfs mount point, empty for /proc
+ * @mode: PROCFS_AUTO, PROCFS_SYNC or PROCFS_URING
+ *
+ * The directory stays open so every file can be opened relative to it.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int open_procfs(struct kmon *km, const char *root, int mode)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    long hz = sysconf(_SC_CLK_TCK);
+
+    km->fd = open(*root ? root : "/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (km->fd < 0)
+        return -1;
+    km->page_kb = page >= 1024 ? page / 1024 : 4;
+    km->tick_ns = hz > 0 ? 1000000000ul / hz : 10000000ul;
+
+    if (mode != PROCFS_SYNC && uring_open(km) < 0 && mode == PROCFS_URING) {
+        int err = errno;
+
+        close(km->fd);
+        km->fd = -1;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int kmon_open(struct kmon *km, const char *source)
+{
+    memset(km, 0, sizeof(*km));
+    km->fd = -1;
+
+    if (source && strncmp(source, "procfs:", 7) == 0) {
+        km->kind = KMON_PROCFS;
+        return open_procfs(km, source + 7, PROCFS_AUTO);
+    }
+    if (source && strncmp(source, "procfs-sync:", 12) == 0) {
+        km->kind = KMON_PROCFS;
+        return open_procfs(km, source + 12, PROCFS_SYNC);
+    }
+    if (source && strncmp(source, "procfs-uring:", 13) == 0) {
+        km->kind = KMON_PROCFS;
+        return open_procfs(km, source + 13, PROCFS_URING);
+    }
+
+    if (source && strncmp(source, "unix:", 5) == 0) {
+        km->kind = KMON_SOCKET;
+        return open_socket(km, source + 5);
+    }
+    if (source && strncmp(source, "shm:", 4) == 0) {
+        km->kind = KMON_SHM;
+        return open_shm(km, source + 4);
+    }
+
+    km->kind = KMON_TEXT;
+    if (!source)
+        source = KMON_PROC_PATH;
+    if (strlen(source) >= sizeof(km->path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(km->path, source);
+    return 0;
+}
+
+void kmon_close(struct kmon *km)
+{
+    uring_close(km);
+    if (km->shm)
+        munmap((void *)km->shm, km->shm_size);
+    if (km->fd >= 0)
+        close(km->fd);
+    km->shm = NULL;
+    km->fd = -1;
+}
+
+int kmon_fd(const struct kmon *km)
+{
+    return km->kind == KMON_SOCKET ? km->fd : -1;
+}
+
+ssize_t kmon_read_raw(struct kmon *km, void *buf, size_t len)
+{
+    char *p = buf;
+    size_t used = 0;
+    int fd, err;
+
+    if (km->kind != KMON_TEXT) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len < 2) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    /*
+     * The seq_file interface returns large outputs in several chunks, so
+     * the file is read until EOF.
+     */
+    fd = open(km->path, O_RDONLY | O_CLOEXEC);
+    km->syscalls += 2;          /* The open and the close */
+    if (fd < 0)
+        return -1;
+    for (;;) {
+        ssize_t n;
+
+        if (used == len - 1) {
+            close(fd);
+            errno = ENOBUFS;
+            return -1;
+        }
+        n = read(fd, p + used, len - 1 - used);
+        km->syscalls++;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        used += n;
+    }
+    close(fd);
+
+    p[used] = '\0';
+    km->bytes += used;
+    return used;
+}
+
+/**
+ * skip_label - Match a line against a label and return the text after it
+ * @line: Line to examine
+ * @label: Expected prefix, leading whitespace in @line is ignored
+ *
+ * Return: Pointer just past the label, or NULL if @line does not match
+ */
+static const char *skip_label(const char *line, const char *label)
+{
+    size_t n = strlen(label);
+
+    while (*line == ' ')
+        line++;
+    return strncmp(line, label, n) == 0 ? line + n : NULL;
+}
+
+/**
+ * parse_header - Map the process table header to its numeric columns
+ * @line: Header row after the leading "Name"
+ * @snap: Snapshot receiving the columns in print order
+ *
+ * Every word of the header names a column, except for units in
+ * parentheses. Names are matched whole, so "PID" does not match "PPID".
+ * A word this build does not know still takes a slot, so that the values
+ * of a newer module's extra column are skipped instead of shifting the
+ * known ones.
+ */
+static void parse_header(const char *line, struct kmon_snapshot *snap)
+{
+    snap->ncols = 0;
+    snap->has_rss = snap->has_cpu = snap->has_uid = 0;
+
+    while (snap->ncols < KMON_MAX_COLS) {
+        size_t n;
+        int c;
+
+        while (*line == ' ')
+            line++;
+        if (!*line)
+            break;
+        n = strcspn(line, " ");
+        if (*line != '(') {
+            for (c = 0; c < TASK_COL_MAX; c++)
+                if (strlen(task_col_names[c]) == n &&
+                    strncmp(line, task_col_names[c], n) == 0)
+                    break;
+            snap->cols[snap->ncols++] = c;
+            if (c == TASK_COL_RSS)
+                snap->has_rss = 1;
+            else if (c == TASK_COL_CPU)
+                snap->has_cpu = 1;
+            else if (c == TASK_COL_UID)
+                snap->has_uid = 1;
+        }
+        line += n;
+    }
+}
+
+/**
+ * parse_text - Parse the module's text output into a snapshot
+ * @buf: NUL-terminated output, modified in place
+ * @snap: Snapshot to fill
+ *
+ * The system figures are parsed here; the process table is only located,
+ * and its rows are decoded later by kmon_next_task().
+ *
+ * Return: 0 on success, -1 if the output does not look like module data
+ */
+static int parse_text(char *buf, struct kmon_snapshot *snap)
+{
+    int found = 0;
+    char *line = buf;
+
+    snap->format = KMON_FORMAT_TEXT;
+    snap->ncols = 0;
+    snap->pos = snap->end = NULL;
+
+    while (line && *line) {
+        char *next = strchr(line, '\n');
+        const char *val;
+
+        if (next)
+            *next++ = '\0';
+
+        if ((val = skip_label(line, "Sample Time:"))) {
+            snap->collected = strtoull(val, NULL, 10) / 1e9;
+        } else if ((val = skip_label(line, "User Time:"))) {
+            snap->cpu_user = strtoull(val, NULL, 10);
+            found++;
+        } else if ((val = skip_label(line, "System Time:"))) {
+            snap->cpu_system = strtoull(val, NULL, 10);
+        } else if ((val = skip_label(line, "Idle Time:"))) {
+            snap->cpu_idle = strtoull(val, NULL, 10);
+        } else if ((val = skip_label(line, "Total RAM:"))) {
+            snap->total_ram = strtoul(val, NULL, 10);
+            found++;
+        } else if ((val = skip_label(line, "Free RAM:"))) {
+            snap->free_ram = strtoul(val, NULL, 10);
+        } else if ((val = skip_label(line, "Shared RAM:"))) {
+            snap->shared_ram = strtoul(val, NULL, 10);
+        } else if ((val = skip_label(line, "Buffer RAM:"))) {
+            snap->buffer_ram = strtoul(val, NULL, 10);
+        } else if ((val = skip_label(line, "Total Processes:"))) {
+            snap->total_processes = strtoul(val, NULL, 10);
+        } else if ((val = skip_label(line, "Collection Time:"))) {
+            snap->collect_ns = strtoull(val, NULL, 10);
+        } else if ((val = skip_label(line, "Collections:"))) {
+            sscanf(val, "%llu, %llu", &snap->collections, &snap->collect_total_ns);
+        } else if (strncmp(line, "Name", 4) == 0 && !snap->pos) {
+            parse_header(line + 4, snap);
+        } else if (strncmp(line, "---", 3) == 0 && snap->ncols && !snap->pos && next) {
+            /* The table runs up to the first empty line */
+            char *blank = *next == '\n' ? next - 1 : strstr(next, "\n\n");
+
+            snap->pos = next;
+            snap->end = blank ? blank + 1 : next + strlen(next);
+            next = *snap->end ? snap->end + 1 : snap->end;
+        } else if (strncmp(line, "Process Information:", 20) == 0) {
+            found++;
+        }
+
+        line = next;
+    }
+
+    if (found < 3 || snap->ncols == 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (!snap->pos)
+        snap->pos = snap->end = line;
+    return 0;
+}
+
+/**
+ * parse_task_line - Parse one row of the process table
+ * @line: NUL-terminated row, modified in place
+ * @cols: Column indices present, in print order; TASK_COL_MAX for a
+ *        column this build does not know
+ * @ncols: Number of entries in @cols
+ * @task: Output task
+ *
+ * The task name is left-aligned and may contain spaces, so the numeric
+ * columns are taken from the right-hand end of the line.
+ *
+ * Return: 0 on success, -1 on a malformed row
+ */
+static int parse_task_line(char *line, const int *cols, int ncols,
+                           struct kmon_task *task)
+{
+    char *end = line + strlen(line);
+    int i;
+
+    memset(task, 0, sizeof(*task));
+    for (i = ncols - 1; i >= 0; i--) {
+        char *tok;
+        unsigned long long val;
+
+        while (end > line && end[-1] == ' ')
+            end--;
+        tok = end;
+        while (tok > line && tok[-1] != ' ')
+            tok--;
+        if (tok == end)
+            return -1;
+
+        *end = '\0';
+        errno = 0;
+        val = strtoull(tok, NULL, 10);
+        if (errno)
+            return -1;
+        end = tok;
+
+        switch (cols[i]) {
+        case TASK_COL_PID:
+            task->pid = (int)val;
+            break;
+        case TASK_COL_MEM:
+            task->mem_kb = val;
+            break;
+        case TASK_COL_RSS:
+            task->rss_kb = val;
+            break;
+        case TASK_COL_START:
+            task->start_time = val;
+            break;
+        case TASK_COL_CPU:
+            task->cpu_ns = val;
+            break;
+        case TASK_COL_PPID:
+            task->ppid = (int)val;
+            break;
+        case TASK_COL_UID:
+            task->uid = (unsigned int)val;
+            break;
+        default:
+            break;
+        }
+    }
+
+    while (end > line && end[-1] == ' ')
+        end--;
+    *end = '\0';
+    snprintf(task->comm, sizeof(task->comm), "%s", line);
+    return 0;
+}
+
+/**
+ * read_text - Read and parse the module's text output
+ * @km: Text source
+ * @buf: Caller's buffer
+ * @len: Size of @buf
+ * @snap: Snapshot to fill
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int read_text(struct kmon *km, char *buf, size_t len, struct kmon_snapshot *snap)
+{
+    if (kmon_read_raw(km, buf, len) < 0) {
+        if (errno == ENOBUFS)
+            snap->needed = len < KMON_MIN_BUFFER ? KMON_MIN_BUFFER : len * 2;
+        return -1;
+    }
+    snap->timestamp = monotonic_seconds();
+    snap->seq = ++km->seq;
+    return parse_text(buf, snap);
+}
+
+/**
+ * read_at - Read the start of a file below the procfs directory
+ * @km: Procfs source, charged with the system calls and bytes
+ * @name: Relative path
+ * @buf: Destination, NUL-terminated on success
+ * @len: Size of @buf
+ *
+ * Return: Number of bytes read, or -1 on failure
+ */
+static ssize_t read_at(struct kmon *km, const char *name, char *buf, size_t len)
+{
+    size_t used = 0;
+    int fd = openat(km->fd, name, O_RDONLY | O_CLOEXEC);
+
+    km->syscalls += 2;          /* The open and the close */
+    if (fd < 0)
+        return -1;
+    while (used < len - 1) {
+        ssize_t n = read(fd, buf + used, len - 1 - used);
+
+        km->syscalls++;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            int err = errno;
+
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        used += n;
+    }
+    close(fd);
+    buf[used] = '\0';
+    km->bytes += used;
+    return used;
+}
+
+/**
+ * procfs_field - Find a labelled line in a procfs file
+ * @buf: NUL-terminated file contents
+ * @label: Label at the start of the line, including its separator
+ *
+ * Return: Text after the label, or NULL if no line carries it
+ */
+static const char *procfs_field(const char *buf, const char *label)
+{
+    size_t n = strlen(label);
+    const char *line = buf;
+
+    while (line) {
+        if (strncmp(line, label, n) == 0)
+            return line + n;
+        line = strchr(line, '\n');
+        if (line)
+            line++;
+    }
+    return NULL;
+}
+
+/**
+ * procfs_system - Fill the CPU and memory figures from /proc/stat and /proc/meminfo
+ * @km: Procfs source
+ * @file: Scratch buffer of PROCFS_FILE_BUF bytes
+ * @snap: Snapshot to fill
+ *
+ * CPU 0 times are converted from clock ticks to ns and memory from KB to
+ * pages, matching what the module reports.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int procfs_system(struct kmon *km, char *file, struct kmon_snapshot *snap)
+{
+    unsigned long long user, nice, system, idle;
+    const char *p;
+
+    if (read_at(km, "stat", file, PROCFS_FILE_BUF) < 0)
+        return -1;
+    p = procfs_field(file, "cpu0 ");
+    if (!p || sscanf(p, "%llu %llu %llu %llu", &user, &nice, &system, &idle) != 4) {
+        errno = EPROTO;
+        return -1;
+    }
+    snap->cpu_user = user * km->tick_ns;
+    snap->cpu_system = system * km->tick_ns;
+    snap->cpu_idle = idle * km->tick_ns;
+
+    if (read_at(km, "meminfo", file, PROCFS_FILE_BUF) < 0)
+        return -1;
+    p = procfs_field(file, "MemTotal:");
+    if (!p) {
+        errno = EPROTO;
+        return -1;
+    }
+    snap->total_ram = strtoul(p, NULL, 10) / km->page_kb;
+    if ((p = procfs_field(file, "MemFree:")))
+        snap->free_ram = strtoul(p, NULL, 10) / km->page_kb;
+    if ((p = procfs_field(file, "Shmem:")))
+        snap->shared_ram = strtoul(p, NULL, 10) / km->page_kb;
+    if ((p = procfs_field(file, "Buffers:")))
+        snap->buffer_ram = strtoul(p, NULL, 10) / km->page_kb;
+    return 0;
+}
+
+/**
+ * procfs_parse_stat - Decode /proc/PID/stat into a task record
+ * @km: Procfs source
+ * @buf: NUL-terminated file contents
+ * @wt: Record to fill
+ *
+ * The name sits in parentheses and may itself contain spaces and
+ * parentheses, so the fields are counted from the last ')'.
+ *
+ * Return: 0 on success, -1 on a malformed line or a task without memory
+ */
+static int procfs_parse_stat(const struct kmon *km, const char *buf,
+                             struct kmon_wire_task *wt)
+{
+    const char *open = strchr(buf, '(');
+    const char *close = strrchr(buf, ')');
+    unsigned long long vsize, start = 0, utime = 0, stime = 0;
+    long rss;
+    size_t n;
+    int field;
+
+    if (!open || !close || close < open)
+        return -1;
+
+    memset(wt, 0, sizeof(*wt));
+    wt->pid = (int32_t)strtol(buf, NULL, 10);
+    n = close - open - 1;
+    if (n > sizeof(wt->comm) - 1)
+        n = sizeof(wt->comm) - 1;
+    memcpy(wt->comm, open + 1, n);
+
+    /*
+     * Field 3 (state) follows ") " and the parent pid is field 4; utime and
+     * stime are fields 14 and 15, starttime is field 22, vsize and rss are
+     * fields 23 and 24
+     */
+    buf = close + 1;
+    for (field = 3; field <= 23; field++) {
+        buf = strchr(buf, ' ');
+        if (!buf)
+            return -1;
+        buf++;
+        if (field == 4)
+            wt->ppid = (int32_t)strtol(buf, NULL, 10);
+        else if (field == 14)
+            utime = strtoull(buf, NULL, 10);
+        else if (field == 15)
+            stime = strtoull(buf, NULL, 10);
+        else if (field == 22)
+            start = strtoull(buf, NULL, 10);
+    }
+    vsize = strtoull(buf, (char **)&buf, 10);
+    rss = strtol(buf, NULL, 10);
+
+    /* Kernel threads have no address space; the module skips them too */
+    if (!vsize)
+        return -1;
+    wt->mem_kb = vsize / 1024;
+    wt->rss_kb = rss > 0 ? (unsigned long)rss * km->page_kb : 0;
+    wt->start_time = start * km->tick_ns;
+    wt->cpu_ns = (utime + stime) * km->tick_ns;
+    return 0;
+}
+
+/**
+ * procfs_uid - Fill in a task's user ID
+ * @km: Procfs source
+ * @name: Path of a file under /proc/PID, relative to the source's directory
+ * @wt: Record to fill
+ *
+ * Procfs files belong to the process's effective uid.
+ *
+ * Return: 0 on success, -1 if the process is gone
+ */
+static int procfs_uid(struct kmon *km, const char *name, struct kmon_wire_task *wt)
+{
+    struct stat st;
+
+    km->syscalls++;
+    if (fstatat(km->fd, name, &st, 0) < 0)
+        return -1;
+    wt->uid = st.st_uid;
+    return 0;
+}
+
+#ifdef KMON_HAVE_URING
+/**
+ * uring_read_batch - Read a batch of /proc/PID/stat files through io_uring
+ * @km: Procfs source with an io_uring instance
+ * @n: Files in the ring's path slots
+ *
+ * Results land in @u->res: the length read into @u->bufs, or a negative
+ * errno for a file that could not be opened or read. The owner of each
+ * file, which is the process's effective uid, lands in @u->stx with its
+ * status in @u->stx_res.
+ *
+ * Return: 0 on success, -1 if the batch could not be submitted
+ */
+static int uring_read_batch(struct kmon *km, unsigned n)
+{
+    struct kmon_uring *u = km->uring;
+    int dirfd = km->fd;
+    unsigned tail = *u->sq_tail;
+    unsigned mask = *u->sq_mask;
+    unsigned submit = 4 * n, pending = 4 * n;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe;
+        unsigned slot;
+
+        u->res[i] = -ECANCELED;
+        u->stx_res[i] = -ECANCELED;
+
+        slot = tail++ & mask;
+        sqe = &u->sqes[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = dirfd;
+        sqe->addr = (uintptr_t)u->paths[i];
+        /* Direct descriptors never enter the fd table; O_CLOEXEC is refused */
+        sqe->open_flags = O_RDONLY;
+        sqe->file_index = i + 1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = 4 * i;
+        u->sq_array[slot] = slot;
+
+        slot = tail++ & mask;
+        sqe = &u->sqes[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = i;
+        sqe->addr = (uintptr_t)u->bufs[i];
+        sqe->len = URING_FILE_BUF - 1;
+        sqe->buf_index = 0;
+        /* Close the slot even if the read fails */
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        sqe->user_data = 4 * i + 1;
+        u->sq_array[slot] = slot;
+
+        slot = tail++ & mask;
+        sqe = &u->sqes[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = i + 1;
+        sqe->user_data = 4 * i + 2;
+        u->sq_array[slot] = slot;
+
+        /* Outside the chain: statx takes a path, not a direct descriptor */
+        slot = tail++ & mask;
+        sqe = &u->sqes[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirfd;
+        sqe->addr = (uintptr_t)u->paths[i];
+        sqe->len = STATX_UID;
+        sqe->off = (uintptr_t)&u->stx[i];
+        sqe->user_data = 4 * i + 3;
+        u->sq_array[slot] = slot;
+    }
+    __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+    while (pending) {
+        unsigned head, cq_tail;
+        long r;
+
+        r = syscall(SYS_io_uring_enter, u->fd, submit, pending,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+        km->syscalls++;
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        submit -= r;
+
+        head = *u->cq_head;
+        cq_tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++, pending--) {
+            const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            unsigned file = cqe->user_data / 4;
+
+            /* The open's error wins over the cancelled read behind it */
+            if (cqe->user_data % 4 == 0 && cqe->res < 0)
+                u->res[file] = cqe->res;
+            else if (cqe->user_data % 4 == 1 && u->res[file] == -ECANCELED)
+                u->res[file] = cqe->res;
+            else if (cqe->user_data % 4 == 3)
+                u->stx_res[file] = cqe->res;
+            if (cqe->user_data % 4 == 1 && cqe->res > 0)
+                km->bytes += cqe->res;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+#endif
+
+/**
+ * procfs_flush - Turn a batch of queued /proc/PID/stat files into task records
+ * @km: Procfs source with an io_uring instance
+ * @n: Files queued in the ring's path slots
+ * @out: Next free record in the caller's buffer
+ * @file: Scratch buffer of PROCFS_FILE_BUF bytes
+ *
+ * A kernel without direct descriptor support fails the opens with
+ * EINVAL; the batch is then read with plain syscalls and io_uring is
+ * switched off for the source.
+ *
+ * Return: Number of records written, or -1 on failure
+ */
+static long procfs_flush(struct kmon *km, unsigned n, char *out, char *file)
+{
+#ifdef KMON_HAVE_URING
+    struct kmon_uring *u = km->uring;
+    long nr = 0;
+    int fallback = 0;
+    unsigned i;
+
+    if (uring_read_batch(km, n) < 0) {
+        if (errno != EINVAL && errno != EOPNOTSUPP)
+            return -1;
+        fallback = 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        struct kmon_wire_task wt;
+        const char *text = u->bufs[i];
+        int res = u->res[i];
+
+        if (fallback || res == -EINVAL || res == -EOPNOTSUPP) {
+            fallback = 1;
+            if (read_at(km, u->paths[i], file, PROCFS_FILE_BUF) <= 0 ||
+                procfs_parse_stat(km, file, &wt) < 0 ||
+                procfs_uid(km, u->paths[i], &wt) < 0)
+                continue;
+        } else if (res <= 0 || u->stx_res[i] < 0) {
+            /* The process exited after the listing */
+            continue;
+        } else {
+            u->bufs[i][res] = '\0';
+            if (procfs_parse_stat(km, text, &wt) < 0)
+                continue;
+            wt.uid = u->stx[i].stx_uid;
+        }
+        memcpy(out + nr * sizeof(wt), &wt, sizeof(wt));
+        nr++;
+    }
+    if (fallback)
+        uring_close(km);
+    return nr;
+#else
+    (void)km; (void)n; (void)out; (void)file;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * read_procfs - Build a snapshot from the standard procfs files
+ * @km: Procfs source
+ * @buf: Caller's buffer; task records fill it from the front and the
+ *       last PROCFS_SCRATCH bytes hold directory entries and file reads
+ * @len: Size of @buf
+ * @snap: Snapshot to fill
+ *
+ * With io_uring, files are queued while the directory is listed and read
+ * URING_BATCH at a time, so a batch costs one io_uring_enter() instead of
+ * four syscalls per process.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int read_procfs(struct kmon *km, char *buf, size_t len, struct kmon_snapshot *snap)
+{
+    const size_t rec = sizeof(struct kmon_wire_task);
+    char *dents, *file;
+    size_t room, nr = 0, missing = 0;
+    unsigned queued = 0;
+    long got;
+
+    if (len < PROCFS_SCRATCH + 2 * sizeof(uint64_t) + rec) {
+        snap->needed = PROCFS_SCRATCH + 2 * sizeof(uint64_t) + PROCFS_MIN_TASKS * rec;
+        errno = ENOBUFS;
+        return -1;
+    }
+    /* Directory entries hold 64-bit fields, keep them aligned */
+    dents = (char *)(((uintptr_t)buf + len - PROCFS_SCRATCH) & ~(uintptr_t)7);
+    file = dents + PROCFS_DENT_BUF;
+    room = (dents - buf) / rec;
+
+    /* The files are read one after another; date the sample by its start */
+    snap->collected = monotonic_seconds();
+    if (procfs_system(km, file, snap) < 0)
+        return -1;
+
+    km->syscalls++;
+    if (lseek(km->fd, 0, SEEK_SET) < 0)
+        return -1;
+    for (;;) {
+        long n = syscall(SYS_getdents64, km->fd, dents, PROCFS_DENT_BUF);
+        long off;
+
+        km->syscalls++;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+
+        for (off = 0; off < n; ) {
+            const struct procfs_dirent *d = (const struct procfs_dirent *)(dents + off);
+            struct kmon_wire_task wt;
+            char path[32];
+
+            off += d->d_reclen;
+            if (d->d_name[0] < '1' || d->d_name[0] > '9')
+                continue;
+            if (nr + queued == room) {
+                missing++;
+                continue;
+            }
+#ifdef KMON_HAVE_URING
+            if (km->uring) {
+                snprintf(km->uring->paths[queued], sizeof(km->uring->paths[0]),
+                         "%s/stat", d->d_name);
+                if (++queued < URING_BATCH)
+                    continue;
+                got = procfs_flush(km, queued, buf + nr * rec, file);
+                if (got < 0)
+                    return -1;
+                nr += got;
+                queued = 0;
+                continue;
+            }
+#endif
+            snprintf(path, sizeof(path), "%s/stat", d->d_name);
+            /* Processes may exit between the listing and the read */
+            if (read_at(km, path, file, PROCFS_FILE_BUF) <= 0 ||
+                procfs_parse_stat(km, file, &wt) < 0 ||
+                procfs_uid(km, path, &wt) < 0)
+                continue;
+            memcpy(buf + nr * rec, &wt, rec);
+            nr++;
+        }
+    }
+    if (queued) {
+        got = procfs_flush(km, queued, buf + nr * rec, file);
+        if (got < 0)
+            return -1;
+        nr += got;
+    }
+
+    if (missing) {
+        /* Leave headroom for processes started before the retry */
+        snap->needed = len + (missing + missing / 4 + 16) * rec;
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    snap->timestamp = monotonic_seconds();
+    snap->seq = ++km->seq;
+    snap->total_processes = nr;
+    snap->has_rss = 1;
+    snap->has_cpu = 1;
+    snap->has_uid = 1;
+    snap->format = KMON_FORMAT_WIRE;
+    snap->pos = buf;
+    snap->end = buf + nr * rec;
+    return 0;
+}
+
+/**
+ * wire_check - Validate an encoded sample header
+ * @h: Header
+ *
+ * Return: 0 if this build can decode it, -1 otherwise
+ */
+static int wire_check(const struct kmon_wire_header *h)
+{
+    if (h->magic != KMON_WIRE_MAGIC || h->version != KMON_WIRE_VERSION ||
+        h->header_size != sizeof(*h) || h->task_size != sizeof(struct kmon_wire_task))
+        return -1;
+    return 0;
+}
+
+/**
+ * wire_snapshot - Fill a snapshot from an encoded sample
+ * @km: Source, for sequence tracking
+ * @h: Validated header
+ * @tasks: Task records, already in the caller's buffer
+ * @snap: Snapshot to fill
+ */
+static void wire_snapshot(struct kmon *km, const struct kmon_wire_header *h,
+                          char *tasks, struct kmon_snapshot *snap)
+{
+    snap->missed = km->seq && h->seq > km->seq + 1 ? h->seq - km->seq - 1 : 0;
+    km->seq = h->seq;
+
+    snap->seq = h->seq;
+    snap->timestamp = h->timestamp;
+    snap->collected = h->collected;
+    snap->collect_ns = h->collect_ns;
+    snap->collections = h->collections;
+    snap->collect_total_ns = h->collect_total_ns;
+    snap->cpu_user = h->cpu_user;
+    snap->cpu_system = h->cpu_system;
+    snap->cpu_idle = h->cpu_idle;
+    snap->total_ram = h->total_ram;
+    snap->free_ram = h->free_ram;
+    snap->shared_ram = h->shared_ram;
+    snap->buffer_ram = h->buffer_ram;
+    snap->total_processes = h->total_processes;
+    snap->has_rss = h->has_rss;
+    snap->dropped_tasks = h->dropped_tasks;
+    snap->has_cpu = h->has_cpu;
+    snap->has_uid = h->has_uid;
+    snap->format = KMON_FORMAT_WIRE;
+    snap->pos = tasks;
+    snap->end = tasks + (size_t)h->nr_tasks * sizeof(struct kmon_wire_task);
+}
+
+/**
+ * read_full - Read exactly the requested number of bytes from a daemon
+ * @km: Socket source
+ * @buf: Destination
+ * @len: Number of bytes
+ *
+ * Return: 0 on success, -1 on error or end of file (ECONNRESET)
+ */
+static int read_full(struct kmon *km, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len) {
+        ssize_t n = read(km->fd, p, len);
+
+        km->syscalls++;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0)
+            errno = ECONNRESET;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+        km->bytes += n;
+    }
+    return 0;
+}
+
+/**
+ * read_socket - Receive one sample from a fan-out daemon
+ * @km: Socket source
+ * @buf: Caller's buffer, receiving the task records
+ * @len: Size of @buf
+ * @snap: Snapshot to fill
+ *
+ * If the records do not fit, the header is kept so that the call can be
+ * repeated with a larger buffer without losing the sample.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int read_socket(struct kmon *km, char *buf, size_t len, struct kmon_snapshot *snap)
+{
+    struct kmon_wire_header *h = &km->pending;
+    size_t need;
+
+    if (!km->has_pending) {
+        if (read_full(km, h, sizeof(*h)) < 0)
+            return -1;
+        if (wire_check(h) < 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        km->has_pending = 1;
+    }
+
+    need = (size_t)h->nr_tasks * sizeof(struct kmon_wire_task);
+    if (len < need) {
+        snap->needed = need;
+        errno = ENOBUFS;
+        return -1;
+    }
+    km->has_pending = 0;
+    if (read_full(km, buf, need) < 0)
+        return -1;
+
+    wire_snapshot(km, h, buf, snap);
+    return 0;
+}
+
+/**
+ * read_shm - Read the latest sample from shared memory
+ * @km: Shared memory source
+ * @buf: Caller's buffer, receiving the task records; NULL to read in place
+ * @len: Size of @buf
+ * @snap: Snapshot to fill
+ *
+ * A copy is checked against the sequence counter before returning. An
+ * in-place snapshot only checks the header here and leaves the task
+ * records to kmon_snapshot_valid().
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int read_shm(struct kmon *km, char *buf, size_t len, struct kmon_snapshot *snap)
+{
+    const struct kmon_shm_header *hdr = km->shm;
+    const struct kmon_wire_header *h = (const struct kmon_wire_header *)(hdr + 1);
+    struct kmon_wire_header copy;
+    int tries;
+
+    for (tries = 0; tries < SHM_READ_RETRIES; tries++) {
+        uint32_t seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+        size_t need = 0;
+        int valid;
+
+        if (seq & 1) {
+            sched_yield();
+            km->syscalls++;
+            continue;
+        }
+        /* Check a private copy so a torn task count cannot overrun the mapping */
+        memcpy(&copy, h, sizeof(copy));
+        valid = seq != 0 && wire_check(&copy) == 0 && copy.nr_tasks <= hdr->capacity;
+        if (valid && buf) {
+            need = (size_t)copy.nr_tasks * sizeof(struct kmon_wire_task);
+            if (need <= len)
+                memcpy(buf, h + 1, need);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+
+        if (!valid) {
+            errno = ENODATA;
+            return -1;
+        }
+        if (!buf) {
+            km->bytes += sizeof(copy);
+            wire_snapshot(km, &copy, (char *)(h + 1), snap);
+            snap->shm_seq = &hdr->seq;
+            snap->shm_start = seq;
+            return 0;
+        }
+        if (need > len) {
+            snap->needed = (size_t)hdr->capacity * sizeof(struct kmon_wire_task);
+            errno = ENOBUFS;
+            return -1;
+        }
+        km->bytes += sizeof(copy) + need;
+        wire_snapshot(km, &copy, buf, snap);
+        return 0;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+int kmon_read(struct kmon *km, void *buf, size_t len, struct kmon_snapshot *snap)
+{
+    int ret;
+
+    memset(snap, 0, sizeof(*snap));
+    km->syscalls = 0;
+    km->bytes = 0;
+    if (!buf && len && km->kind != KMON_SHM) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    switch (km->kind) {
+    case KMON_SOCKET:
+        ret = read_socket(km, buf, len, snap);
+        break;
+    case KMON_SHM:
+        ret = read_shm(km, buf, len, snap);
+        break;
+    case KMON_PROCFS:
+        ret = read_procfs(km, buf, len, snap);
+        break;
+    default:
+        ret = read_text(km, buf, len, snap);
+        break;
+    }
+    snap->syscalls = km->syscalls;
+    snap->bytes = km->bytes;
+    return ret;
+}
+
+int kmon_snapshot_valid(const struct kmon_snapshot *snap)
+{
+    if (!snap->shm_seq)
+        return 1;
+    /* Order the task loads before the second look at the counter */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(snap->shm_seq, __ATOMIC_RELAXED) == snap->shm_start;
+}
+
+int kmon_next_task(struct kmon_snapshot *snap, struct kmon_task *task)
+{
+    if (snap->format == KMON_FORMAT_WIRE) {
+        struct kmon_wire_task wt;
+
+        if (snap->pos >= snap->end)
+            return 0;
+        memcpy(&wt, snap->pos, sizeof(wt));
+        snap->pos += sizeof(wt);
+
+        memcpy(task->comm, wt.comm, sizeof(task->comm));
+        task->comm[sizeof(task->comm) - 1] = '\0';
+        task->pid = wt.pid;
+        task->mem_kb = wt.mem_kb;
+        task->rss_kb = wt.rss_kb;
+        task->start_time = wt.start_time;
+        task->cpu_ns = wt.cpu_ns;
+        task->ppid = wt.ppid;
+        task->uid = wt.uid;
+        return 1;
+    }
+
+    while (snap->pos < snap->end) {
+        char *line = snap->pos;
+        char *nl = memchr(line, '\n', snap->end - line);
+
+        if (nl) {
+            *nl = '\0';
+            snap->pos = nl + 1;
+        } else {
+            snap->pos = snap->end;
+        }
+        if (*line && parse_task_line(line, snap->cols, snap->ncols, task) == 0)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,342 @@
+/**
+ * @file kmon.h
+ * @brief Snapshot API for Linux Kernel Monitor data (libkmon)
+ *
+ * libkmon reads samples from the kernel monitor module, from standard
+ * procfs files when the module is not loaded, from a monitor_app fan-out
+ * daemon or from a shared memory snapshot, and hands them out one
+ * snapshot at a time. The caller owns all memory: the handle,
+ * the read buffer and the task records are provided by the caller, and
+ * the library never allocates.
+ *
+ * Typical use:
+ *
+ *     struct kmon km;
+ *     struct kmon_snapshot snap;
+ *     struct kmon_task task;
+ *     static char buf[1 << 20];
+ *
+ *     if (kmon_open(&km, NULL) < 0)
+ *         return -1;
+ *     if (kmon_read(&km, buf, sizeof(buf), &snap) == 0)
+ *         while (kmon_next_task(&snap, &task) > 0)
+ *             printf("%d %s %lu\n", task.pid, task.comm, task.rss_kb);
+ *     kmon_close(&km);
+ *
+ * Functions return -1 and set errno on failure.
+ */
+
+#ifndef KMON_H
+#define KMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define KMON_PROC_PATH      "/proc/kernel_monitor"
+#define KMON_COMM_LEN       16          /* Matches the kernel's comm size */
+#define KMON_MAX_COLS       8           /* Numeric task columns understood */
+
+/* Fan-out protocol and shared memory layout */
+#define KMON_WIRE_MAGIC     0x4E4F4D4Bu /* "KMON" in little-endian byte order */
+#define KMON_WIRE_VERSION   7
+#define KMON_SHM_MAGIC      0x48534D4Bu /* "KMSH" in little-endian byte order */
+#define KMON_SHM_VERSION    1
+
+/**
+ * struct kmon_wire_header - Sample header of the fan-out protocol
+ * @magic: KMON_WIRE_MAGIC
+ * @version: KMON_WIRE_VERSION
+ * @header_size: sizeof(struct kmon_wire_header)
+ * @task_size: sizeof(struct kmon_wire_task)
+ * @nr_tasks: Task records following the header
+ * @seq: Sample sequence number; gaps mean samples were dropped
+ * @timestamp: CLOCK_MONOTONIC time of the read, in seconds
+ * @collected: CLOCK_MONOTONIC time the source collected the sample
+ * @collect_ns: Time the module took to collect the sample, 0 if unknown
+ * @collections: Samples the module has collected since it was loaded
+ * @collect_total_ns: Time the module spent on them
+ *
+ * Remaining fields mirror struct kmon_snapshot. The protocol only runs
+ * over a local socket, so integers use the host's byte order; the size
+ * fields let either side reject a peer built with a different layout.
+ */
+struct kmon_wire_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t task_size;
+    uint32_t nr_tasks;
+    uint64_t seq;
+    double timestamp;
+    double collected;
+    uint64_t collect_ns;
+    uint64_t collections;
+    uint64_t collect_total_ns;
+    uint64_t cpu_user;
+    uint64_t cpu_system;
+    uint64_t cpu_idle;
+    uint64_t total_ram;
+    uint64_t free_ram;
+    uint64_t shared_ram;
+    uint64_t buffer_ram;
+    uint64_t total_processes;
+    uint32_t has_rss;
+    uint32_t dropped_tasks;
+    uint32_t has_cpu;
+    uint32_t has_uid;
+};
+
+/**
+ * struct kmon_wire_task - Task record of the fan-out protocol
+ * @comm: Task name, NUL-padded
+ * @pid: Process ID
+ * @ppid: Parent process ID, 0 if unknown
+ * @mem_kb: Virtual memory size in KB
+ * @rss_kb: Resident set size in KB
+ * @start_time: Start time in ns since boot, 0 if unknown
+ * @cpu_ns: User and system CPU time in ns, 0 if unknown
+ * @uid: Effective user ID, 0 if unknown
+ * @reserved: Zero
+ */
+struct kmon_wire_task {
+    char comm[KMON_COMM_LEN];
+    int32_t pid;
+    int32_t ppid;
+    uint64_t mem_kb;
+    uint64_t rss_kb;
+    uint64_t start_time;
+    uint64_t cpu_ns;
+    uint32_t uid;
+    uint32_t reserved;
+};
+
+/**
+ * struct kmon_shm_header - Header of the shared memory snapshot
+ * @magic: KMON_SHM_MAGIC
+ * @version: KMON_SHM_VERSION
+ * @header_size: sizeof(struct kmon_shm_header)
+ * @capacity: Task records the segment has room for
+ * @seq: Seqlock counter; odd while the snapshot is being rewritten
+ *
+ * The header is followed by a struct kmon_wire_header and its task
+ * records, rewritten in place for every sample. Readers load @seq, skip
+ * the read while it is odd, read the snapshot and then check that @seq
+ * did not change; otherwise they retry. The writer never waits for
+ * readers, so its cost does not depend on how many there are.
+ */
+struct kmon_shm_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t capacity;
+    uint32_t seq;
+};
+
+struct kmon_uring;
+
+/**
+ * struct kmon - Open sample source
+ *
+ * Allocated by the caller; all fields are private.
+ */
+struct kmon {
+    int kind;
+    int fd;
+    struct kmon_uring *uring;
+    unsigned long syscalls;
+    size_t bytes;
+    unsigned long page_kb;
+    unsigned long tick_ns;
+    char path[108];
+    const struct kmon_shm_header *shm;
+    size_t shm_size;
+    struct kmon_wire_header pending;
+    int has_pending;
+    uint64_t seq;
+};
+
+/**
+ * struct kmon_task - One row of the process table
+ * @comm: Task name
+ * @pid: Process ID
+ * @mem_kb: Virtual memory size in KB
+ * @rss_kb: Resident set size in KB (0 if the module does not report it)
+ * @start_time: Start time in ns since boot (0 if the source does not
+ *              report it). Together with @pid it identifies a process
+ *              across samples even when pids are reused.
+ * @cpu_ns: User and system CPU time of all threads in ns (0 if the source
+ *          does not report it)
+ * @ppid: Parent process ID (0 if the source does not report it)
+ * @uid: Effective user ID (0 if the source does not report it)
+ */
+struct kmon_task {
+    char comm[KMON_COMM_LEN];
+    int pid;
+    unsigned long mem_kb;
+    unsigned long rss_kb;
+    unsigned long long start_time;
+    unsigned long long cpu_ns;
+    int ppid;
+    unsigned int uid;
+};
+
+/**
+ * struct kmon_snapshot - One sample
+ * @seq: Sample sequence number
+ * @missed: Samples skipped since the previous read (daemon sources only)
+ * @timestamp: CLOCK_MONOTONIC time of the read, in seconds
+ * @collected: CLOCK_MONOTONIC time the source collected the sample, in
+ *             seconds; 0 for modules that do not report it
+ * @collect_ns: Time the module took to collect this sample, 0 if it does
+ *              not report its cost
+ * @collections: Samples the module has collected since it was loaded, for
+ *               all of its readers
+ * @collect_total_ns: Time the module spent collecting them
+ * @syscalls: System calls kmon_read() made for this snapshot
+ * @bytes: Bytes kmon_read() read or copied for this snapshot
+ * @cpu_user: CPU 0 user time in ns
+ * @cpu_system: CPU 0 system time in ns
+ * @cpu_idle: CPU 0 idle time in ns
+ * @total_ram: Total RAM in pages
+ * @free_ram: Free RAM in pages
+ * @shared_ram: Shared RAM in pages
+ * @buffer_ram: Buffer RAM in pages
+ * @total_processes: Process count reported by the module
+ * @has_rss: Non-zero if the module reports an RSS column
+ * @dropped_tasks: Rows the source had to leave out
+ * @has_cpu: Non-zero if the tasks carry their CPU time
+ * @has_uid: Non-zero if the tasks carry their user ID
+ * @needed: After an ENOBUFS failure, a buffer size to retry with
+ *
+ * The task rows stay in the buffer passed to kmon_read(), or in the shared
+ * memory mapping for an in-place read, and are decoded one at a time by
+ * kmon_next_task(); the remaining fields are private iteration state.
+ */
+struct kmon_snapshot {
+    uint64_t seq;
+    uint64_t missed;
+    double timestamp;
+    double collected;
+    unsigned long long collect_ns;
+    unsigned long long collections;
+    unsigned long long collect_total_ns;
+    unsigned long syscalls;
+    size_t bytes;
+    unsigned long long cpu_user;
+    unsigned long long cpu_system;
+    unsigned long long cpu_idle;
+    unsigned long total_ram;
+    unsigned long free_ram;
+    unsigned long shared_ram;
+    unsigned long buffer_ram;
+    unsigned long total_processes;
+    int has_rss;
+    unsigned long dropped_tasks;
+    int has_cpu;
+    int has_uid;
+    size_t needed;
+
+    int format;
+    char *pos;
+    char *end;
+    int cols[KMON_MAX_COLS];
+    int ncols;
+    const uint32_t *shm_seq;
+    uint32_t shm_start;
+};
+
+/**
+ * kmon_open - Open a sample source
+ * @km: Handle to initialize
+ * @source: NULL or a file path for the module's text output (default
+ *          KMON_PROC_PATH), "procfs:[ROOT]" to build samples from the
+ *          standard files under ROOT (default /proc), "unix:PATH" for a
+ *          fan-out daemon socket, or "shm:NAME" for a shared memory snapshot
+ *
+ * A procfs source reads the per-process files in batches through
+ * io_uring when the kernel allows it and with plain syscalls otherwise.
+ * "procfs-sync:[ROOT]" always uses plain syscalls and "procfs-uring:[ROOT]"
+ * fails instead of falling back, which is mostly useful for benchmarks.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int kmon_open(struct kmon *km, const char *source);
+
+/**
+ * kmon_read - Read the next snapshot
+ * @km: Open source
+ * @buf: Buffer receiving the raw sample; keep it until iteration is done
+ * @len: Size of @buf
+ * @snap: Snapshot to fill
+ *
+ * A text source is read afresh. A procfs source reads /proc/stat,
+ * /proc/meminfo and every /proc/PID/stat, using the end of @buf as
+ * scratch space. A daemon socket blocks until the daemon sends the next
+ * sample.
+ *
+ * A shared memory source copies the latest sample into @buf and checks
+ * that the writer did not touch it meanwhile, so the copy can be kept.
+ * With @buf NULL it reads in place instead: the snapshot points into the
+ * mapping, kmon_next_task() decodes straight from it, and nothing is
+ * copied. The writer may rewrite the sample during the iteration, so the
+ * caller must check kmon_snapshot_valid() once it is done and discard
+ * what it decoded if that fails. Other sources treat a NULL @buf of
+ * length 0 as an empty buffer and fail with ENOBUFS.
+ *
+ * Return: 0 on success, -1 on failure. errno is ENOBUFS if @buf is too
+ * small (retry with @snap->needed bytes), EPROTO if the data is not in
+ * a known format, ECONNRESET if the daemon went away, ENODATA if the
+ * shared memory holds no sample yet, EAGAIN if it kept changing while
+ * being read, and EINVAL if @buf is NULL with a non-zero @len for a source
+ * other than shared memory.
+ */
+int kmon_read(struct kmon *km, void *buf, size_t len, struct kmon_snapshot *snap);
+
+/**
+ * kmon_snapshot_valid - Check that an in-place snapshot was not rewritten
+ * @snap: Snapshot filled by kmon_read()
+ *
+ * Call after the last kmon_next_task() of an in-place shared memory read.
+ *
+ * Return: 1 if every task decoded so far is consistent, 0 if the writer
+ * updated the sample meanwhile and the read must be repeated. Snapshots
+ * read into a buffer are always valid.
+ */
+int kmon_snapshot_valid(const struct kmon_snapshot *snap);
+
+/**
+ * kmon_read_raw - Read the module's text output without parsing it
+ * @km: Source opened on a text file
+ * @buf: Buffer receiving the NUL-terminated text
+ * @len: Size of @buf
+ *
+ * Return: Length of the text, or -1 on failure (ENOBUFS if @buf is too
+ * small, EINVAL for daemon sources)
+ */
+ssize_t kmon_read_raw(struct kmon *km, void *buf, size_t len);
+
+/**
+ * kmon_next_task - Decode the next task of a snapshot
+ * @snap: Snapshot filled by kmon_read()
+ * @task: Task to fill
+ *
+ * Return: 1 if @task was filled, 0 at the end of the table
+ */
+int kmon_next_task(struct kmon_snapshot *snap, struct kmon_task *task);
+
+/**
+ * kmon_fd - Descriptor to poll for the next sample
+ * @km: Open source
+ *
+ * Return: Daemon socket, or -1 if the source can be read at any time
+ */
+int kmon_fd(const struct kmon *km);
+
+/**
+ * kmon_close - Release a source
+ * @km: Handle
+ */
+void kmon_close(struct kmon *km);
+
+#endif
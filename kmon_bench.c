@@ -0,0 +1,639 @@
+/**
+ * @file kmon_bench.c
+ * @brief Sampling cost of the libkmon sources versus task count
+ *
+ * Reads the same system through several libkmon sources and reports how
+ * long one sample takes with each: wall time percentiles, the split
+ * between kmon_read() and decoding the task rows, and CPU time split
+ * into user and kernel. By default it compares the kernel module's
+ * /proc/kernel_monitor with the procfs fallback read by plain syscalls
+ * and through io_uring.
+ *
+ * To see how the cost grows with the size of the task table, the
+ * benchmark can spawn idle processes or threads and repeat the
+ * measurement at each requested count. To expose contention in the
+ * source, each measurement can also run with several concurrent readers,
+ * each with its own handle. Results can be appended to a CSV file
+ * labelled with the module version, so runs can be compared across
+ * module versions.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#include "kmon.h"
+
+#define DEFAULT_SAMPLES 200         /* Timed samples per source */
+#define WARMUP_SAMPLES  3           /* Untimed samples that size the buffer */
+#define MAX_TASK_COUNTS 32          /* Entries of --tasks and --readers */
+#define IDLE_STACK_SIZE 65536       /* Stack of each idle thread */
+#define MODULE_VERSION_PATH "/sys/module/kernel_monitor/version"
+
+/**
+ * struct bench_result - Timings of one source
+ * @samples: Samples taken, by all readers together
+ * @tasks: Tasks in the last sample
+ * @wall: Wall time of each sample, seconds
+ * @elapsed: Wall time of the whole measurement, seconds
+ * @read_total: Time spent in kmon_read(), seconds
+ * @decode_total: Time spent decoding task rows, seconds
+ * @user_total: User CPU time of all samples, seconds
+ * @sys_total: Kernel CPU time of all samples, seconds
+ */
+struct bench_result {
+    int samples;
+    unsigned long tasks;
+    double *wall;
+    double elapsed;
+    double read_total;
+    double decode_total;
+    double user_total;
+    double sys_total;
+};
+
+/**
+ * struct bench_reader - One reader thread of a measurement
+ * @thread: Thread running the reader
+ * @spec: Source as accepted by kmon_open()
+ * @samples: Samples to time
+ * @start: Released once every reader is warmed up
+ * @res: Timings of this reader; @res.wall points into the shared array
+ * @buf: Read buffer, grown as libkmon asks for it
+ * @len: Size of @buf
+ * @err: errno of a failed reader, 0 on success
+ */
+struct bench_reader {
+    pthread_t thread;
+    const char *spec;
+    int samples;
+    pthread_barrier_t *start;
+    struct bench_result res;
+    char *buf;
+    size_t len;
+    int err;
+};
+
+/**
+ * struct idle_tasks - Processes or threads spawned to grow the task table
+ * @threads: Non-zero to spawn threads instead of processes
+ * @count: Tasks running
+ * @pids: Process IDs (processes)
+ * @tids: Thread handles (threads)
+ * @capacity: Size of @pids or @tids
+ * @pipe: Idle threads block reading pipe[0]; closing pipe[1] releases them
+ */
+struct idle_tasks {
+    int threads;
+    long count;
+    pid_t *pids;
+    pthread_t *tids;
+    long capacity;
+    int pipe[2];
+};
+
+/**
+ * now_seconds - Read CLOCK_MONOTONIC
+ *
+ * Return: Current monotonic time in seconds
+ */
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * tv_seconds - Convert a struct timeval to seconds
+ * @tv: Time value
+ *
+ * Return: @tv in seconds
+ */
+static double tv_seconds(const struct timeval *tv)
+{
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+/**
+ * compare_double - qsort() comparator for ascending doubles
+ * @a: First value
+ * @b: Second value
+ *
+ * Return: Negative, zero or positive as for strcmp()
+ */
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * percentile - Nearest-rank percentile of sorted values
+ * @v: Values in ascending order
+ * @n: Number of values
+ * @p: Percentile, 0 to 100
+ *
+ * Return: The percentile
+ */
+static double percentile(const double *v, int n, double p)
+{
+    int i = (int)(p / 100.0 * n + 0.5) - 1;
+
+    if (i < 0)
+        i = 0;
+    if (i >= n)
+        i = n - 1;
+    return v[i];
+}
+
+/**
+ * idle_thread - Body of an idle thread
+ * @arg: Read end of the release pipe
+ *
+ * Return: NULL
+ */
+static void *idle_thread(void *arg)
+{
+    char c;
+
+    while (read((int)(intptr_t)arg, &c, 1) < 0 && errno == EINTR)
+        ;
+    return NULL;
+}
+
+/**
+ * idle_spawn - Grow the number of idle tasks
+ * @idle: Tasks spawned so far
+ * @target: Number of tasks wanted
+ *
+ * Processes sleep in pause() and are killed with their parent; threads
+ * block on a pipe. Spawning stops early when the system refuses more
+ * tasks.
+ *
+ * Return: 0 on success, -1 if fewer than @target tasks are running
+ */
+static int idle_spawn(struct idle_tasks *idle, long target)
+{
+    pthread_attr_t attr;
+    pid_t parent = getpid();
+
+    if (target > idle->capacity) {
+        void *p = idle->threads ?
+                  realloc(idle->tids, target * sizeof(*idle->tids)) :
+                  realloc(idle->pids, target * sizeof(*idle->pids));
+
+        if (!p)
+            return -1;
+        if (idle->threads)
+            idle->tids = p;
+        else
+            idle->pids = p;
+        idle->capacity = target;
+    }
+
+    if (idle->threads) {
+        int err;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, IDLE_STACK_SIZE);
+        while (idle->count < target) {
+            err = pthread_create(&idle->tids[idle->count], &attr, idle_thread,
+                                 (void *)(intptr_t)idle->pipe[0]);
+            if (err) {
+                errno = err;
+                break;
+            }
+            idle->count++;
+        }
+        pthread_attr_destroy(&attr);
+        return idle->count < target ? -1 : 0;
+    }
+
+    fflush(NULL);
+    while (idle->count < target) {
+        pid_t pid = fork();
+
+        if (pid < 0)
+            return -1;
+        if (pid == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            if (getppid() != parent)
+                _exit(0);
+            for (;;)
+                pause();
+        }
+        idle->pids[idle->count++] = pid;
+    }
+    return 0;
+}
+
+/**
+ * idle_stop - Stop all idle tasks
+ * @idle: Tasks to stop
+ */
+static void idle_stop(struct idle_tasks *idle)
+{
+    long i;
+
+    if (idle->threads) {
+        close(idle->pipe[1]);
+        for (i = 0; i < idle->count; i++)
+            pthread_join(idle->tids[i], NULL);
+    } else {
+        for (i = 0; i < idle->count; i++)
+            kill(idle->pids[i], SIGKILL);
+        for (i = 0; i < idle->count; i++)
+            waitpid(idle->pids[i], NULL, 0);
+    }
+    idle->count = 0;
+}
+
+/**
+ * take_sample - Read one snapshot and decode every task
+ * @km: Open source
+ * @rd: Reader owning the buffer and receiving the timings
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int take_sample(struct kmon *km, struct bench_reader *rd)
+{
+    struct bench_result *res = &rd->res;
+    struct kmon_snapshot snap;
+    struct kmon_task task;
+    double t0, t1;
+    char *p;
+
+    for (;;) {
+        t0 = now_seconds();
+        if (kmon_read(km, rd->buf, rd->len, &snap) == 0)
+            break;
+        if (errno != ENOBUFS || !snap.needed)
+            return -1;
+        p = realloc(rd->buf, snap.needed);
+        if (!p)
+            return -1;
+        rd->buf = p;
+        rd->len = snap.needed;
+    }
+    t1 = now_seconds();
+
+    res->tasks = 0;
+    while (kmon_next_task(&snap, &task) > 0)
+        res->tasks++;
+    res->read_total += t1 - t0;
+    res->decode_total += now_seconds() - t1;
+    return 0;
+}
+
+/**
+ * bench_reader_run - Warm up, wait for the other readers, then time samples
+ * @arg: struct bench_reader
+ *
+ * Return: NULL; failures are left in the reader's @err
+ */
+static void *bench_reader_run(void *arg)
+{
+    struct bench_reader *rd = arg;
+    struct kmon km;
+    int i, opened = kmon_open(&km, rd->spec) == 0;
+
+    if (!opened)
+        rd->err = errno;
+    for (i = 0; opened && !rd->err && i < WARMUP_SAMPLES; i++) {
+        if (take_sample(&km, rd) < 0)
+            rd->err = errno;
+    }
+    rd->res.read_total = 0;
+    rd->res.decode_total = 0;
+
+    /* Readers that failed still take part so the others are released */
+    pthread_barrier_wait(rd->start);
+
+    for (i = 0; !rd->err && i < rd->samples; i++) {
+        double t0 = now_seconds();
+
+        if (take_sample(&km, rd) < 0) {
+            rd->err = errno;
+            break;
+        }
+        rd->res.wall[i] = now_seconds() - t0;
+        rd->res.samples++;
+    }
+    if (opened)
+        kmon_close(&km);
+    free(rd->buf);
+    return NULL;
+}
+
+/**
+ * bench_source - Time repeated samples from one source
+ * @spec: Source as accepted by kmon_open()
+ * @readers: Concurrent readers, each with its own handle
+ * @samples: Samples to time per reader
+ * @res: Result to fill; @res->wall must have room for @readers * @samples
+ *       values
+ *
+ * Readers start together after warming up. CPU time covers the whole
+ * process, so with several readers it is their sum.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int bench_source(const char *spec, int readers, int samples, struct bench_result *res)
+{
+    double *wall = res->wall;
+    struct bench_reader *rd;
+    struct rusage before, after;
+    pthread_barrier_t start;
+    double t0;
+    int i, err = 0, started;
+
+    memset(res, 0, sizeof(*res));
+    res->wall = wall;
+    rd = calloc(readers, sizeof(*rd));
+    if (!rd)
+        return -1;
+    pthread_barrier_init(&start, NULL, readers + 1);
+
+    for (started = 0; started < readers; started++) {
+        rd[started].spec = spec;
+        rd[started].samples = samples;
+        rd[started].start = &start;
+        rd[started].res.wall = wall + started * samples;
+        err = pthread_create(&rd[started].thread, NULL, bench_reader_run, &rd[started]);
+        if (err)
+            break;
+    }
+    if (err) {
+        /* Stand in for the readers that never started */
+        for (i = started; i < readers; i++)
+            rd[i].err = err;
+        for (i = started; i < readers; i++)
+            pthread_barrier_wait(&start);
+    }
+
+    /* The readers may be done before this thread runs again */
+    getrusage(RUSAGE_SELF, &before);
+    t0 = now_seconds();
+    pthread_barrier_wait(&start);
+    for (i = 0; i < started; i++)
+        pthread_join(rd[i].thread, NULL);
+    res->elapsed = now_seconds() - t0;
+    getrusage(RUSAGE_SELF, &after);
+    res->user_total = tv_seconds(&after.ru_utime) - tv_seconds(&before.ru_utime);
+    res->sys_total = tv_seconds(&after.ru_stime) - tv_seconds(&before.ru_stime);
+    pthread_barrier_destroy(&start);
+
+    /* Pack the readers' timings together for the percentiles */
+    for (i = 0; i < readers; i++) {
+        if (rd[i].err && !err)
+            err = rd[i].err;
+        memmove(wall + res->samples, rd[i].res.wall, rd[i].res.samples * sizeof(*wall));
+        res->samples += rd[i].res.samples;
+        res->tasks = rd[i].res.tasks;
+        res->read_total += rd[i].res.read_total;
+        res->decode_total += rd[i].res.decode_total;
+    }
+    free(rd);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * module_version - Read the loaded module's version
+ * @buf: Destination
+ * @len: Size of @buf
+ *
+ * Return: @buf, holding the version or "none" if the module is not loaded
+ */
+static const char *module_version(char *buf, size_t len)
+{
+    FILE *fp = fopen(MODULE_VERSION_PATH, "r");
+
+    snprintf(buf, len, "none");
+    if (fp) {
+        if (fgets(buf, len, fp))
+            buf[strcspn(buf, "\n")] = '\0';
+        fclose(fp);
+    }
+    return buf;
+}
+
+/**
+ * parse_counts - Parse a comma-separated list of counts
+ * @arg: List such as "1000,5000,10000"
+ * @counts: Destination, MAX_TASK_COUNTS entries
+ * @min: Smallest count allowed
+ *
+ * Return: Number of counts, or -1 on a malformed list
+ */
+static int parse_counts(const char *arg, long *counts, long min)
+{
+    int n = 0;
+
+    while (*arg) {
+        char *end;
+        long v = strtol(arg, &end, 10);
+
+        if (end == arg || v < min || n == MAX_TASK_COUNTS || (*end && *end != ','))
+            return -1;
+        if (n && v < counts[n - 1])
+            return -1;
+        counts[n++] = v;
+        arg = *end ? end + 1 : end;
+    }
+    return n ? n : -1;
+}
+
+/**
+ * print_usage - Print command line help
+ * @prog: Program name
+ */
+static void print_usage(const char *prog)
+{
+    printf("Usage: %s [OPTIONS] [SOURCE...]\n\n", prog);
+    printf("Time one sample from each SOURCE, as accepted by kmon_open().\n"
+           "Without sources, compares %s, procfs-sync: and procfs-uring:.\n\n",
+           KMON_PROC_PATH);
+    printf("Options:\n");
+    printf("  -n, --samples N     Timed samples per source (default %d)\n", DEFAULT_SAMPLES);
+    printf("  -t, --tasks LIST    Spawn idle tasks and measure at each count in LIST,\n"
+           "                      e.g. 1000,5000,10000,50000 (ascending)\n");
+    printf("      --threads       Spawn idle threads instead of processes\n");
+    printf("  -r, --readers LIST  Repeat each measurement with each number of\n"
+           "                      concurrent readers in LIST, e.g. 1,2,4,8\n");
+    printf("  -o, --csv FILE      Append results to FILE as CSV\n");
+    printf("  -l, --label TEXT    Label of the CSV rows (default: module version)\n");
+    printf("  -h, --help          Show this help message\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *const defaults[] = {
+        KMON_PROC_PATH, "procfs-sync:", "procfs-uring:",
+    };
+    enum { OPT_THREADS = 256 };
+    static struct option long_options[] = {
+        {"samples", required_argument, 0, 'n'},
+        {"tasks",   required_argument, 0, 't'},
+        {"threads", no_argument,       0, OPT_THREADS},
+        {"readers", required_argument, 0, 'r'},
+        {"csv",     required_argument, 0, 'o'},
+        {"label",   required_argument, 0, 'l'},
+        {"help",    no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    const char *const *sources = defaults;
+    int nr_sources = sizeof(defaults) / sizeof(defaults[0]);
+    struct idle_tasks idle = { .pipe = { -1, -1 } };
+    long counts[MAX_TASK_COUNTS] = { 0 };
+    long readers[MAX_TASK_COUNTS] = { 1 };
+    int nr_counts = 1, nr_readers = 1;
+    int samples = DEFAULT_SAMPLES;
+    const char *csv_path = NULL, *label = NULL;
+    char version[64];
+    struct utsname uts;
+    struct bench_result res;
+    FILE *csv = NULL;
+    int opt, c, i, r, ok = 0;
+
+    while ((opt = getopt_long(argc, argv, "n:t:r:o:l:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                samples = atoi(optarg);
+                if (samples < 1) {
+                    fprintf(stderr, "Error: Invalid sample count: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                nr_counts = parse_counts(optarg, counts, 0);
+                if (nr_counts < 0) {
+                    fprintf(stderr, "Error: Invalid task counts: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                nr_readers = parse_counts(optarg, readers, 1);
+                if (nr_readers < 0) {
+                    fprintf(stderr, "Error: Invalid reader counts: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_THREADS:
+                idle.threads = 1;
+                break;
+            case 'o':
+                csv_path = optarg;
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        sources = (const char *const *)&argv[optind];
+        nr_sources = argc - optind;
+    }
+    if (!label)
+        label = module_version(version, sizeof(version));
+    if (uname(&uts) < 0)
+        snprintf(uts.release, sizeof(uts.release), "unknown");
+
+    res.wall = malloc(readers[nr_readers - 1] * samples * sizeof(*res.wall));
+    if (!res.wall || (idle.threads && pipe(idle.pipe) < 0)) {
+        perror("Error");
+        return 1;
+    }
+    if (csv_path) {
+        csv = fopen(csv_path, "a");
+        if (!csv) {
+            fprintf(stderr, "Error: Cannot open %s: %s\n", csv_path, strerror(errno));
+            return 1;
+        }
+        if (ftell(csv) == 0)
+            fprintf(csv, "label,kernel,spawn,spawned,source,readers,tasks,samples,"
+                         "samples_per_s,wall_mean_us,wall_p50_us,wall_p99_us,wall_max_us,"
+                         "read_us,decode_us,user_us,sys_us\n");
+    }
+
+    printf("%-8s %-24s %7s %8s %10s %10s %10s %10s %10s %10s\n", "spawned", "source",
+           "readers", "tasks", "per_s", "mean_us", "p50_us", "p99_us", "user_us", "sys_us");
+    for (c = 0; c < nr_counts; c++) {
+        if (idle_spawn(&idle, counts[c]) < 0) {
+            fprintf(stderr, "Error: Stopped at %ld idle %s: %s\n", idle.count,
+                    idle.threads ? "threads" : "processes", strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < nr_sources; i++) {
+            for (r = 0; r < nr_readers; r++) {
+                double sum = 0, mean, p50, p99, rate;
+                int k;
+
+                if (bench_source(sources[i], readers[r], samples, &res) < 0) {
+                    printf("%-8ld %-24s %7ld %s\n", idle.count, sources[i], readers[r],
+                           strerror(errno));
+                    continue;
+                }
+                for (k = 0; k < res.samples; k++)
+                    sum += res.wall[k];
+                qsort(res.wall, res.samples, sizeof(*res.wall), compare_double);
+                mean = sum / res.samples * 1e6;
+                p50 = percentile(res.wall, res.samples, 50) * 1e6;
+                p99 = percentile(res.wall, res.samples, 99) * 1e6;
+                rate = res.elapsed > 0 ? res.samples / res.elapsed : 0;
+
+                printf("%-8ld %-24s %7ld %8lu %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                       idle.count, sources[i], readers[r], res.tasks, rate, mean, p50, p99,
+                       res.user_total / res.samples * 1e6,
+                       res.sys_total / res.samples * 1e6);
+                if (csv)
+                    fprintf(csv, "%s,%s,%s,%ld,%s,%ld,%lu,%d,%.1f,%.2f,%.2f,%.2f,%.2f,"
+                                 "%.2f,%.2f,%.2f,%.2f\n",
+                            label, uts.release, idle.threads ? "threads" : "processes",
+                            idle.count, sources[i], readers[r], res.tasks, res.samples,
+                            rate, mean, p50, p99, res.wall[res.samples - 1] * 1e6,
+                            res.read_total / res.samples * 1e6,
+                            res.decode_total / res.samples * 1e6,
+                            res.user_total / res.samples * 1e6,
+                            res.sys_total / res.samples * 1e6);
+                ok++;
+            }
+        }
+    }
+
+    idle_stop(&idle);
+    if (csv && fclose(csv) != 0) {
+        fprintf(stderr, "Error: Failed to write %s: %s\n", csv_path, strerror(errno));
+        ok = 0;
+    }
+    free(res.wall);
+    free(idle.pids);
+    free(idle.tids);
+    return ok ? 0 : 1;
+}
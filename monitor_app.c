@@ -9,6 +9,8 @@
  * from the kernel monitor module via /proc/kernel_monitor.
  */
 
+#define _GNU_SOURCE
+
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,12 +18,86 @@
 #include <unistd.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "kmon.h"
 
 /* Configuration constants */
-#define PROC_PATH "/proc/kernel_monitor"
 #define BUFFER_SIZE 4096
 #define APP_VERSION "1.0.0"
 
+/* Task table limits */
+#define DEFAULT_MAX_PROCS 65536     /* Tasks tracked per sample */
+
+/* Leak detector defaults */
+#define DEFAULT_LEAK_HORIZON 300.0  /* Seconds of steady growth required */
+#define DEFAULT_LEAK_RATE    1.0    /* Minimum growth in KB/s */
+#define LEAK_MIN_R2          0.8    /* Minimum fit quality of the trend */
+
+/* Free memory forecast defaults */
+#define DEFAULT_FORECAST_WINDOW 600.0  /* Time constant of the trend, seconds */
+#define FORECAST_CLIP           3.0    /* Residuals beyond this many MADs are clipped */
+#define FORECAST_WARMUP         3      /* Samples before a forecast is shown */
+
+/* Anomaly detector defaults */
+#define DEFAULT_EWMA_ALPHA  0.1     /* Weight of the newest sample */
+#define DEFAULT_ZSCORE      3.0     /* Band half-width in standard deviations */
+#define EWMA_WARMUP         10      /* Samples before a series can be flagged */
+#define EWMA_MIN_SD_CPU     1.0f    /* Variance floors, in each series' unit */
+#define EWMA_MIN_SD_PAGES   16.0f
+#define EWMA_MIN_SD_KB      64.0f
+
+/* Alert engine limits */
+#define MAX_RULES         64        /* Compiled rules */
+#define RULE_TEXT_LEN     128       /* Rule source kept for messages */
+#define ALERT_LINE_LEN    512       /* One formatted alert */
+
+/* HTTP exporter limits */
+#define MAX_HTTP_CLIENTS  32        /* Concurrent scrapes */
+#define HTTP_REQ_LEN      2048      /* Request head, anything longer is rejected */
+#define HTTP_HDR_LEN      256       /* Response head */
+#define OPENMETRICS_TYPE  "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+/* Textfile exporter output, picked up by node_exporter's textfile collector */
+#define TEXTFILE_NAME     "kernel_monitor.prom"
+
+/* Fan-out daemon limits */
+#define FANOUT_FRAMES       8           /* Encoded samples kept for clients */
+#define FANOUT_QUEUE        4           /* Samples a client may fall behind */
+#define MAX_FANOUT_CLIENTS  64
+
+/* Output pipeline */
+#define SINK_QUEUE_DEPTH    4           /* Samples queued per sink, power of two */
+
+/* Latency tracing */
+#define LATENCY_BUCKETS     16          /* Finite histogram buckets */
+
+/* Buffers reserved at startup, sized from --max-procs */
+#define ARENA_ALIGN         16
+#define SINK_SCRATCH_SIZE   (64 * 1024) /* Per-sample memory of one sink */
+#define READ_TASK_BYTES     96          /* Raw sample bytes per task, estimated */
+#define SHM_DECODE_RETRIES  100         /* In-place reads of a snapshot being rewritten */
+#define METRICS_BASE_BYTES  (64 * 1024) /* Rendered metrics besides the tasks */
+#define METRICS_TASK_BYTES  768         /* Rendered metrics per task, estimated */
+
 /* Color codes for terminal output */
 #define COLOR_RESET   "\033[0m"
 #define COLOR_RED     "\033[31m"
@@ -30,114 +106,5888 @@
 #define COLOR_BLUE    "\033[34m"
 #define COLOR_BOLD    "\033[1m"
 
+/* Task flags set by the analysis passes */
+#define TASK_LEAKING  0x1
+#define TASK_ANOMALY  0x2
+#define TASK_RATES    0x4           /* cpu_pct and mem_rate are valid */
+#define TASK_HISTORY  0x8           /* spark is filled in */
+
+/* Sparklines of the live view */
+#define HISTORY_LEN   20            /* Samples kept per series */
+#define SPARK_LEVELS  8             /* Block heights, U+2581 to U+2588 */
+
+/* Task filters, compiled at startup */
+#define MAX_FILTER_NODES  512       /* Trie nodes for all name patterns */
+#define MAX_FILTER_RANGES 32        /* Ranges per kind of ID */
+#define FILTER_EXACT      0x1       /* A pattern ends at this trie node */
+#define FILTER_PREFIX     0x2       /* A pattern ending here takes any suffix */
+
+/* Lifecycle diff: a memory change is shown once it passes both limits */
+#define DIFF_CHANGE_PCT    10.0     /* Percent of the previous figure */
+#define DIFF_CHANGE_MIN_KB 1024     /* Absolute change in KB */
+
+/* Synthetic load of --bench-tracker */
+#define BENCH_SAMPLES      100      /* Timed samples */
+#define BENCH_CHURN        100      /* One process in this many is replaced per sample */
+
+/* What happened to a process between two samples */
+enum change_kind {
+    CHANGE_NEW,
+    CHANGE_EXITED,
+    CHANGE_MEMORY,
+};
+
+/* System-wide series watched by the anomaly detector */
+enum sys_series {
+    SERIES_CPU,
+    SERIES_FREE_RAM,
+    SERIES_MAX
+};
+
+/* Consumers of the sample stream, each running on its own thread */
+enum sink_kind {
+    SINK_DISPLAY,           /* Live view on the terminal */
+    SINK_ALERTS,            /* Alert file and hook delivery */
+    SINK_TEXTFILE,          /* node_exporter textfile */
+    SINK_SERVER,            /* HTTP exporter and fan-out daemon */
+    SINK_MAX
+};
+
+static const char *const sink_names[SINK_MAX] = {
+    [SINK_DISPLAY] = "display",
+    [SINK_ALERTS] = "alerts",
+    [SINK_TEXTFILE] = "textfile",
+    [SINK_SERVER] = "server",
+};
+
+/* Stages a sample passes through on its way to the screen */
+enum trace_stage {
+    STAGE_READ,             /* kmon_read(): module output to bytes in our buffer */
+    STAGE_PARSE,            /* Decoding the task rows */
+    STAGE_ANALYZE,          /* Trackers, detectors, alerts and shm publishing */
+    STAGE_RENDER,           /* Queued for the display until drawn */
+    STAGE_AGE,              /* Collected by the source until drawn */
+    STAGE_MAX
+};
+
+static const char *const stage_names[STAGE_MAX] = {
+    [STAGE_READ] = "read",
+    [STAGE_PARSE] = "parse",
+    [STAGE_ANALYZE] = "analyze",
+    [STAGE_RENDER] = "render",
+    [STAGE_AGE] = "age",
+};
+
+/* Upper bounds of the latency histogram buckets, in seconds */
+static const double latency_bounds[LATENCY_BUCKETS] = {
+    0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+    0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 10.0,
+};
+
+/**
+ * struct sink_stat - Queue state of one sink, as seen by the reader
+ * @depth: Samples waiting when this sample was queued
+ * @dropped: Samples discarded so far because the queue was full
+ */
+struct sink_stat {
+    unsigned int depth;
+    unsigned long dropped;
+};
+
+/**
+ * struct alert_event - Alert state change found in a sample
+ * @rule: Index of the rule
+ * @firing: New state
+ * @value: Value that caused the change
+ * @pid: Matching process for process rules, 0 otherwise
+ */
+struct alert_event {
+    int rule;
+    int firing;
+    double value;
+    int pid;
+};
+
+/**
+ * struct sample_trace - CLOCK_MONOTONIC timestamps of one sample, in seconds
+ * @collected: Source collected the data; the read start if it does not say
+ * @read_start: kmon_read() was called
+ * @read_done: kmon_read() returned
+ * @parsed: Task rows were decoded
+ * @queued: Sample was handed to the output sinks (watch mode only)
+ */
+struct sample_trace {
+    double collected;
+    double read_start;
+    double read_done;
+    double parsed;
+    double queued;
+};
+
+/**
+ * struct latency_hist - Histogram of one pipeline stage
+ * @count: Observations
+ * @sum: Sum of the observations in seconds
+ * @last: Latest observation in seconds
+ * @buckets: Observations per bucket of latency_bounds, the last one
+ *           unbounded; not cumulative
+ *
+ * Each histogram has a single writer. Other threads copy it with relaxed
+ * loads and may see it mid-update, which only skews one observation.
+ */
+struct latency_hist {
+    uint64_t count;
+    double sum;
+    double last;
+    uint64_t buckets[LATENCY_BUCKETS + 1];
+};
+
+/**
+ * struct self_cost - What monitoring costs the machine
+ * @cpu_user: User CPU time of monitor_app so far, in seconds
+ * @cpu_system: Kernel CPU time of monitor_app so far, in seconds
+ * @cpu_pct: CPU use of monitor_app since the previous sample, -1 if unknown
+ * @rss_kb: Resident set size of monitor_app in KB
+ * @syscalls: System calls made to read this sample
+ * @bytes: Bytes read to get this sample
+ * @collect_ns: Time the module took to collect this sample, 0 if unknown
+ * @collections: Samples the module has collected, for all of its readers
+ * @collect_total_ns: Time the module spent on them
+ * @allocs: Heap allocations monitor_app made since sampling started
+ */
+struct self_cost {
+    double cpu_user;
+    double cpu_system;
+    double cpu_pct;
+    unsigned long rss_kb;
+    unsigned long syscalls;
+    size_t bytes;
+    unsigned long long collect_ns;
+    unsigned long long collections;
+    unsigned long long collect_total_ns;
+    unsigned long allocs;
+};
+
+/**
+ * struct self_meter - State for measuring monitor_app's own cost
+ * @statm_fd: /proc/self/statm, kept open; -1 if unavailable
+ * @last_time: CLOCK_MONOTONIC time of the previous measurement
+ * @last_cpu: CPU time at the previous measurement
+ * @base_allocs: Heap allocations made before sampling started
+ */
+struct self_meter {
+    int statm_fd;
+    double last_time;
+    double last_cpu;
+    unsigned long base_allocs;
+};
+
+/**
+ * struct km_task - One row of the module's process table
+ * @comm: Task name
+ * @pid: Process ID
+ * @mem_kb: Virtual memory size in KB
+ * @rss_kb: Resident set size in KB (0 if the module does not report it)
+ * @start_time: Start time in ns since boot, 0 if the source does not say
+ * @cpu_ns: CPU time used so far in ns, 0 if the source does not say
+ * @ppid: Parent process ID, 0 if the source does not say
+ * @uid: Effective user ID, 0 if the source does not say
+ * @cpu_pct: CPU use since the previous sample, -1 if the source does not
+ *           report CPU time (valid with TASK_RATES)
+ * @mem_rate: Memory growth since the previous sample in KB/s (valid with
+ *            TASK_RATES)
+ * @leak_rate: Estimated memory growth in KB/s (watch mode only)
+ * @mem_z: Z-score of the memory figure against its EWMA band
+ * @flags: TASK_* analysis flags
+ * @spark: Memory over the last HISTORY_LEN samples as sparkline levels,
+ *         oldest first (valid with TASK_HISTORY)
+ */
+struct km_task {
+    char comm[KMON_COMM_LEN];
+    int pid;
+    unsigned long mem_kb;
+    unsigned long rss_kb;
+    unsigned long long start_time;
+    unsigned long long cpu_ns;
+    int ppid;
+    unsigned int uid;
+    float cpu_pct;
+    float mem_rate;
+    float leak_rate;
+    float mem_z;
+    unsigned int flags;
+    unsigned char spark[HISTORY_LEN];
+};
+
+/**
+ * struct km_group - Processes of a sample that share a name
+ * @comm: Task name
+ * @count: Processes with this name
+ * @mem_kb: Their combined memory figure (RSS when reported, else virtual)
+ * @max_kb: Memory figure of the largest of them
+ * @cpu_pct: Their combined CPU usage in percent of one CPU, -1 if unknown
+ */
+struct km_group {
+    char comm[KMON_COMM_LEN];
+    unsigned int count;
+    unsigned long mem_kb;
+    unsigned long max_kb;
+    float cpu_pct;
+};
+
+/**
+ * struct km_node - One process in the tree view
+ * @row: Index of the process in the sample's tasks
+ * @depth: Ancestors above it in the sample
+ * @parent: Node index of its parent, -1 for a root
+ * @descendants: Processes in its subtree, itself excluded
+ * @subtree_kb: Memory figure of the whole subtree
+ * @subtree_cpu: CPU usage of the whole subtree in percent of one CPU, -1
+ *               if unknown
+ */
+struct km_node {
+    unsigned int row;
+    unsigned int depth;
+    int parent;
+    unsigned int descendants;
+    unsigned long subtree_kb;
+    float subtree_cpu;
+};
+
+/**
+ * struct km_change - One entry of the lifecycle diff
+ * @comm: Task name
+ * @pid: Process ID
+ * @kind: enum change_kind
+ * @mem_kb: Memory figure now, or at the last sample for an exited process
+ * @delta_kb: Change of the memory figure since the previous sample
+ */
+struct km_change {
+    char comm[KMON_COMM_LEN];
+    int pid;
+    int kind;
+    unsigned long mem_kb;
+    long delta_kb;
+};
+
+/**
+ * struct km_sample - Parsed contents of one read of /proc/kernel_monitor
+ * @timestamp: CLOCK_MONOTONIC time of the read, in seconds
+ * @cpu_user: CPU 0 user time in ns
+ * @cpu_system: CPU 0 system time in ns
+ * @cpu_idle: CPU 0 idle time in ns
+ * @total_ram: Total RAM in pages
+ * @free_ram: Free RAM in pages
+ * @shared_ram: Shared RAM in pages
+ * @buffer_ram: Buffer RAM in pages
+ * @total_processes: Process count reported by the module
+ * @has_rss: Non-zero if the module reports an RSS column
+ * @has_cpu: Non-zero if the tasks carry their CPU time
+ * @has_uid: Non-zero if the tasks carry their user ID
+ * @seq: Sample sequence number, assigned by the source
+ * @free_trend: Smoothed change of free RAM in pages/s (watch mode only)
+ * @oom_eta: Seconds until free RAM runs out, 0 if it is not shrinking
+ * @cpu_busy: CPU 0 busy percentage since the previous sample, -1 if unknown
+ * @sys_z: Z-scores of the system series, indexed by enum sys_series
+ * @sys_anomaly: Bitmask of system series outside their band
+ * @sys_spark: Recent history of the system series as sparkline levels
+ * @alerts_firing: Bitmask of rules firing after this sample
+ * @alert_events: Rules that changed state with this sample
+ * @nr_alert_events: Number of valid entries in @alert_events
+ * @sinks: Output queue state, indexed by enum sink_kind
+ * @sink_mask: Bitmask of sinks that are running
+ * @self: Cost of monitoring, measured with this sample
+ * @trace: Timestamps of this sample's way through the pipeline
+ * @latency: Stage histograms up to the previous sample (watch mode only)
+ * @tasks: Task rows, allocated once with room for @max_tasks entries
+ * @nr_tasks: Number of valid entries in @tasks
+ * @max_tasks: Capacity of @tasks
+ * @dropped_tasks: Rows that did not fit into @tasks
+ * @filtered_tasks: Rows left out by --filter
+ * @groups: Tasks aggregated by name, largest first; as many entries as
+ *          @tasks can hold
+ * @nr_groups: Number of valid entries in @groups, 0 unless grouping is on
+ * @nodes: Tasks in depth-first order of the process tree; as many entries
+ *         as @tasks can hold
+ * @nr_nodes: Number of valid entries in @nodes, 0 unless the tree is on
+ * @changes: Processes that started, exited or changed since the previous
+ *           sample, in pid order; as many entries as @tasks can hold
+ * @nr_changes: Number of valid entries in @changes
+ * @dropped_changes: Changes that did not fit into @changes
+ * @has_changes: Non-zero if @changes compares against a previous sample
+ */
+struct km_sample {
+    double timestamp;
+    unsigned long long cpu_user;
+    unsigned long long cpu_system;
+    unsigned long long cpu_idle;
+    unsigned long total_ram;
+    unsigned long free_ram;
+    unsigned long shared_ram;
+    unsigned long buffer_ram;
+    unsigned long total_processes;
+    int has_rss;
+    int has_cpu;
+    int has_uid;
+    unsigned long long seq;
+    double free_trend;
+    double oom_eta;
+    double cpu_busy;
+    float sys_z[SERIES_MAX];
+    unsigned int sys_anomaly;
+    unsigned char sys_spark[SERIES_MAX][HISTORY_LEN];
+    uint64_t alerts_firing;
+    struct alert_event alert_events[MAX_RULES];
+    int nr_alert_events;
+    struct sink_stat sinks[SINK_MAX];
+    unsigned int sink_mask;
+    struct self_cost self;
+    struct sample_trace trace;
+    struct latency_hist latency[STAGE_MAX];
+    struct km_task *tasks;
+    size_t nr_tasks;
+    size_t max_tasks;
+    size_t dropped_tasks;
+    size_t filtered_tasks;
+    struct km_group *groups;
+    size_t nr_groups;
+    struct km_node *nodes;
+    size_t nr_nodes;
+    struct km_change *changes;
+    size_t nr_changes;
+    size_t dropped_changes;
+    int has_changes;
+};
+
+/**
+ * struct read_buf - Reusable buffer holding the raw proc file contents
+ * @data: Buffer memory, reserved at startup; grown by doubling if a sample
+ *        does not fit, and never shrunk
+ * @len: Number of valid bytes (excluding the terminating NUL)
+ * @cap: Allocated size of @data
+ */
+struct read_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * struct arena - Bump allocator over one mapping reserved at startup
+ * @base: Start of the mapping
+ * @size: Size of the mapping
+ * @used: Bytes handed out since the last reset
+ * @peak: Largest @used seen
+ *
+ * Blocks are never freed one by one: the whole arena is reset when its
+ * owner is done with them, typically once per sample. The mapping is
+ * reserved without touching it, so only the part that is actually used
+ * costs memory.
+ */
+struct arena {
+    char *base;
+    size_t size;
+    size_t used;
+    size_t peak;
+};
+
+/**
+ * struct leak_stat - Exponentially weighted regression of memory over time
+ * @first: Time the process was first seen
+ * @last: Time of the previous update
+ * @mt: Weighted mean of time
+ * @my: Weighted mean of memory
+ * @ctt: Weighted variance of time
+ * @cty: Weighted covariance of time and memory
+ * @cyy: Weighted variance of memory
+ */
+struct leak_stat {
+    double first;
+    double last;
+    double mt, my;
+    double ctt, cty, cyy;
+};
+
+/**
+ * struct ewma_bank - Exponentially weighted mean/variance of many series
+ * @x: Latest observation of each series, filled in before an update
+ * @mean: Weighted mean
+ * @var: Weighted variance
+ * @score: Squared z-score of the latest observation
+ * @count: Observations seen, saturating at EWMA_WARMUP
+ * @flag: Non-zero if the latest observation left the band
+ * @min_var: Variance floor, keeps flat series from flagging tiny changes
+ *
+ * Structure-of-arrays so one pass over contiguous floats updates every
+ * series; the update loop has no branches and vectorizes.
+ */
+struct ewma_bank {
+    float *x;
+    float *mean;
+    float *var;
+    float *score;
+    uint32_t *count;
+    uint32_t *flag;
+    float min_var;
+};
+
+/**
+ * struct pid_slot - Open-addressing table slot mapping a pid to dense state
+ * @pid: Process ID, 0 marks an empty slot
+ * @idx: Index into the dense per-process arrays
+ */
+struct pid_slot {
+    int pid;
+    unsigned int idx;
+};
+
+/**
+ * struct proc_tracker - Per-process state carried across samples
+ * @slots: Linear-probing hash table, sized to twice @max (power of two)
+ * @mask: Number of slots minus one
+ * @count: Number of tracked processes
+ * @max: Maximum number of tracked processes
+ * @seq: Current sample sequence number
+ * @pid: Dense array of tracked pids
+ * @start: Dense array of their start times
+ * @seen: Dense array of the last sample sequence each pid appeared in
+ * @last_cpu: Dense array of CPU times in the previous sample
+ * @last_mem: Dense array of memory figures in the previous sample
+ * @last_time: Timestamp of the previous sample, 0 before the first one
+ * @leak: Dense array of leak regression state
+ * @mem_ewma: Dense memory series for the anomaly detector
+ * @hist: Dense memory history, one ring of HISTORY_LEN samples per process
+ * @hist_len: Dense array of the samples in each ring
+ * @hist_head: Ring slot of the current sample, shared by all processes
+ * @hist_pool: Arena holding @hist and @hist_len
+ * @sparklines: Render the history into the sample's tasks
+ * @task_idx: Scratch map from sample row to dense index, -1 if untracked
+ *
+ * Processes are identified by (pid, start time). Only one live process
+ * can hold a pid, so the table hashes the pid alone and the start time
+ * tells a reused pid from the process that had it before.
+ *
+ * All memory is allocated once at startup; samples never allocate. Exited
+ * processes are removed with backward-shift deletion so the table never
+ * accumulates tombstones, and their dense entries are swap-removed.
+ */
+struct proc_tracker {
+    struct pid_slot *slots;
+    size_t mask;
+    size_t count;
+    size_t max;
+    unsigned long seq;
+    int *pid;
+    unsigned long long *start;
+    unsigned long *seen;
+    unsigned long long *last_cpu;
+    unsigned long *last_mem;
+    double last_time;
+    struct leak_stat *leak;
+    struct ewma_bank mem_ewma;
+    float *hist;
+    unsigned char *hist_len;
+    unsigned int hist_head;
+    struct arena hist_pool;
+    int sparklines;
+    long *task_idx;
+};
+
+/**
+ * struct comm_table - Interned process names
+ * @slots: Linear-probing hash table of name ids plus one, 0 marks an empty
+ *         slot; sized to twice @max (power of two)
+ * @mask: Number of slots minus one
+ * @names: Interned names, KMON_COMM_LEN bytes each and NUL-padded
+ * @hash: Hash of each name, compared before the name itself
+ * @group: Row of each name in the group table of sample @stamp
+ * @stamp: Sample sequence the @group entry belongs to
+ * @count: Names interned
+ * @max: Capacity of @names
+ * @seq: Current sample sequence number
+ * @pool: Arena holding all of the above
+ *
+ * Names are interned once and stay in the table across samples, so a
+ * sample is grouped with one hash probe per task and no string copies for
+ * names seen before. The stamps make the per-sample group rows reset
+ * themselves instead of needing a clear.
+ */
+struct comm_table {
+    uint32_t *slots;
+    size_t mask;
+    char (*names)[KMON_COMM_LEN];
+    uint32_t *hash;
+    uint32_t *group;
+    unsigned long *stamp;
+    size_t count;
+    size_t max;
+    unsigned long seq;
+    struct arena pool;
+};
+
+/**
+ * struct leak_config - Leak detector thresholds
+ * @horizon: Seconds of growth needed before a process is flagged
+ * @rate: Minimum growth rate in KB/s
+ */
+struct leak_config {
+    double horizon;
+    double rate;
+};
+
+/**
+ * struct oom_forecast - Robust linear trend of free memory
+ * @level: Smoothed free RAM in pages
+ * @trend: Smoothed change of free RAM in pages/s
+ * @mad: Running mean absolute one-step prediction error
+ * @last: Time of the previous update
+ * @n: Number of samples seen
+ */
+struct oom_forecast {
+    double level;
+    double trend;
+    double mad;
+    double last;
+    unsigned int n;
+};
+
+/**
+ * struct anomaly_config - Anomaly detector settings
+ * @alpha: EWMA weight of the newest sample
+ * @zscore: Band half-width in standard deviations
+ */
+struct anomaly_config {
+    float alpha;
+    float zscore;
+};
+
+/**
+ * struct sys_state - System-wide analysis state kept across samples
+ * @forecast: Free memory trend
+ * @ewma: One single-series bank per enum sys_series, each with its own floor
+ * @started: Bitmask of series that have received a first observation
+ * @prev_busy: CPU busy time of the previous sample
+ * @prev_total: CPU total time of the previous sample, 0 before the first
+ * @hist: History ring of each series
+ * @hist_head: Slot of the newest observation in each ring
+ * @hist_len: Observations in each ring
+ */
+struct sys_state {
+    struct oom_forecast forecast;
+    struct ewma_bank ewma[SERIES_MAX];
+    unsigned int started;
+    unsigned long long prev_busy;
+    unsigned long long prev_total;
+    float hist[SERIES_MAX][HISTORY_LEN];
+    unsigned int hist_head[SERIES_MAX];
+    unsigned int hist_len[SERIES_MAX];
+};
+
+/* Operands a rule can compare */
+enum rule_metric {
+    METRIC_CPU_BUSY,        /* cpu.busy_pct */
+    METRIC_MEM_FREE_MB,     /* mem.free_mb */
+    METRIC_MEM_FREE_PAGES,  /* mem.free_pages */
+    METRIC_MEM_USED_PCT,    /* mem.used_pct */
+    METRIC_MEM_OOM_ETA,     /* mem.oom_eta_s */
+    METRIC_PROC_COUNT,      /* procs.count */
+    METRIC_PROC_RSS,        /* proc[...].rss_kb */
+    METRIC_PROC_MEM,        /* proc[...].mem_kb */
+    METRIC_PROC_LEAK,       /* proc[...].leak_kbps */
+    METRIC_PROC_Z,          /* proc[...].mem_z */
+    METRIC_PROC_CPU,        /* proc[...].cpu_pct */
+    METRIC_PROC_GROWTH,     /* proc[...].growth_kbps */
+};
+
+enum rule_op {
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+};
+
+/**
+ * struct rule - One compiled alert rule
+ * @metric: Operand to compare
+ * @op: Comparison operator
+ * @by_pid: For process rules, select by @pid rather than @name
+ * @pid: Selected process ID
+ * @name: Selected task name
+ * @threshold: Right-hand side of the comparison
+ * @hold: Seconds the condition must hold before the alert fires
+ * @since: Time the condition became true, negative while false
+ * @firing: Non-zero while the alert is active
+ * @text: Rule source, for alert messages
+ */
+struct rule {
+    enum rule_metric metric;
+    enum rule_op op;
+    int by_pid;
+    int pid;
+    char name[KMON_COMM_LEN];
+    double threshold;
+    double hold;
+    double since;
+    int firing;
+    char text[RULE_TEXT_LEN];
+};
+
+/**
+ * struct filter_node - Trie node of the --filter name patterns
+ * @child: First child, 0 if none; the root, node 0, is nobody's child
+ * @sibling: Next child of the same parent, 0 if none
+ * @c: Character leading to this node
+ * @flags: FILTER_EXACT and FILTER_PREFIX
+ */
+struct filter_node {
+    uint16_t child;
+    uint16_t sibling;
+    unsigned char c;
+    unsigned char flags;
+};
+
+/**
+ * struct id_range - Inclusive range of process or user IDs
+ * @lo: First ID
+ * @hi: Last ID
+ */
+struct id_range {
+    unsigned long lo;
+    unsigned long hi;
+};
+
+/**
+ * struct task_filter - Compiled --filter options
+ * @nodes: Trie of the name patterns, node 0 is the root
+ * @nr_nodes: Nodes in use
+ * @nr_names: Name patterns given
+ * @pids: Process ID ranges, sorted and merged by filter_finish()
+ * @nr_pids: Number of valid entries in @pids
+ * @uids: User ID ranges, sorted and merged by filter_finish()
+ * @nr_uids: Number of valid entries in @uids
+ *
+ * A task is kept if it passes every kind of filter that was given; a kind
+ * passes if any of its patterns or ranges matches. Name patterns share one
+ * trie, so a name is checked in a single walk of at most KMON_COMM_LEN
+ * steps however many patterns there are.
+ */
+struct task_filter {
+    struct filter_node nodes[MAX_FILTER_NODES];
+    unsigned int nr_nodes;
+    unsigned int nr_names;
+    struct id_range pids[MAX_FILTER_RANGES];
+    unsigned int nr_pids;
+    struct id_range uids[MAX_FILTER_RANGES];
+    unsigned int nr_uids;
+};
+
+/**
+ * struct alert_engine - Compiled rules and where their alerts go
+ * @rules: Rule program, evaluated in order against each sample
+ * @nr_rules: Number of valid entries in @rules
+ * @fd: Alert log file, -1 if alerts only go to stderr
+ * @exec: Shell command run for every alert, NULL if unset
+ *
+ * Rules are compiled into this fixed array at startup, so evaluating them
+ * never allocates.
+ */
+struct alert_engine {
+    struct rule rules[MAX_RULES];
+    int nr_rules;
+    int fd;
+    const char *exec;
+};
+
+/**
+ * struct text_buf - Output buffer reused across samples
+ * @data: Buffer memory, reserved at startup; grown by doubling if the
+ *        output does not fit, and never shrunk
+ * @len: Number of valid bytes
+ * @cap: Allocated size of @data
+ * @failed: Set when an append could not grow the buffer
+ */
+struct text_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;
+};
+
+/* Text exposition formats the exporters can render */
+enum metrics_format {
+    FORMAT_OPENMETRICS,     /* OpenMetrics 1.0, served over HTTP */
+    FORMAT_PROMETHEUS,      /* Prometheus 0.0.4, for the textfile collector */
+};
+
+/**
+ * struct textfile_exporter - Periodic writer of a Prometheus textfile
+ * @path: Final file name
+ * @tmp: Temporary file name in the same directory
+ * @buf: Rendered metrics, reused across samples
+ *
+ * The temporary name does not end in .prom, so the collector never reads
+ * it; rename() then swaps the complete file in atomically.
+ */
+struct textfile_exporter {
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    struct text_buf buf;
+};
+
+/**
+ * struct http_client - One exporter connection
+ * @fd: Socket, -1 if the slot is free
+ * @writing: Non-zero once the request has been read and a reply is queued
+ * @req: Request head received so far
+ * @req_len: Bytes in @req
+ * @hdr: Response head
+ * @hdr_len: Bytes in @hdr
+ * @body: Index of the exporter body being sent, -1 for none
+ * @body_len: Bytes of body to send
+ * @sent: Bytes of head and body already sent
+ */
+struct http_client {
+    int fd;
+    int writing;
+    char req[HTTP_REQ_LEN];
+    size_t req_len;
+    char hdr[HTTP_HDR_LEN];
+    size_t hdr_len;
+    int body;
+    size_t body_len;
+    size_t sent;
+};
+
+/**
+ * struct http_exporter - OpenMetrics endpoint serving pre-rendered samples
+ * @listen_fd: Listening socket
+ * @clients: Connection slots
+ * @body: Two rendered payloads; scrapes read one while the next is built
+ * @current: Index of the newest complete payload, -1 before the first sample
+ *
+ * Each sample is rendered once into the spare payload, so the cost of a
+ * scrape is a copy to the socket no matter how many scrapers there are.
+ */
+struct http_exporter {
+    int listen_fd;
+    struct http_client clients[MAX_HTTP_CLIENTS];
+    struct text_buf body[2];
+    int current;
+};
+
+/**
+ * struct fanout_client - One daemon subscriber
+ * @fd: Socket, -1 if the slot is free
+ * @next_seq: Next frame to send
+ * @resume_seq: Frame to continue with once the frame in flight is done
+ * @off: Bytes of frame @next_seq already sent
+ * @dropped: Frames skipped because the client fell behind
+ */
+struct fanout_client {
+    int fd;
+    uint64_t next_seq;
+    uint64_t resume_seq;
+    size_t off;
+    unsigned long dropped;
+};
+
+/**
+ * struct fanout_server - Unix socket daemon serving encoded samples
+ * @listen_fd: Listening socket
+ * @path: Socket path, removed on exit
+ * @frames: Ring of the last FANOUT_FRAMES encoded samples
+ * @seq: Number of frames published so far
+ * @clients: Subscriber slots
+ * @pool: Memory of the frames, each with room for the largest sample
+ *
+ * Every sample is encoded once into the ring and all clients send from
+ * it. A client more than FANOUT_QUEUE frames behind skips straight to the
+ * newest ones (drop-oldest); a frame it is halfway through is finished
+ * first, unless the ring has already reused it, in which case the client
+ * is disconnected.
+ */
+struct fanout_server {
+    int listen_fd;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    struct text_buf frames[FANOUT_FRAMES];
+    uint64_t seq;
+    struct fanout_client clients[MAX_FANOUT_CLIENTS];
+    struct arena pool;
+};
+
+/**
+ * struct shm_publisher - Shared memory snapshot writer
+ * @name: POSIX shared memory object name, removed on exit
+ * @hdr: Mapped segment
+ * @size: Size of the mapping
+ */
+struct shm_publisher {
+    char name[NAME_MAX + 1];
+    struct kmon_shm_header *hdr;
+    size_t size;
+};
+
+/**
+ * struct publishers - Servers that run between samples
+ * @http: OpenMetrics exporter, NULL if disabled
+ * @fanout: Fan-out daemon, NULL if disabled
+ */
+struct publishers {
+    struct http_exporter *http;
+    struct fanout_server *fanout;
+};
+
+/**
+ * struct sink_queue - Bounded single-producer single-consumer sample queue
+ * @slots: Queued samples, each with its own task table
+ * @head: Samples queued so far; written by the reader only
+ * @tail: Samples consumed so far; written by the sink only
+ * @dropped: Samples discarded because the queue was full
+ * @efd: eventfd the reader signals after queueing a sample
+ *
+ * The reader copies each sample into a free slot and publishes it by
+ * advancing @head; the sink advances @tail once it is done with the slot.
+ * Neither side takes a lock and the reader never waits: if the queue is
+ * full, the sample is dropped for that sink only.
+ */
+struct sink_queue {
+    struct km_sample slots[SINK_QUEUE_DEPTH];
+    unsigned int head;
+    unsigned int tail __attribute__((aligned(64)));
+    unsigned long dropped __attribute__((aligned(64)));
+    int efd;
+};
+
+struct pipeline;
+
+/**
+ * struct sink - One consumer thread
+ * @pl: Pipeline the sink belongs to
+ * @kind: What the sink does with samples
+ * @q: Its queue
+ * @thread: Consumer thread
+ * @scratch: Memory for handling one sample, reset before the next
+ */
+struct sink {
+    struct pipeline *pl;
+    enum sink_kind kind;
+    struct sink_queue q;
+    pthread_t thread;
+    struct arena scratch;
+};
+
+/**
+ * struct pipeline - Output sinks fed by the sampling loop
+ * @sinks: Sinks, indexed by enum sink_kind
+ * @mask: Bitmask of running sinks
+ * @stop: Set to make the sinks drain their queues and exit
+ * @cfg: Monitor settings
+ * @textfile: Exporter written by SINK_TEXTFILE
+ * @pub: Servers run by SINK_SERVER
+ * @latency: Stage histograms; the sampling loop writes the read, parse
+ *           and analyze stages and the display sink the others
+ * @pool: Task tables of all queued samples
+ */
+struct pipeline {
+    struct sink sinks[SINK_MAX];
+    unsigned int mask;
+    int stop;
+    const struct monitor_config *cfg;
+    struct textfile_exporter *textfile;
+    struct publishers *pub;
+    struct latency_hist latency[STAGE_MAX];
+    struct arena pool;
+};
+
+/**
+ * struct proc_tree - Scratch space for building the process tree
+ * @slots: Linear-probing table from pid to sample row, sized to twice @max
+ *         (power of two); empty between samples
+ * @mask: Number of slots minus one
+ * @parent: Row of each row's parent, -1 if it is not in the sample
+ * @first_child: Row of each row's first child, -1 if none
+ * @next_sibling: Row of the next child of the same parent, -1 if none
+ * @stack: Node indices of the ancestors during the walk
+ * @visited: Non-zero once a row has been placed in the tree
+ * @max: Rows the arrays have room for
+ * @pool: Arena holding all of the above
+ *
+ * Children are kept as index-linked lists in flat arrays, so building the
+ * tree takes a few passes over the rows and no allocation.
+ */
+struct proc_tree {
+    struct pid_slot *slots;
+    size_t mask;
+    int *parent;
+    int *first_child;
+    int *next_sibling;
+    int *stack;
+    unsigned char *visited;
+    size_t max;
+    struct arena pool;
+};
+
+/**
+ * struct proc_key - Identity and memory of a process, as kept for the diff
+ * @pid: Process ID
+ * @start: Start time, 0 if unknown
+ * @mem_kb: Memory figure
+ * @comm: Task name
+ */
+struct proc_key {
+    int pid;
+    unsigned long long start;
+    unsigned long mem_kb;
+    char comm[KMON_COMM_LEN];
+};
+
+/**
+ * struct proc_diff - Previous sample kept for the lifecycle diff
+ * @prev: Processes of the previous sample, sorted by pid and start time
+ * @cur: The same for the current sample; swapped with @prev afterwards
+ * @nr_prev: Number of valid entries in @prev
+ * @primed: Non-zero once @prev holds a sample
+ * @max: Capacity of @prev and @cur
+ * @pool: Arena holding both arrays
+ */
+struct proc_diff {
+    struct proc_key *prev;
+    struct proc_key *cur;
+    size_t nr_prev;
+    int primed;
+    size_t max;
+    struct arena pool;
+};
+
+/**
+ * struct monitor_config - Settings shared by the display modes
+ * @max_procs: Task table and tracker capacity
+ * @leak: Leak detector thresholds
+ * @forecast_window: Time constant of the free memory trend in seconds
+ * @anomaly: Anomaly detector settings
+ * @alerts: Alert rules, NULL if none were given
+ * @filter: Tasks to keep, NULL to keep all of them
+ * @export_http: [ADDR:]PORT to serve OpenMetrics on, NULL if disabled
+ * @textfile_dir: Directory to write a Prometheus textfile into, NULL if disabled
+ * @daemon_path: Unix socket to serve samples on, NULL if disabled
+ * @connect_path: Daemon socket to take samples from instead of /proc
+ * @shm_name: Shared memory object to publish samples in, NULL if disabled
+ * @connect_shm: Shared memory object to take samples from instead of /proc
+ * @procfs: Build samples from the standard procfs files instead of the module
+ * @trace: Show per-stage latencies under the live view
+ * @group: Aggregate processes that share a name
+ * @tree: Show the processes as a tree with subtree totals
+ * @tree_depth: Levels of the tree to show, 0 for all of them
+ * @diff: Show the processes that started, exited or changed instead of the
+ *        process table
+ */
+struct monitor_config {
+    size_t max_procs;
+    struct leak_config leak;
+    double forecast_window;
+    struct anomaly_config anomaly;
+    struct alert_engine *alerts;
+    const struct task_filter *filter;
+    const char *export_http;
+    const char *textfile_dir;
+    const char *daemon_path;
+    const char *connect_path;
+    const char *shm_name;
+    const char *connect_shm;
+    int procfs;
+    int trace;
+    int group;
+    int tree;
+    unsigned int tree_depth;
+    int diff;
+};
+
+/**
+ * print_usage - Display usage information
+ * @prog_name: Name of the program
+ */
+static void print_usage(const char *prog_name)
+{
+    printf("Usage: %s [OPTIONS]\n", prog_name);
+    printf("Read and display Linux kernel monitoring data\n\n");
+    printf("Options:\n");
+    printf("  -h, --help       Display this help message\n");
+    printf("  -v, --version    Display version information\n");
+    printf("  -r, --raw        Display raw output without formatting\n");
+    printf("  -w, --watch SEC  Continuously display data every SEC seconds\n");
+    printf("  -m, --max-procs N      Track at most N processes (default %d)\n",
+           DEFAULT_MAX_PROCS);
+    printf("  -n, --count N          Batch mode: write N samples as tab-separated\n"
+           "                         records without colors, then exit. -n 0, or -d\n"
+           "                         without -n, samples until killed\n");
+    printf("  -d, --delay SEC        Batch mode: take a sample every SEC seconds,\n"
+           "                         fractions allowed (default 1)\n");
+    printf("  -g, --group            Show and export one row per process name\n"
+           "                         instead of one per process\n");
+    printf("  -t, --tree             Show the processes as a tree with the memory\n"
+           "                         and CPU of each subtree\n");
+    printf("      --tree-depth N     Show N levels of the tree and fold deeper\n"
+           "                         processes into their ancestors (implies -t)\n");
+    printf("      --filter EXPR      Only keep processes matching EXPR: name=PAT,\n"
+           "                         pid=RANGE or uid=RANGE, each a comma-separated\n"
+           "                         list. PAT may end in '*', a RANGE is N or LO-HI.\n"
+           "                         Repeat to combine kinds, e.g. --filter name=nginx*\n"
+           "                         --filter uid=33\n");
+    printf("      --diff             In watch mode, list the processes that started,\n"
+           "                         exited or changed their memory by more than\n"
+           "                         %.0f%% since the previous sample\n", DIFF_CHANGE_PCT);
+    printf("      --leak-horizon SEC Flag memory growth sustained for SEC seconds\n"
+           "                         (default %.0f)\n", DEFAULT_LEAK_HORIZON);
+    printf("      --leak-rate KBPS   Minimum growth rate to flag, in KB/s\n"
+           "                         (default %.1f)\n", DEFAULT_LEAK_RATE);
+    printf("      --forecast-window SEC  Time constant of the free memory trend\n"
+           "                             used for the OOM forecast (default %.0f)\n",
+           DEFAULT_FORECAST_WINDOW);
+    printf("      --ewma-alpha A     Weight of the newest sample in the anomaly\n"
+           "                         detector's moving averages (default %.2f)\n",
+           DEFAULT_EWMA_ALPHA);
+    printf("      --zscore K         Flag samples more than K standard deviations\n"
+           "                         from their moving average (default %.1f)\n",
+           DEFAULT_ZSCORE);
+    printf("      --rule EXPR        Raise an alert when EXPR holds, e.g.\n"
+           "                         'mem.free_mb < 64 for 30s' or\n"
+           "                         'proc[name=nginx].rss_kb > 500000'\n");
+    printf("      --rules FILE       Read rules from FILE, one per line\n");
+    printf("      --alert-file PATH  Append alerts to PATH as well as stderr\n");
+    printf("      --alert-exec CMD   Run CMD through /bin/sh for every alert, with\n"
+           "                         KM_ALERT_STATE, KM_ALERT_RULE and\n"
+           "                         KM_ALERT_VALUE in the environment\n");
+    printf("      --export-http [ADDR:]PORT  Serve the latest sample in OpenMetrics\n"
+           "                         format at http://ADDR:PORT/metrics. Without -w\n"
+           "                         the monitor samples every second and does not\n"
+           "                         draw the live view\n");
+    printf("      --textfile-dir DIR Write each sample to DIR/%s for the\n"
+           "                         node_exporter textfile collector. Without -w\n"
+           "                         the file is refreshed every second\n",
+           TEXTFILE_NAME);
+    printf("      --daemon PATH      Read /proc/kernel_monitor once per interval\n"
+           "                         and serve parsed samples on Unix socket PATH\n");
+    printf("      --connect PATH     Take samples from a daemon at PATH instead of\n"
+           "                         reading /proc/kernel_monitor\n");
+    printf("      --shm NAME         Publish every sample in POSIX shared memory\n"
+           "                         object NAME (implies daemon operation)\n");
+    printf("      --connect-shm NAME Take samples from shared memory object NAME\n"
+           "                         instead of reading /proc/kernel_monitor\n");
+    printf("      --procfs           Read /proc/stat, /proc/meminfo and /proc/PID/stat\n"
+           "                         instead of the module (the default when the\n"
+           "                         module is not loaded)\n");
+    printf("      --trace            Show how long each sample took to read, parse,\n"
+           "                         analyze and draw, and how old it was on screen\n");
+    printf("      --bench-tracker N  Time the per-process tracking on N synthetic\n"
+           "                         processes and exit\n");
+    printf("\nExamples:\n");
+    printf("  %s              Display current system statistics\n", prog_name);
+    printf("  %s -w 2         Update display every 2 seconds\n", prog_name);
+}
+
+/**
+ * print_version - Display version information
+ */
+static void print_version(void)
+{
+    printf("Kernel Monitor Application v%s\n", APP_VERSION);
+    printf("Copyright (C) 2025 Mahmoud Ezzat\n");
+}
+
+/**
+ * monotonic_seconds - Read CLOCK_MONOTONIC
+ *
+ * Return: Current monotonic time in seconds
+ */
+static double monotonic_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * Heap allocations made through mem_alloc(), mem_calloc() and
+ * mem_realloc(). Once sampling has started this should stay flat; the
+ * live view and the exporters report any increase.
+ */
+static unsigned long heap_allocs;
+
+static void *mem_alloc(size_t size)
+{
+    __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static void *mem_calloc(size_t n, size_t size)
+{
+    __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return calloc(n, size);
+}
+
+static void *mem_realloc(void *p, size_t size)
+{
+    __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return realloc(p, size);
+}
+
+/*
+ * Size of a memory page in KB, read once by main(). Both sources count RAM
+ * in pages of the running kernel, which are 16 or 64 KB on some arm64
+ * configurations.
+ */
+static unsigned long page_kb = 4;
+
+/*
+ * Whether messages on stderr are colored. main() turns this off in batch
+ * mode and when stderr is not a terminal, so captured logs stay plain text.
+ */
+static int stderr_colors = 1;
+
+/**
+ * err_printf - Print a message on stderr in a color
+ * @color: COLOR_* sequence, used only while stderr_colors is set
+ * @fmt: printf-style format
+ */
+static void err_printf(const char *color, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void err_printf(const char *color, const char *fmt, ...)
+{
+    int saved_errno = errno;
+    va_list ap;
+
+    flockfile(stderr);
+    if (stderr_colors)
+        fputs(color, stderr);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    if (stderr_colors)
+        fputs(COLOR_RESET, stderr);
+    funlockfile(stderr);
+    errno = saved_errno;
+}
+
+/**
+ * arena_init - Reserve the memory of an arena
+ * @a: Arena to initialize
+ * @size: Bytes to reserve
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int arena_init(struct arena *a, size_t size)
+{
+    memset(a, 0, sizeof(*a));
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (!size)
+        return 0;
+    a->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (a->base == MAP_FAILED) {
+        a->base = NULL;
+        return -1;
+    }
+    a->size = size;
+    return 0;
+}
+
+/**
+ * arena_alloc - Take a block from an arena
+ * @a: Arena
+ * @size: Bytes needed
+ *
+ * Memory below the arena's peak keeps whatever the previous user left in
+ * it; above it, the mapping is still zero.
+ *
+ * Return: Block aligned to ARENA_ALIGN, or NULL if the arena is exhausted
+ */
+static void *arena_alloc(struct arena *a, size_t size)
+{
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (size > a->size - a->used)
+        return NULL;
+    p = a->base + a->used;
+    a->used += size;
+    if (a->used > a->peak)
+        a->peak = a->used;
+    return p;
+}
+
+/**
+ * arena_reset - Release every block of an arena at once
+ * @a: Arena
+ */
+static void arena_reset(struct arena *a)
+{
+    a->used = 0;
+}
+
+/**
+ * arena_free - Unmap an arena
+ * @a: Arena
+ */
+static void arena_free(struct arena *a)
+{
+    if (a->base)
+        munmap(a->base, a->size);
+    memset(a, 0, sizeof(*a));
+}
+
+/**
+ * latency_record - Add an observation to a stage histogram
+ * @h: Histogram, written only by the calling thread
+ * @secs: Latency in seconds
+ */
+static void latency_record(struct latency_hist *h, double secs)
+{
+    double sum;
+    int b = 0;
+
+    if (secs < 0.0)
+        secs = 0.0;
+    while (b < LATENCY_BUCKETS && secs > latency_bounds[b])
+        b++;
+    sum = h->sum + secs;
+    __atomic_store_n(&h->buckets[b], h->buckets[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store(&h->sum, &sum, __ATOMIC_RELAXED);
+    __atomic_store(&h->last, &secs, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * latency_copy - Copy a histogram another thread may be updating
+ * @dst: Destination
+ * @src: Histogram
+ */
+static void latency_copy(struct latency_hist *dst, const struct latency_hist *src)
+{
+    int b;
+
+    dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    __atomic_load(&src->sum, &dst->sum, __ATOMIC_RELAXED);
+    __atomic_load(&src->last, &dst->last, __ATOMIC_RELAXED);
+    for (b = 0; b <= LATENCY_BUCKETS; b++)
+        dst->buckets[b] = __atomic_load_n(&src->buckets[b], __ATOMIC_RELAXED);
+}
+
+/**
+ * latency_quantile - Estimate a quantile from a histogram
+ * @h: Histogram with at least one observation
+ * @q: Quantile, 0 to 1
+ *
+ * Return: Upper bound of the bucket holding the quantile, or the largest
+ * finite bound if it falls into the unbounded bucket
+ */
+static double latency_quantile(const struct latency_hist *h, double q)
+{
+    uint64_t rank = (uint64_t)ceil(q * h->count), seen = 0;
+    int b;
+
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank)
+            return latency_bounds[b];
+    }
+    return latency_bounds[LATENCY_BUCKETS - 1];
+}
+
+/**
+ * self_meter_init - Prepare to measure monitor_app's own cost
+ * @m: Meter to initialize
+ *
+ * Call this once all buffers are set up: heap allocations are counted
+ * from here on.
+ */
+static void self_meter_init(struct self_meter *m)
+{
+    m->statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    m->last_time = 0.0;
+    m->last_cpu = 0.0;
+    m->base_allocs = __atomic_load_n(&heap_allocs, __ATOMIC_RELAXED);
+}
+
+/**
+ * self_meter_free - Release a meter
+ * @m: Meter
+ */
+static void self_meter_free(struct self_meter *m)
+{
+    if (m->statm_fd >= 0)
+        close(m->statm_fd);
+    m->statm_fd = -1;
+}
+
+/**
+ * self_measure - Record monitor_app's CPU time and RSS in a sample
+ * @m: Meter
+ * @s: Sample; the read cost is already filled in by sample_read()
+ *
+ * CPU time covers every thread, so sinks and exporters are included.
+ * The measurement itself costs two system calls.
+ */
+static void self_measure(struct self_meter *m, struct km_sample *s)
+{
+    struct rusage ru;
+    double now = monotonic_seconds(), cpu;
+    char buf[128];
+    ssize_t n;
+
+    s->self.cpu_pct = -1.0;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        s->self.cpu_user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+        s->self.cpu_system = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+        cpu = s->self.cpu_user + s->self.cpu_system;
+        if (m->last_time > 0.0 && now > m->last_time)
+            s->self.cpu_pct = (cpu - m->last_cpu) / (now - m->last_time) * 100.0;
+        m->last_time = now;
+        m->last_cpu = cpu;
+    }
+
+    s->self.allocs = __atomic_load_n(&heap_allocs, __ATOMIC_RELAXED) - m->base_allocs;
+    s->self.rss_kb = 0;
+    if (m->statm_fd >= 0 && (n = pread(m->statm_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        unsigned long size, resident;
+
+        buf[n] = '\0';
+        if (sscanf(buf, "%lu %lu", &size, &resident) == 2)
+            s->self.rss_kb = resident * page_kb;
+    }
+}
+
+/**
+ * sample_init - Allocate the per-task tables of a sample
+ * @s: Sample to initialize
+ * @max_tasks: Number of task rows to reserve
+ * @pool: Arena to take the tables from, NULL to allocate them on the heap
+ *
+ * Samples taken from a pool are released with the pool, not sample_free().
+ *
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int sample_init(struct km_sample *s, size_t max_tasks, struct arena *pool)
+{
+    memset(s, 0, sizeof(*s));
+    if (pool) {
+        s->tasks = arena_alloc(pool, max_tasks * sizeof(*s->tasks));
+        s->groups = arena_alloc(pool, max_tasks * sizeof(*s->groups));
+        s->nodes = arena_alloc(pool, max_tasks * sizeof(*s->nodes));
+        s->changes = arena_alloc(pool, max_tasks * sizeof(*s->changes));
+    } else {
+        s->tasks = mem_calloc(max_tasks, sizeof(*s->tasks));
+        s->groups = mem_calloc(max_tasks, sizeof(*s->groups));
+        s->nodes = mem_calloc(max_tasks, sizeof(*s->nodes));
+        s->changes = mem_calloc(max_tasks, sizeof(*s->changes));
+    }
+    if (!s->tasks || !s->groups || !s->nodes || !s->changes) {
+        if (!pool) {
+            free(s->tasks);
+            free(s->groups);
+            free(s->nodes);
+            free(s->changes);
+        }
+        return -1;
+    }
+    s->max_tasks = max_tasks;
+    s->cpu_busy = -1.0;
+    return 0;
+}
+
+/**
+ * sample_free - Release the memory owned by a sample
+ * @s: Sample to release
+ */
+static void sample_free(struct km_sample *s)
+{
+    free(s->tasks);
+    free(s->groups);
+    free(s->nodes);
+    free(s->changes);
+    s->tasks = NULL;
+    s->groups = NULL;
+    s->nodes = NULL;
+    s->changes = NULL;
+    s->max_tasks = 0;
+}
+
+/**
+ * task_memory - Memory figure used for per-process analysis
+ * @s: Sample the task belongs to
+ * @t: Task
+ *
+ * Return: RSS in KB when the module reports it, virtual size otherwise
+ */
+static unsigned long task_memory(const struct km_sample *s,
+                                 const struct km_task *t)
+{
+    return s->has_rss ? t->rss_kb : t->mem_kb;
+}
+
+/**
+ * ewma_bank_init - Allocate a bank of series
+ * @b: Bank to initialize
+ * @cap: Number of series
+ * @min_sd: Smallest standard deviation assumed for any series
+ *
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int ewma_bank_init(struct ewma_bank *b, size_t cap, float min_sd)
+{
+    b->x = mem_calloc(cap, sizeof(*b->x));
+    b->mean = mem_calloc(cap, sizeof(*b->mean));
+    b->var = mem_calloc(cap, sizeof(*b->var));
+    b->score = mem_calloc(cap, sizeof(*b->score));
+    b->count = mem_calloc(cap, sizeof(*b->count));
+    b->flag = mem_calloc(cap, sizeof(*b->flag));
+    b->min_var = min_sd * min_sd;
+    if (!b->x || !b->mean || !b->var || !b->score || !b->count || !b->flag)
+        return -1;
+    return 0;
+}
+
+/**
+ * ewma_bank_free - Release a bank of series
+ * @b: Bank to release
+ */
+static void ewma_bank_free(struct ewma_bank *b)
+{
+    free(b->x);
+    free(b->mean);
+    free(b->var);
+    free(b->score);
+    free(b->count);
+    free(b->flag);
+    memset(b, 0, sizeof(*b));
+}
+
+/**
+ * ewma_bank_reset - Start a series over from a first observation
+ * @b: Bank
+ * @i: Series index
+ * @x: First observation
+ */
+static void ewma_bank_reset(struct ewma_bank *b, size_t i, float x)
+{
+    b->x[i] = x;
+    b->mean[i] = x;
+    b->var[i] = 0.0f;
+    b->score[i] = 0.0f;
+    b->count[i] = 0;
+    b->flag[i] = 0;
+}
+
+/**
+ * ewma_bank_move - Copy the state of one series over another
+ * @b: Bank
+ * @dst: Destination index
+ * @src: Source index
+ */
+static void ewma_bank_move(struct ewma_bank *b, size_t dst, size_t src)
+{
+    b->x[dst] = b->x[src];
+    b->mean[dst] = b->mean[src];
+    b->var[dst] = b->var[src];
+    b->score[dst] = b->score[src];
+    b->count[dst] = b->count[src];
+    b->flag[dst] = b->flag[src];
+}
+
+/**
+ * ewma_update_kernel - Branch-free EWMA update over parallel arrays
+ *
+ * Kept separate from ewma_bank_update() so the restrict qualifiers sit on
+ * real parameters, which lets the compiler vectorize the loop without
+ * runtime alias checks even after inlining.
+ */
+static void ewma_update_kernel(const float *restrict x, float *restrict mean,
+                               float *restrict var, float *restrict score,
+                               uint32_t *restrict count, uint32_t *restrict flag,
+                               size_t n, float alpha, float k2, float min_var)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        float d = x[i] - mean[i];
+        float incr = alpha * d;
+        float z2 = d * d / (var[i] + min_var);
+
+        score[i] = z2;
+        flag[i] = (count[i] >= EWMA_WARMUP) & (z2 > k2);
+        count[i] += count[i] < EWMA_WARMUP;
+        mean[i] += incr;
+        var[i] = (1.0f - alpha) * (var[i] + d * incr);
+    }
+}
+
+/**
+ * ewma_bank_update - Fold the pending observations into every series
+ * @b: Bank, with @b->x holding the new observations
+ * @n: Number of series to update
+ * @cfg: Detector settings
+ *
+ * Each observation is scored against the band from before the update,
+ * then the mean and variance move towards it.
+ */
+static void ewma_bank_update(struct ewma_bank *b, size_t n,
+                             const struct anomaly_config *cfg)
+{
+    ewma_update_kernel(b->x, b->mean, b->var, b->score, b->count, b->flag, n,
+                       cfg->alpha, cfg->zscore * cfg->zscore, b->min_var);
+}
+
+/**
+ * ewma_bank_z - Signed z-score of a series' latest observation
+ * @b: Bank
+ * @i: Series index
+ */
+static float ewma_bank_z(const struct ewma_bank *b, size_t i)
+{
+    return copysignf(sqrtf(b->score[i]), b->x[i] - b->mean[i]);
+}
+
+/**
+ * pid_hash - Hash a pid into the tracker table
+ * @pid: Process ID
+ * @mask: Table size minus one
+ */
+static size_t pid_hash(int pid, size_t mask)
+{
+    uint32_t h = (uint32_t)pid * 0x9E3779B1u;
+
+    return (h ^ (h >> 16)) & mask;
+}
+
+/**
+ * spark_render - Scale a history ring to sparkline levels
+ * @ring: HISTORY_LEN observations
+ * @head: Slot of the newest observation
+ * @len: Valid observations, ending at @head
+ * @out: HISTORY_LEN levels, oldest first; 0 where there is no observation
+ *       yet, otherwise 1 to SPARK_LEVELS between the window's min and max
+ */
+static void spark_render(const float *ring, unsigned int head, unsigned int len,
+                         unsigned char *out)
+{
+    unsigned int first = (head + HISTORY_LEN + 1 - len) % HISTORY_LEN;
+    unsigned int pad = HISTORY_LEN - len, i;
+    float lo = ring[head], hi = ring[head];
+
+    for (i = 0; i < len; i++) {
+        float v = ring[(first + i) % HISTORY_LEN];
+
+        if (v < lo)
+            lo = v;
+        if (v > hi)
+            hi = v;
+    }
+    memset(out, 0, pad);
+    for (i = 0; i < len; i++) {
+        float v = ring[(first + i) % HISTORY_LEN];
+
+        out[pad + i] = hi > lo ?
+            1 + (unsigned char)((v - lo) / (hi - lo) * (SPARK_LEVELS - 1) + 0.5f) : 1;
+    }
+}
+
+/**
+ * spark_print - Print sparkline levels as Unicode block characters
+ * @levels: HISTORY_LEN levels from spark_render()
+ */
+static void spark_print(const unsigned char *levels)
+{
+    static const char *const blocks[SPARK_LEVELS + 1] = {
+        " ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█",
+    };
+    int i;
+
+    for (i = 0; i < HISTORY_LEN; i++)
+        fputs(blocks[levels[i]], stdout);
+}
+
+/**
+ * tracker_init - Allocate a process tracker
+ * @tr: Tracker to initialize
+ * @max: Maximum number of processes to track
+ *
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int tracker_init(struct proc_tracker *tr, size_t max)
+{
+    size_t nslots = 16;
+
+    memset(tr, 0, sizeof(*tr));
+    while (nslots < max * 2)
+        nslots <<= 1;
+
+    tr->slots = mem_calloc(nslots, sizeof(*tr->slots));
+    tr->pid = mem_calloc(max, sizeof(*tr->pid));
+    tr->start = mem_calloc(max, sizeof(*tr->start));
+    tr->seen = mem_calloc(max, sizeof(*tr->seen));
+    tr->last_cpu = mem_calloc(max, sizeof(*tr->last_cpu));
+    tr->last_mem = mem_calloc(max, sizeof(*tr->last_mem));
+    tr->leak = mem_calloc(max, sizeof(*tr->leak));
+    tr->task_idx = mem_calloc(max, sizeof(*tr->task_idx));
+    if (arena_init(&tr->hist_pool, max * (HISTORY_LEN * sizeof(float) + 1) +
+                   2 * ARENA_ALIGN) == 0) {
+        tr->hist = arena_alloc(&tr->hist_pool, max * HISTORY_LEN * sizeof(float));
+        tr->hist_len = arena_alloc(&tr->hist_pool, max);
+    }
+    if (!tr->slots || !tr->pid || !tr->start || !tr->seen || !tr->last_cpu ||
+        !tr->last_mem || !tr->leak || !tr->task_idx || !tr->hist ||
+        ewma_bank_init(&tr->mem_ewma, max, EWMA_MIN_SD_KB) < 0) {
+        free(tr->slots);
+        free(tr->pid);
+        free(tr->start);
+        free(tr->seen);
+        free(tr->last_cpu);
+        free(tr->last_mem);
+        free(tr->leak);
+        free(tr->task_idx);
+        arena_free(&tr->hist_pool);
+        ewma_bank_free(&tr->mem_ewma);
+        return -1;
+    }
+    tr->mask = nslots - 1;
+    tr->max = max;
+    return 0;
+}
+
+/**
+ * tracker_free - Release a process tracker
+ * @tr: Tracker to release
+ */
+static void tracker_free(struct proc_tracker *tr)
+{
+    free(tr->slots);
+    free(tr->pid);
+    free(tr->start);
+    free(tr->seen);
+    free(tr->last_cpu);
+    free(tr->last_mem);
+    free(tr->leak);
+    free(tr->task_idx);
+    arena_free(&tr->hist_pool);
+    ewma_bank_free(&tr->mem_ewma);
+    memset(tr, 0, sizeof(*tr));
+}
+
+/**
+ * tracker_find_slot - Locate the slot holding a pid
+ * @tr: Tracker
+ * @pid: Process ID to look up
+ *
+ * Return: Slot index holding @pid, or the empty slot where it would go
+ */
+static size_t tracker_find_slot(const struct proc_tracker *tr, int pid)
+{
+    size_t i = pid_hash(pid, tr->mask);
+
+    while (tr->slots[i].pid != 0 && tr->slots[i].pid != pid)
+        i = (i + 1) & tr->mask;
+    return i;
+}
+
+/**
+ * tracker_lookup - Find or insert a process
+ * @tr: Tracker
+ * @pid: Process ID
+ * @start: Start time of the process, 0 if unknown
+ * @created: Set to 1 if the caller must initialize the entry
+ *
+ * A pid found with a different start time belongs to a new process: its
+ * entry is handed back as created, in place of the exited one.
+ *
+ * Return: Dense index of the process, or -1 if the tracker is full
+ */
+static long tracker_lookup(struct proc_tracker *tr, int pid,
+                           unsigned long long start, int *created)
+{
+    size_t slot = tracker_find_slot(tr, pid);
+    size_t idx;
+
+    *created = 0;
+    if (tr->slots[slot].pid == pid) {
+        idx = tr->slots[slot].idx;
+        if (tr->start[idx] != start) {
+            tr->start[idx] = start;
+            *created = 1;
+        }
+        return idx;
+    }
+    if (tr->count == tr->max)
+        return -1;
+
+    idx = tr->count++;
+    tr->slots[slot].pid = pid;
+    tr->slots[slot].idx = idx;
+    tr->pid[idx] = pid;
+    tr->start[idx] = start;
+    *created = 1;
+    return idx;
+}
+
+/**
+ * tracker_remove - Remove the process at a dense index
+ * @tr: Tracker
+ * @idx: Dense index to remove
+ *
+ * The hash slot is cleared with backward-shift deletion and the last
+ * dense entry is moved into @idx.
+ */
+static void tracker_remove(struct proc_tracker *tr, size_t idx)
+{
+    size_t hole = tracker_find_slot(tr, tr->pid[idx]);
+    size_t i = hole;
+    size_t last = tr->count - 1;
+
+    /* Backward-shift: pull later entries of the probe run into the hole */
+    for (;;) {
+        size_t home;
+
+        i = (i + 1) & tr->mask;
+        if (tr->slots[i].pid == 0)
+            break;
+        home = pid_hash(tr->slots[i].pid, tr->mask);
+        /* Move the entry unless its home lies cyclically in (hole, i] */
+        if (((i - home) & tr->mask) >= ((i - hole) & tr->mask)) {
+            tr->slots[hole] = tr->slots[i];
+            hole = i;
+        }
+    }
+    tr->slots[hole].pid = 0;
+
+    /* Swap-remove the dense entry */
+    if (idx != last) {
+        tr->pid[idx] = tr->pid[last];
+        tr->start[idx] = tr->start[last];
+        tr->seen[idx] = tr->seen[last];
+        tr->last_cpu[idx] = tr->last_cpu[last];
+        tr->last_mem[idx] = tr->last_mem[last];
+        memcpy(&tr->hist[idx * HISTORY_LEN], &tr->hist[last * HISTORY_LEN],
+               HISTORY_LEN * sizeof(*tr->hist));
+        tr->hist_len[idx] = tr->hist_len[last];
+        tr->leak[idx] = tr->leak[last];
+        ewma_bank_move(&tr->mem_ewma, idx, last);
+        tr->slots[tracker_find_slot(tr, tr->pid[idx])].idx = idx;
+    }
+    tr->count--;
+}
+
+/**
+ * tracker_sweep - Drop processes that were absent from the latest sample
+ * @tr: Tracker
+ */
+static void tracker_sweep(struct proc_tracker *tr)
+{
+    size_t i = 0;
+
+    while (i < tr->count) {
+        if (tr->seen[i] != tr->seq)
+            tracker_remove(tr, i);  /* Re-examine i: it now holds another pid */
+        else
+            i++;
+    }
+}
+
+/**
+ * leak_update - Add one observation to a process's memory trend
+ * @ls: Regression state
+ * @t: Observation time in seconds
+ * @y: Memory in KB
+ * @horizon: Time constant of the exponential weighting in seconds
+ *
+ * Uses exponentially weighted means and co-moments, so the slope reflects
+ * roughly the last @horizon seconds in O(1) time and constant space.
+ */
+static void leak_update(struct leak_stat *ls, double t, double y, double horizon)
+{
+    double alpha = 1.0 - exp(-(t - ls->last) / horizon);
+    double dt = t - ls->mt;
+    double dy = y - ls->my;
+
+    ls->mt += alpha * dt;
+    ls->my += alpha * dy;
+    ls->ctt = (1.0 - alpha) * (ls->ctt + alpha * dt * dt);
+    ls->cty = (1.0 - alpha) * (ls->cty + alpha * dt * dy);
+    ls->cyy = (1.0 - alpha) * (ls->cyy + alpha * dy * dy);
+    ls->last = t;
+}
+
+/**
+ * leak_start - Reset regression state for a newly seen process
+ * @ls: Regression state
+ * @t: Observation time in seconds
+ * @y: Memory in KB
+ */
+static void leak_start(struct leak_stat *ls, double t, double y)
+{
+    memset(ls, 0, sizeof(*ls));
+    ls->first = ls->last = ls->mt = t;
+    ls->my = y;
+}
+
+/**
+ * leak_rate - Current growth estimate of a process
+ * @ls: Regression state
+ * @cfg: Detector thresholds
+ * @steady: Set to 1 if growth is steady enough to be reported
+ *
+ * Return: Estimated growth in KB/s
+ */
+static double leak_rate(const struct leak_stat *ls, const struct leak_config *cfg,
+                        int *steady)
+{
+    double slope, r2;
+
+    *steady = 0;
+    if (ls->ctt <= 0.0)
+        return 0.0;
+
+    slope = ls->cty / ls->ctt;
+    r2 = ls->cyy > 0.0 ? (ls->cty * ls->cty) / (ls->ctt * ls->cyy) : 0.0;
+    if (ls->last - ls->first >= cfg->horizon && slope >= cfg->rate &&
+        r2 >= LEAK_MIN_R2)
+        *steady = 1;
+    return slope;
+}
+
+/**
+ * analyze_processes - Update per-process state and annotate tasks
+ * @tr: Process tracker
+ * @s: Latest sample; tasks are annotated in place
+ * @cfg: Monitor settings
+ *
+ * Runs in three passes: match rows to tracked processes and update their
+ * rates and leak trends, update every memory series of the anomaly
+ * detector in one vectorized sweep, then copy the anomaly results back
+ * onto the rows.
+ *
+ * Rates compare each process with itself in the previous sample. A new
+ * process, or a reused pid, gets its first rates with the next sample.
+ */
+static void analyze_processes(struct proc_tracker *tr, struct km_sample *s,
+                              const struct monitor_config *cfg)
+{
+    double dt = tr->last_time > 0.0 ? s->timestamp - tr->last_time : 0.0;
+    size_t i;
+
+    tr->seq++;
+    tr->last_time = s->timestamp;
+    tr->hist_head = (tr->hist_head + 1) % HISTORY_LEN;
+    for (i = 0; i < s->nr_tasks; i++) {
+        struct km_task *t = &s->tasks[i];
+        double y = (double)task_memory(s, t);
+        int created, steady;
+        long idx = tracker_lookup(tr, t->pid, t->start_time, &created);
+
+        tr->task_idx[i] = idx;
+        if (idx < 0)
+            continue;
+        tr->seen[idx] = tr->seq;
+        if (created)
+            tr->hist_len[idx] = 0;
+        tr->hist[idx * HISTORY_LEN + tr->hist_head] = (float)y;
+        if (tr->hist_len[idx] < HISTORY_LEN)
+            tr->hist_len[idx]++;
+        if (tr->sparklines) {
+            spark_render(&tr->hist[idx * HISTORY_LEN], tr->hist_head, tr->hist_len[idx],
+                         t->spark);
+            t->flags |= TASK_HISTORY;
+        }
+        if (created) {
+            tr->last_cpu[idx] = t->cpu_ns;
+            tr->last_mem[idx] = (unsigned long)y;
+            leak_start(&tr->leak[idx], s->timestamp, y);
+            ewma_bank_reset(&tr->mem_ewma, idx, (float)y);
+            continue;
+        }
+
+        if (dt > 0.0) {
+            if (!s->has_cpu)
+                t->cpu_pct = -1.0f;
+            else if (t->cpu_ns > tr->last_cpu[idx])
+                t->cpu_pct = (float)((t->cpu_ns - tr->last_cpu[idx]) / (dt * 1e7));
+            t->mem_rate = (float)((y - (double)tr->last_mem[idx]) / dt);
+            t->flags |= TASK_RATES;
+        }
+        tr->last_cpu[idx] = t->cpu_ns;
+        tr->last_mem[idx] = (unsigned long)y;
+
+        tr->mem_ewma.x[idx] = (float)y;
+        leak_update(&tr->leak[idx], s->timestamp, y, cfg->leak.horizon);
+        t->leak_rate = (float)leak_rate(&tr->leak[idx], &cfg->leak, &steady);
+        if (steady)
+            t->flags |= TASK_LEAKING;
+    }
+
+    /* Exited processes are updated too; the sweep drops them right after */
+    ewma_bank_update(&tr->mem_ewma, tr->count, &cfg->anomaly);
+
+    for (i = 0; i < s->nr_tasks; i++) {
+        long idx = tr->task_idx[i];
+
+        if (idx >= 0 && tr->mem_ewma.flag[idx]) {
+            s->tasks[i].flags |= TASK_ANOMALY;
+            s->tasks[i].mem_z = ewma_bank_z(&tr->mem_ewma, idx);
+        }
+    }
+    tracker_sweep(tr);
+}
+
+/**
+ * sort_swap - Exchange two array elements
+ * @a: First element
+ * @b: Second element
+ * @size: Element size in bytes
+ */
+static void sort_swap(unsigned char *a, unsigned char *b, size_t size)
+{
+    while (size--) {
+        unsigned char c = *a;
+
+        *a++ = *b;
+        *b++ = c;
+    }
+}
+
+/**
+ * sort_sift - Restore the heap property below one element
+ * @base: Array
+ * @root: Element to move down
+ * @n: Elements in the heap
+ * @size: Element size in bytes
+ * @cmp: Comparison function
+ */
+static void sort_sift(unsigned char *base, size_t root, size_t n, size_t size,
+                      int (*cmp)(const void *, const void *))
+{
+    size_t child;
+
+    while ((child = 2 * root + 1) < n) {
+        if (child + 1 < n && cmp(base + child * size, base + (child + 1) * size) < 0)
+            child++;
+        if (cmp(base + root * size, base + child * size) >= 0)
+            return;
+        sort_swap(base + root * size, base + child * size, size);
+        root = child;
+    }
+}
+
+/**
+ * sort_array - Sort an array in place
+ * @base: Array
+ * @n: Number of elements
+ * @size: Element size in bytes
+ * @cmp: Comparison function, as for qsort()
+ *
+ * Heapsort: O(n log n) without recursion or temporary memory. glibc's
+ * qsort() may call malloc(), which the sampling loop must not do.
+ */
+static void sort_array(void *base, size_t n, size_t size,
+                       int (*cmp)(const void *, const void *))
+{
+    unsigned char *b = base;
+    size_t i;
+
+    for (i = n / 2; i-- > 0;)
+        sort_sift(b, i, n, size, cmp);
+    for (i = n; i-- > 1;) {
+        sort_swap(b, b + i * size, size);
+        sort_sift(b, 0, i, size, cmp);
+    }
+}
+
+/**
+ * comm_table_init - Allocate a name table
+ * @ct: Table to initialize
+ * @max: Maximum number of names; at least the task capacity of a sample
+ *
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int comm_table_init(struct comm_table *ct, size_t max)
+{
+    size_t nslots = 16;
+
+    memset(ct, 0, sizeof(*ct));
+    while (nslots < max * 2)
+        nslots <<= 1;
+    if (arena_init(&ct->pool, nslots * sizeof(*ct->slots) +
+                   max * (sizeof(*ct->names) + sizeof(*ct->hash) + sizeof(*ct->group) +
+                          sizeof(*ct->stamp)) + 5 * ARENA_ALIGN) < 0)
+        return -1;
+    ct->slots = arena_alloc(&ct->pool, nslots * sizeof(*ct->slots));
+    ct->names = arena_alloc(&ct->pool, max * sizeof(*ct->names));
+    ct->hash = arena_alloc(&ct->pool, max * sizeof(*ct->hash));
+    ct->group = arena_alloc(&ct->pool, max * sizeof(*ct->group));
+    ct->stamp = arena_alloc(&ct->pool, max * sizeof(*ct->stamp));
+    ct->mask = nslots - 1;
+    ct->max = max;
+    return 0;
+}
+
+/**
+ * comm_table_free - Release a name table
+ * @ct: Table to release
+ */
+static void comm_table_free(struct comm_table *ct)
+{
+    arena_free(&ct->pool);
+    memset(ct, 0, sizeof(*ct));
+}
+
+/**
+ * comm_intern - Look up a name, adding it if it is new
+ * @ct: Table with room for one more name
+ * @comm: Task name, at most KMON_COMM_LEN bytes
+ *
+ * Return: Id of the name
+ */
+static uint32_t comm_intern(struct comm_table *ct, const char *comm)
+{
+    uint32_t h = 2166136261u, id;
+    size_t i, len = strnlen(comm, KMON_COMM_LEN);
+
+    /* FNV-1a */
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)comm[i]) * 16777619u;
+
+    for (i = h & ct->mask; ct->slots[i]; i = (i + 1) & ct->mask) {
+        id = ct->slots[i] - 1;
+        if (ct->hash[id] == h && strncmp(ct->names[id], comm, KMON_COMM_LEN) == 0)
+            return id;
+    }
+
+    id = ct->count++;
+    ct->slots[i] = id + 1;
+    ct->hash[id] = h;
+    memset(ct->names[id], 0, KMON_COMM_LEN);
+    memcpy(ct->names[id], comm, len);
+    ct->stamp[id] = 0;
+    return id;
+}
+
+/**
+ * group_compare - Order groups by memory, largest first
+ * @a: First group
+ * @b: Second group
+ */
+static int group_compare(const void *a, const void *b)
+{
+    const struct km_group *ga = a, *gb = b;
+
+    if (ga->mem_kb != gb->mem_kb)
+        return ga->mem_kb < gb->mem_kb ? 1 : -1;
+    return strncmp(ga->comm, gb->comm, KMON_COMM_LEN);
+}
+
+/**
+ * group_tasks - Aggregate a sample's tasks by name
+ * @ct: Name table
+ * @s: Sample; its group table is overwritten
+ *
+ * Runs after analyze_processes() so the CPU rates can be summed. Should
+ * the table fill up with names of processes long gone, it is emptied
+ * before the sample instead of growing.
+ */
+static void group_tasks(struct comm_table *ct, struct km_sample *s)
+{
+    size_t i;
+
+    if (ct->count + s->nr_tasks > ct->max) {
+        memset(ct->slots, 0, (ct->mask + 1) * sizeof(*ct->slots));
+        ct->count = 0;
+    }
+    ct->seq++;
+    s->nr_groups = 0;
+
+    for (i = 0; i < s->nr_tasks; i++) {
+        const struct km_task *t = &s->tasks[i];
+        unsigned long mem = task_memory(s, t);
+        uint32_t id = comm_intern(ct, t->comm);
+        struct km_group *g;
+
+        if (ct->stamp[id] != ct->seq) {
+            ct->stamp[id] = ct->seq;
+            ct->group[id] = s->nr_groups;
+            g = &s->groups[s->nr_groups++];
+            memcpy(g->comm, ct->names[id], KMON_COMM_LEN);
+            g->count = 0;
+            g->mem_kb = 0;
+            g->max_kb = 0;
+            g->cpu_pct = -1.0f;
+        }
+        g = &s->groups[ct->group[id]];
+        g->count++;
+        g->mem_kb += mem;
+        if (mem > g->max_kb)
+            g->max_kb = mem;
+        if ((t->flags & TASK_RATES) && t->cpu_pct >= 0.0f)
+            g->cpu_pct = (g->cpu_pct < 0.0f ? 0.0f : g->cpu_pct) + t->cpu_pct;
+    }
+    sort_array(s->groups, s->nr_groups, sizeof(*s->groups), group_compare);
+}
+
+/**
+ * tree_init - Allocate the scratch space of the process tree
+ * @pt: Workspace to initialize
+ * @max: Task capacity of the samples
+ *
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int tree_init(struct proc_tree *pt, size_t max)
+{
+    size_t nslots = 16;
+
+    memset(pt, 0, sizeof(*pt));
+    while (nslots < max * 2)
+        nslots <<= 1;
+    if (arena_init(&pt->pool, nslots * sizeof(*pt->slots) +
+                   max * (4 * sizeof(int) + 1) + 6 * ARENA_ALIGN) < 0)
+        return -1;
+    /* A fresh mapping is zeroed, so the table starts out empty */
+    pt->slots = arena_alloc(&pt->pool, nslots * sizeof(*pt->slots));
+    pt->parent = arena_alloc(&pt->pool, max * sizeof(int));
+    pt->first_child = arena_alloc(&pt->pool, max * sizeof(int));
+    pt->next_sibling = arena_alloc(&pt->pool, max * sizeof(int));
+    pt->stack = arena_alloc(&pt->pool, max * sizeof(int));
+    pt->visited = arena_alloc(&pt->pool, max);
+    pt->mask = nslots - 1;
+    pt->max = max;
+    return 0;
+}
+
+/**
+ * tree_free - Release the scratch space of the process tree
+ * @pt: Workspace to release
+ */
+static void tree_free(struct proc_tree *pt)
+{
+    arena_free(&pt->pool);
+    memset(pt, 0, sizeof(*pt));
+}
+
+/**
+ * tree_find_slot - Locate the slot holding a pid
+ * @pt: Workspace
+ * @pid: Process ID to look up
+ *
+ * Return: Slot index holding @pid, or the empty slot where it would go
+ */
+static size_t tree_find_slot(const struct proc_tree *pt, int pid)
+{
+    size_t i = pid_hash(pid, pt->mask);
+
+    while (pt->slots[i].pid != 0 && pt->slots[i].pid != pid)
+        i = (i + 1) & pt->mask;
+    return i;
+}
+
+/**
+ * tree_walk - Append a subtree to the sample's tree in depth-first order
+ * @pt: Workspace with the child lists built
+ * @s: Sample
+ * @root: Row to start from
+ *
+ * Walks the child lists with an explicit stack of ancestors. Rows already
+ * placed are skipped, so a parent loop in an inconsistent sample cannot
+ * make the walk run forever.
+ */
+static void tree_walk(struct proc_tree *pt, struct km_sample *s, int root)
+{
+    int row = root, sp = 0;
+
+    while (1) {
+        const struct km_task *t = &s->tasks[row];
+        struct km_node *n = &s->nodes[s->nr_nodes];
+        int child;
+
+        pt->visited[row] = 1;
+        n->row = row;
+        n->depth = sp;
+        n->parent = sp ? pt->stack[sp - 1] : -1;
+        n->descendants = 0;
+        n->subtree_kb = task_memory(s, t);
+        n->subtree_cpu = (t->flags & TASK_RATES) ? t->cpu_pct : -1.0f;
+
+        child = pt->first_child[row];
+        while (child >= 0 && pt->visited[child])
+            child = pt->next_sibling[child];
+        if (child >= 0) {
+            pt->stack[sp++] = s->nr_nodes++;
+            row = child;
+            continue;
+        }
+        s->nr_nodes++;
+
+        /* Leaf: continue with the next unvisited sibling of the nearest ancestor */
+        while (sp > 0) {
+            int sib = pt->next_sibling[row];
+
+            while (sib >= 0 && pt->visited[sib])
+                sib = pt->next_sibling[sib];
+            if (sib >= 0) {
+                row = sib;
+                break;
+            }
+            row = s->nodes[pt->stack[--sp]].row;
+        }
+        if (sp == 0 && pt->visited[row])
+            return;
+    }
+}
+
+/**
+ * tree_build - Arrange a sample's tasks into the process tree
+ * @pt: Workspace
+ * @s: Sample; its tree table is overwritten
+ * @max_depth: Levels to keep; deeper nodes are dropped once they are
+ *             counted in their ancestors' totals. 0 keeps all of them
+ *
+ * Maps pids to rows, links every row into its parent's child list and
+ * walks the lists from the roots, which are the processes whose parent is
+ * not in the sample. The subtree totals are then summed in one backward
+ * pass, since every node comes after its parent. All passes are linear.
+ */
+static void tree_build(struct proc_tree *pt, struct km_sample *s, unsigned int max_depth)
+{
+    size_t i, n = s->nr_tasks;
+
+    for (i = 0; i < n; i++) {
+        size_t slot = tree_find_slot(pt, s->tasks[i].pid);
+
+        /* A duplicate pid keeps its first row */
+        if (!pt->slots[slot].pid) {
+            pt->slots[slot].pid = s->tasks[i].pid;
+            pt->slots[slot].idx = i;
+        }
+        pt->first_child[i] = -1;
+        pt->next_sibling[i] = -1;
+        pt->visited[i] = 0;
+    }
+    /* Linked back to front, so children keep the order of the sample */
+    for (i = n; i-- > 0;) {
+        int ppid = s->tasks[i].ppid;
+        size_t slot = tree_find_slot(pt, ppid);
+
+        pt->parent[i] = -1;
+        if (ppid <= 0 || pt->slots[slot].pid != ppid || pt->slots[slot].idx == i)
+            continue;
+        pt->parent[i] = pt->slots[slot].idx;
+        pt->next_sibling[i] = pt->first_child[pt->parent[i]];
+        pt->first_child[pt->parent[i]] = i;
+    }
+    /*
+     * Empty the table for the next sample. Removing the pids in reverse
+     * order of insertion leaves each probe path intact until it is cleared.
+     */
+    for (i = n; i-- > 0;) {
+        size_t slot = tree_find_slot(pt, s->tasks[i].pid);
+
+        if (pt->slots[slot].idx == i)
+            pt->slots[slot].pid = 0;
+    }
+
+    s->nr_nodes = 0;
+    for (i = 0; i < n; i++)
+        if (pt->parent[i] < 0)
+            tree_walk(pt, s, i);
+    /* Only rows caught in a parent loop are left */
+    for (i = 0; i < n; i++)
+        if (!pt->visited[i])
+            tree_walk(pt, s, i);
+
+    for (i = s->nr_nodes; i-- > 0;) {
+        const struct km_node *c = &s->nodes[i];
+        struct km_node *p;
+
+        if (c->parent < 0)
+            continue;
+        p = &s->nodes[c->parent];
+        p->descendants += 1 + c->descendants;
+        p->subtree_kb += c->subtree_kb;
+        if (c->subtree_cpu >= 0.0f)
+            p->subtree_cpu = (p->subtree_cpu < 0.0f ? 0.0f : p->subtree_cpu) + c->subtree_cpu;
+    }
+
+    if (!max_depth)
+        return;
+    /* Collapse: keep the upper levels, renumbering parents through the stack */
+    for (i = 0, n = 0; i < s->nr_nodes; i++) {
+        struct km_node *c = &s->nodes[i];
+
+        if (c->depth >= max_depth)
+            continue;
+        pt->stack[i] = n;
+        if (c->parent >= 0)
+            c->parent = pt->stack[c->parent];
+        s->nodes[n++] = *c;
+    }
+    s->nr_nodes = n;
+}
+
+/**
+ * diff_init - Allocate the state of the lifecycle diff
+ * @d: State to initialize
+ * @max: Task capacity of the samples
+ *
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int diff_init(struct proc_diff *d, size_t max)
+{
+    memset(d, 0, sizeof(*d));
+    if (arena_init(&d->pool, 2 * (max * sizeof(*d->prev) + ARENA_ALIGN)) < 0)
+        return -1;
+    d->prev = arena_alloc(&d->pool, max * sizeof(*d->prev));
+    d->cur = arena_alloc(&d->pool, max * sizeof(*d->cur));
+    d->max = max;
+    return 0;
+}
+
+/**
+ * diff_free - Release the state of the lifecycle diff
+ * @d: State to release
+ */
+static void diff_free(struct proc_diff *d)
+{
+    arena_free(&d->pool);
+    memset(d, 0, sizeof(*d));
+}
+
+/**
+ * key_compare - Order processes by pid, then start time
+ * @a: First process
+ * @b: Second process
+ */
+static int key_compare(const void *a, const void *b)
+{
+    const struct proc_key *ka = a, *kb = b;
+
+    if (ka->pid != kb->pid)
+        return ka->pid < kb->pid ? -1 : 1;
+    if (ka->start != kb->start)
+        return ka->start < kb->start ? -1 : 1;
+    return 0;
+}
+
+/**
+ * diff_add - Append an entry to a sample's lifecycle diff
+ * @s: Sample
+ * @k: Process
+ * @kind: What happened to it
+ * @delta: Change of its memory figure
+ */
+static void diff_add(struct km_sample *s, const struct proc_key *k, int kind, long delta)
+{
+    struct km_change *c;
+
+    if (s->nr_changes == s->max_tasks) {
+        s->dropped_changes++;
+        return;
+    }
+    c = &s->changes[s->nr_changes++];
+    memcpy(c->comm, k->comm, sizeof(c->comm));
+    c->pid = k->pid;
+    c->kind = kind;
+    c->mem_kb = k->mem_kb;
+    c->delta_kb = delta;
+}
+
+/**
+ * diff_processes - Compare a sample's processes with the previous sample
+ * @d: Diff state
+ * @s: Sample; its change table is overwritten
+ *
+ * Both samples are kept sorted by (pid, start time), so one merge pass
+ * finds the processes only in the new sample, only in the old one, and
+ * in both. A reused pid differs in its start time and is reported as an
+ * exit and a start. The first sample only primes the state.
+ */
+static void diff_processes(struct proc_diff *d, struct km_sample *s)
+{
+    struct proc_key *tmp;
+    size_t i, j = 0, n = s->nr_tasks < d->max ? s->nr_tasks : d->max;
+
+    for (i = 0; i < n; i++) {
+        const struct km_task *t = &s->tasks[i];
+
+        d->cur[i].pid = t->pid;
+        d->cur[i].start = t->start_time;
+        d->cur[i].mem_kb = task_memory(s, t);
+        memcpy(d->cur[i].comm, t->comm, sizeof(t->comm));
+    }
+    sort_array(d->cur, n, sizeof(*d->cur), key_compare);
+
+    s->nr_changes = 0;
+    s->dropped_changes = 0;
+    s->has_changes = d->primed;
+    for (i = 0; d->primed && (i < d->nr_prev || j < n);) {
+        const struct proc_key *old = &d->prev[i], *now = &d->cur[j];
+        int cmp = i == d->nr_prev ? 1 : j == n ? -1 : key_compare(old, now);
+        long delta;
+
+        if (cmp < 0) {
+            diff_add(s, old, CHANGE_EXITED, -(long)old->mem_kb);
+            i++;
+        } else if (cmp > 0) {
+            diff_add(s, now, CHANGE_NEW, (long)now->mem_kb);
+            j++;
+        } else {
+            delta = (long)now->mem_kb - (long)old->mem_kb;
+            if (labs(delta) >= DIFF_CHANGE_MIN_KB &&
+                labs(delta) >= old->mem_kb * (DIFF_CHANGE_PCT / 100.0))
+                diff_add(s, now, CHANGE_MEMORY, delta);
+            i++;
+            j++;
+        }
+    }
+
+    tmp = d->prev;
+    d->prev = d->cur;
+    d->cur = tmp;
+    d->nr_prev = n;
+    d->primed = 1;
+}
+
+/**
+ * forecast_update - Feed one free memory observation into the forecast
+ * @f: Forecast state
+ * @t: Observation time in seconds
+ * @y: Free RAM in pages
+ * @window: Time constant of the trend in seconds
+ *
+ * Holt's linear trend smoothing with time-aware gains. The one-step
+ * prediction error is clipped to a few running MADs before it updates the
+ * level and trend, so a single large allocation or cache drop does not
+ * swing the forecast. Constant time and space per sample.
+ */
+static void forecast_update(struct oom_forecast *f, double t, double y, double window)
+{
+    double dt, pred, err, limit, a, b;
+
+    if (f->n++ == 0) {
+        f->level = y;
+        f->trend = 0.0;
+        f->mad = 0.0;
+        f->last = t;
+        return;
+    }
+
+    dt = t - f->last;
+    if (dt <= 0.0)
+        return;
+    f->last = t;
+
+    pred = f->level + f->trend * dt;
+    err = y - pred;
+    if (f->n > FORECAST_WARMUP) {
+        limit = FORECAST_CLIP * f->mad;
+        if (err > limit)
+            err = limit;
+        else if (err < -limit)
+            err = -limit;
+    }
+
+    /* Level follows quickly, the trend over the configured window */
+    a = 1.0 - exp(-dt * 4.0 / window);
+    b = 1.0 - exp(-dt / window);
+    f->mad += a * (fabs(y - pred) - f->mad);
+    f->level = pred + a * err;
+    f->trend += b * a * err / dt;
+}
+
+/**
+ * forecast_eta - Time until free memory is exhausted
+ * @f: Forecast state
+ *
+ * Return: Seconds until the trend reaches zero, 0 if memory is not shrinking
+ */
+static double forecast_eta(const struct oom_forecast *f)
+{
+    if (f->n <= FORECAST_WARMUP || f->trend >= 0.0 || f->level <= 0.0)
+        return 0.0;
+    return f->level / -f->trend;
+}
+
+/**
+ * sys_state_init - Allocate the system-wide analysis state
+ * @st: State to initialize
+ *
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int sys_state_init(struct sys_state *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (ewma_bank_init(&st->ewma[SERIES_CPU], 1, EWMA_MIN_SD_CPU) < 0 ||
+        ewma_bank_init(&st->ewma[SERIES_FREE_RAM], 1, EWMA_MIN_SD_PAGES) < 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * sys_state_free - Release the system-wide analysis state
+ * @st: State to release
+ */
+static void sys_state_free(struct sys_state *st)
+{
+    int i;
+
+    for (i = 0; i < SERIES_MAX; i++)
+        ewma_bank_free(&st->ewma[i]);
+}
+
+/**
+ * sys_series_update - Feed one observation into a system series
+ * @st: System analysis state
+ * @i: Series index
+ * @x: Observation
+ * @cfg: Anomaly detector settings
+ */
+static void sys_series_update(struct sys_state *st, enum sys_series i, float x,
+                              const struct anomaly_config *cfg)
+{
+    struct ewma_bank *b = &st->ewma[i];
+
+    if (!(st->started & (1u << i))) {
+        ewma_bank_reset(b, 0, x);
+        st->started |= 1u << i;
+    }
+    b->x[0] = x;
+    ewma_bank_update(b, 1, cfg);
+
+    st->hist_head[i] = (st->hist_head[i] + 1) % HISTORY_LEN;
+    st->hist[i][st->hist_head[i]] = x;
+    if (st->hist_len[i] < HISTORY_LEN)
+        st->hist_len[i]++;
+}
+
+/**
+ * analyze_system - Update system-wide series from a sample
+ * @st: System analysis state
+ * @s: Latest sample; CPU, forecast and anomaly fields are filled in
+ * @cfg: Monitor settings
+ */
+static void analyze_system(struct sys_state *st, struct km_sample *s,
+                           const struct monitor_config *cfg)
+{
+    unsigned long long busy = s->cpu_user + s->cpu_system;
+    unsigned long long total = busy + s->cpu_idle;
+    int i;
+
+    s->cpu_busy = -1.0;
+    if (st->prev_total && total > st->prev_total)
+        s->cpu_busy = 100.0 * (double)(busy - st->prev_busy) /
+                      (double)(total - st->prev_total);
+    st->prev_busy = busy;
+    st->prev_total = total;
+
+    forecast_update(&st->forecast, s->timestamp, (double)s->free_ram,
+                    cfg->forecast_window);
+    s->free_trend = st->forecast.n > FORECAST_WARMUP ? st->forecast.trend : 0.0;
+    s->oom_eta = forecast_eta(&st->forecast);
+
+    /* The CPU series starts one sample late, once a delta exists */
+    if (s->cpu_busy >= 0.0)
+        sys_series_update(st, SERIES_CPU, (float)s->cpu_busy, &cfg->anomaly);
+    sys_series_update(st, SERIES_FREE_RAM, (float)s->free_ram, &cfg->anomaly);
+
+    s->sys_anomaly = 0;
+    for (i = 0; i < SERIES_MAX; i++) {
+        spark_render(st->hist[i], st->hist_head[i], st->hist_len[i], s->sys_spark[i]);
+        s->sys_z[i] = ewma_bank_z(&st->ewma[i], 0);
+        if (st->ewma[i].flag[0])
+            s->sys_anomaly |= 1u << i;
+    }
+}
+
+/**
+ * format_duration - Format a number of seconds as a short duration
+ * @buf: Output buffer
+ * @size: Size of @buf
+ * @secs: Duration in seconds
+ */
+static void format_duration(char *buf, size_t size, double secs)
+{
+    unsigned long s = (unsigned long)secs;
+
+    if (s >= 86400)
+        snprintf(buf, size, "%lud %luh", s / 86400, (s % 86400) / 3600);
+    else if (s >= 3600)
+        snprintf(buf, size, "%luh %lum", s / 3600, (s % 3600) / 60);
+    else if (s >= 60)
+        snprintf(buf, size, "%lum %lus", s / 60, s % 60);
+    else
+        snprintf(buf, size, "%lus", s);
+}
+
+/**
+ * struct rule_name - Spelling of a rule operand
+ * @name: Identifier used in rule source
+ * @metric: Operand it selects
+ */
+struct rule_name {
+    const char *name;
+    enum rule_metric metric;
+};
+
+static const struct rule_name rule_sys_metrics[] = {
+    { "cpu.busy_pct",   METRIC_CPU_BUSY },
+    { "mem.free_mb",    METRIC_MEM_FREE_MB },
+    { "mem.free_pages", METRIC_MEM_FREE_PAGES },
+    { "mem.used_pct",   METRIC_MEM_USED_PCT },
+    { "mem.oom_eta_s",  METRIC_MEM_OOM_ETA },
+    { "procs.count",    METRIC_PROC_COUNT },
+};
+
+static const struct rule_name rule_proc_fields[] = {
+    { "rss_kb",         METRIC_PROC_RSS },
+    { "mem_kb",         METRIC_PROC_MEM },
+    { "leak_kbps",      METRIC_PROC_LEAK },
+    { "mem_z",          METRIC_PROC_Z },
+    { "cpu_pct",        METRIC_PROC_CPU },
+    { "growth_kbps",    METRIC_PROC_GROWTH },
+};
+
+static const char *const rule_op_names[] = {
+    [OP_LT] = "<", [OP_LE] = "<=", [OP_GT] = ">",
+    [OP_GE] = ">=", [OP_EQ] = "==", [OP_NE] = "!=",
+};
+
+/**
+ * rule_lookup_metric - Match an identifier against a metric table
+ * @p: Start of the identifier
+ * @len: Length of the identifier
+ * @table: Table to search
+ * @n: Number of entries in @table
+ *
+ * Return: Index into @table, or -1 if not found
+ */
+static int rule_lookup_metric(const char *p, size_t len,
+                              const struct rule_name *table, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        if (strlen(table[i].name) == len && strncmp(table[i].name, p, len) == 0)
+            return i;
+    return -1;
+}
+
+/**
+ * rule_compile - Parse one rule into its compiled form
+ * @text: Rule source
+ * @r: Output rule
+ *
+ * Grammar: METRIC OP NUMBER [for DURATION], where METRIC is one of the
+ * system metrics or proc[name=COMM].FIELD / proc[pid=N].FIELD, and
+ * DURATION is a number with an optional s, m or h suffix.
+ *
+ * Return: 0 on success, -1 on a syntax error (reported on stderr)
+ */
+static int rule_compile(const char *text, struct rule *r)
+{
+    const char *p = text;
+    const char *start;
+    char *end;
+    int idx;
+
+    memset(r, 0, sizeof(*r));
+    r->since = -1.0;
+    snprintf(r->text, sizeof(r->text), "%s", text);
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+
+    if (strncmp(p, "proc[", 5) == 0) {
+        const char *val;
+
+        p += 5;
+        if (strncmp(p, "name=", 5) == 0) {
+            val = p + 5;
+            p = strchr(val, ']');
+            if (!p || p == val || (size_t)(p - val) >= sizeof(r->name))
+                goto bad_selector;
+            memcpy(r->name, val, p - val);
+        } else if (strncmp(p, "pid=", 4) == 0) {
+            r->by_pid = 1;
+            r->pid = strtol(p + 4, &end, 10);
+            p = end;
+            if (*p != ']' || r->pid <= 0)
+                goto bad_selector;
+        } else {
+            goto bad_selector;
+        }
+        if (p[1] != '.')
+            goto bad_metric;
+        p += 2;
+        start = p;
+        while (*p && *p != ' ' && !strchr("<>=!", *p))
+            p++;
+        idx = rule_lookup_metric(start, p - start, rule_proc_fields,
+                                 sizeof(rule_proc_fields) / sizeof(rule_proc_fields[0]));
+        if (idx < 0)
+            goto bad_metric;
+        r->metric = rule_proc_fields[idx].metric;
+    } else {
+        start = p;
+        while (*p && *p != ' ' && !strchr("<>=!", *p))
+            p++;
+        idx = rule_lookup_metric(start, p - start, rule_sys_metrics,
+                                 sizeof(rule_sys_metrics) / sizeof(rule_sys_metrics[0]));
+        if (idx < 0)
+            goto bad_metric;
+        r->metric = rule_sys_metrics[idx].metric;
+    }
+
+    while (*p == ' ')
+        p++;
+    for (idx = OP_NE; idx >= 0; idx--) {
+        size_t n = strlen(rule_op_names[idx]);
+
+        /* Two-character operators are listed after their prefixes */
+        if (strncmp(p, rule_op_names[idx], n) == 0 && (n == 2 || p[1] != '=')) {
+            r->op = idx;
+            p += n;
+            break;
+        }
+    }
+    if (idx < 0) {
+        fprintf(stderr, "Error: Rule '%s': expected a comparison operator\n", text);
+        return -1;
+    }
+
+    r->threshold = strtod(p, &end);
+    if (end == p) {
+        fprintf(stderr, "Error: Rule '%s': expected a number\n", text);
+        return -1;
+    }
+    p = end;
+    while (*p == ' ')
+        p++;
+
+    if (strncmp(p, "for ", 4) == 0) {
+        p += 4;
+        r->hold = strtod(p, &end);
+        if (end == p || r->hold < 0)
+            goto bad_duration;
+        p = end;
+        if (*p == 'm')
+            r->hold *= 60, p++;
+        else if (*p == 'h')
+            r->hold *= 3600, p++;
+        else if (*p == 's')
+            p++;
+        while (*p == ' ')
+            p++;
+    }
+    if (*p && *p != '\n' && *p != '#') {
+        fprintf(stderr, "Error: Rule '%s': unexpected '%s'\n", text, p);
+        return -1;
+    }
+    return 0;
+
+bad_selector:
+    fprintf(stderr, "Error: Rule '%s': expected proc[name=COMM] or proc[pid=N]\n", text);
+    return -1;
+bad_metric:
+    fprintf(stderr, "Error: Rule '%s': unknown metric\n", text);
+    return -1;
+bad_duration:
+    fprintf(stderr, "Error: Rule '%s': invalid duration\n", text);
+    return -1;
+}
+
+/**
+ * alert_add_rule - Compile a rule into the engine
+ * @ae: Alert engine
+ * @text: Rule source
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int alert_add_rule(struct alert_engine *ae, const char *text)
+{
+    if (ae->nr_rules == MAX_RULES) {
+        fprintf(stderr, "Error: Too many rules (at most %d)\n", MAX_RULES);
+        return -1;
+    }
+    if (rule_compile(text, &ae->rules[ae->nr_rules]) < 0)
+        return -1;
+    ae->nr_rules++;
+    return 0;
+}
+
+/**
+ * alert_load_rules - Compile every rule in a file
+ * @ae: Alert engine
+ * @path: Rule file; blank lines and lines starting with '#' are skipped
+ *
+ * Return: 0 on success, -1 on error
+ */
+static int alert_load_rules(struct alert_engine *ae, const char *path)
+{
+    char line[RULE_TEXT_LEN * 2];
+    FILE *f = fopen(path, "r");
+    int ret = 0;
+
+    if (!f) {
+        fprintf(stderr, "Error: Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (ret == 0 && fgets(line, sizeof(line), f)) {
+        char *p = line;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p && *p != '#')
+            ret = alert_add_rule(ae, p);
+    }
+    fclose(f);
+    return ret;
+}
+
+/**
+ * filter_add_name - Add a name pattern to the trie
+ * @f: Filter
+ * @pat: Task name, or a prefix followed by '*'
+ * @len: Length of @pat
+ *
+ * Return: 0 on success, -1 on error (reported on stderr)
+ */
+static int filter_add_name(struct task_filter *f, const char *pat, size_t len)
+{
+    unsigned int n = 0, flag = FILTER_EXACT;
+    size_t i, full = len;
+
+    if (len && pat[len - 1] == '*') {
+        flag = FILTER_PREFIX;
+        len--;
+    }
+    if (!full || memchr(pat, '*', len)) {
+        fprintf(stderr, "Error: Filter '%.*s': expected a name, optionally ending in '*'\n",
+                (int)full, pat);
+        return -1;
+    }
+    if (len >= KMON_COMM_LEN) {
+        fprintf(stderr, "Error: Filter '%.*s': task names have at most %d characters\n",
+                (int)len, pat, KMON_COMM_LEN - 1);
+        return -1;
+    }
+    if (!f->nr_nodes)
+        f->nr_nodes = 1;
+
+    for (i = 0; i < len; i++) {
+        unsigned int c = f->nodes[n].child;
+
+        while (c && f->nodes[c].c != (unsigned char)pat[i])
+            c = f->nodes[c].sibling;
+        if (!c) {
+            if (f->nr_nodes == MAX_FILTER_NODES) {
+                fprintf(stderr, "Error: Too many name filters\n");
+                return -1;
+            }
+            c = f->nr_nodes++;
+            f->nodes[c].c = pat[i];
+            f->nodes[c].sibling = f->nodes[n].child;
+            f->nodes[n].child = c;
+        }
+        n = c;
+    }
+    f->nodes[n].flags |= flag;
+    f->nr_names++;
+    return 0;
+}
+
+/**
+ * filter_add_range - Parse an ID or ID range
+ * @ranges: Range array
+ * @nr: Number of valid entries in @ranges
+ * @text: "N" or "LO-HI"
+ * @len: Length of @text
+ *
+ * Return: 0 on success, -1 on error (reported on stderr)
+ */
+static int filter_add_range(struct id_range *ranges, unsigned int *nr,
+                            const char *text, size_t len)
+{
+    char buf[48], *end;
+    struct id_range r;
+
+    if (len == 0 || len >= sizeof(buf))
+        goto bad;
+    memcpy(buf, text, len);
+    buf[len] = '\0';
+    if (buf[0] < '0' || buf[0] > '9')
+        goto bad;
+    r.lo = r.hi = strtoul(buf, &end, 10);
+    if (*end == '-') {
+        if (end[1] < '0' || end[1] > '9')
+            goto bad;
+        r.hi = strtoul(end + 1, &end, 10);
+    }
+    if (*end || r.hi < r.lo)
+        goto bad;
+    if (*nr == MAX_FILTER_RANGES) {
+        fprintf(stderr, "Error: Too many ID filters (at most %d per kind)\n",
+                MAX_FILTER_RANGES);
+        return -1;
+    }
+    ranges[(*nr)++] = r;
+    return 0;
+
+bad:
+    fprintf(stderr, "Error: Filter '%.*s': expected an ID or a range LO-HI\n",
+            (int)len, text);
+    return -1;
+}
+
+/**
+ * filter_add - Compile one --filter option
+ * @f: Filter
+ * @text: "name=PAT[,PAT...]", "pid=RANGE[,RANGE...]" or "uid=RANGE[,...]"
+ *
+ * Return: 0 on success, -1 on error (reported on stderr)
+ */
+static int filter_add(struct task_filter *f, const char *text)
+{
+    const char *list = strchr(text, '=');
+    size_t key;
+
+    if (!list || !list[1]) {
+        fprintf(stderr, "Error: Filter '%s': expected name=, pid= or uid=\n", text);
+        return -1;
+    }
+    key = list - text;
+    list++;
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        int r;
+
+        if (key == 4 && strncmp(text, "name", 4) == 0) {
+            r = filter_add_name(f, list, len);
+        } else if (key == 3 && strncmp(text, "pid", 3) == 0) {
+            r = filter_add_range(f->pids, &f->nr_pids, list, len);
+        } else if (key == 3 && strncmp(text, "uid", 3) == 0) {
+            r = filter_add_range(f->uids, &f->nr_uids, list, len);
+        } else {
+            fprintf(stderr, "Error: Filter '%s': expected name=, pid= or uid=\n", text);
+            return -1;
+        }
+        if (r < 0)
+            return -1;
+        list += len;
+        if (*list == ',')
+            list++;
+    }
+    return 0;
+}
+
+/**
+ * filter_merge - Sort ranges and merge the ones that touch
+ * @ranges: Range array
+ * @nr: Number of valid entries in @ranges, updated
+ */
+static void filter_merge(struct id_range *ranges, unsigned int *nr)
+{
+    unsigned int i, j, n = 0;
+
+    for (i = 1; i < *nr; i++) {
+        struct id_range r = ranges[i];
+
+        for (j = i; j > 0 && ranges[j - 1].lo > r.lo; j--)
+            ranges[j] = ranges[j - 1];
+        ranges[j] = r;
+    }
+    for (i = 0; i < *nr; i++) {
+        if (n && ranges[i].lo <= ranges[n - 1].hi + 1) {
+            if (ranges[i].hi > ranges[n - 1].hi)
+                ranges[n - 1].hi = ranges[i].hi;
+        } else {
+            ranges[n++] = ranges[i];
+        }
+    }
+    *nr = n;
+}
+
+/**
+ * filter_finish - Prepare a filter for matching once all options are in
+ * @f: Filter
+ */
+static void filter_finish(struct task_filter *f)
+{
+    filter_merge(f->pids, &f->nr_pids);
+    filter_merge(f->uids, &f->nr_uids);
+}
+
+/**
+ * filter_range - Check an ID against sorted, merged ranges
+ * @ranges: Range array
+ * @nr: Number of valid entries in @ranges
+ * @id: ID to check
+ */
+static int filter_range(const struct id_range *ranges, unsigned int nr, unsigned long id)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr && ranges[i].lo <= id; i++)
+        if (id <= ranges[i].hi)
+            return 1;
+    return 0;
+}
+
+/**
+ * filter_name - Check a task name against the name patterns
+ * @f: Filter with at least one name pattern
+ * @comm: Task name
+ */
+static int filter_name(const struct task_filter *f, const char *comm)
+{
+    unsigned int n = 0;
+    size_t i;
+
+    for (i = 0;; i++) {
+        if (f->nodes[n].flags & FILTER_PREFIX)
+            return 1;
+        if (i == KMON_COMM_LEN || !comm[i])
+            return !!(f->nodes[n].flags & FILTER_EXACT);
+        for (n = f->nodes[n].child; n && f->nodes[n].c != (unsigned char)comm[i];
+             n = f->nodes[n].sibling)
+            ;
+        if (!n)
+            return 0;
+    }
+}
+
+/**
+ * filter_match - Decide whether a task is kept
+ * @f: Filter
+ * @t: Task as decoded by libkmon
+ * @has_uid: Non-zero if @t carries its user ID; without it no uid filter
+ *           matches
+ */
+static int filter_match(const struct task_filter *f, const struct kmon_task *t, int has_uid)
+{
+    if (f->nr_names && !filter_name(f, t->comm))
+        return 0;
+    if (f->nr_pids && (t->pid < 0 || !filter_range(f->pids, f->nr_pids, t->pid)))
+        return 0;
+    if (f->nr_uids && (!has_uid || !filter_range(f->uids, f->nr_uids, t->uid)))
+        return 0;
+    return 1;
+}
+
+/**
+ * rule_compare - Apply a rule's operator
+ * @r: Rule
+ * @v: Left-hand value
+ */
+static int rule_compare(const struct rule *r, double v)
+{
+    switch (r->op) {
+    case OP_LT: return v < r->threshold;
+    case OP_LE: return v <= r->threshold;
+    case OP_GT: return v > r->threshold;
+    case OP_GE: return v >= r->threshold;
+    case OP_EQ: return v == r->threshold;
+    case OP_NE: return v != r->threshold;
+    }
+    return 0;
+}
+
+/**
+ * rule_proc_value - Read a per-process operand
+ * @s: Sample
+ * @t: Task
+ * @metric: Operand
+ */
+static double rule_proc_value(const struct km_sample *s, const struct km_task *t,
+                              enum rule_metric metric)
+{
+    switch (metric) {
+    case METRIC_PROC_RSS:  return s->has_rss ? t->rss_kb : t->mem_kb;
+    case METRIC_PROC_MEM:  return t->mem_kb;
+    case METRIC_PROC_LEAK: return t->leak_rate;
+    case METRIC_PROC_Z:    return t->mem_z;
+    case METRIC_PROC_CPU:  return t->cpu_pct;
+    case METRIC_PROC_GROWTH: return t->mem_rate;
+    default:               return 0.0;
+    }
+}
+
+/**
+ * rule_eval - Evaluate a rule against a sample
+ * @r: Rule
+ * @s: Sample
+ * @value: Set to the value that satisfied the rule, or the last one checked
+ * @pid: Set to the matching process for process rules, 0 otherwise
+ *
+ * Process rules hold if any selected process satisfies the comparison.
+ * Processes without a known value for a rate operand are skipped.
+ *
+ * Return: Non-zero if the condition holds
+ */
+static int rule_eval(const struct rule *r, const struct km_sample *s,
+                     double *value, int *pid)
+{
+    size_t i;
+
+    *pid = 0;
+    switch (r->metric) {
+    case METRIC_CPU_BUSY:
+        *value = s->cpu_busy;
+        return s->cpu_busy >= 0.0 && rule_compare(r, *value);
+    case METRIC_MEM_FREE_MB:
+        *value = s->free_ram * page_kb / 1024.0;
+        return rule_compare(r, *value);
+    case METRIC_MEM_FREE_PAGES:
+        *value = s->free_ram;
+        return rule_compare(r, *value);
+    case METRIC_MEM_USED_PCT:
+        *value = s->total_ram ? 100.0 * (s->total_ram - s->free_ram) / s->total_ram : 0.0;
+        return rule_compare(r, *value);
+    case METRIC_MEM_OOM_ETA:
+        *value = s->oom_eta > 0.0 ? s->oom_eta : INFINITY;
+        return rule_compare(r, *value);
+    case METRIC_PROC_COUNT:
+        *value = s->total_processes;
+        return rule_compare(r, *value);
+    default:
+        break;
+    }
+
+    *value = 0.0;
+    for (i = 0; i < s->nr_tasks; i++) {
+        const struct km_task *t = &s->tasks[i];
+
+        if (r->by_pid ? t->pid != r->pid : strcmp(t->comm, r->name) != 0)
+            continue;
+        /* A process has no rates until its second sample, nor CPU without the column */
+        if ((r->metric == METRIC_PROC_CPU || r->metric == METRIC_PROC_GROWTH) &&
+            !(t->flags & TASK_RATES))
+            continue;
+        if (r->metric == METRIC_PROC_CPU && t->cpu_pct < 0.0f)
+            continue;
+        *value = rule_proc_value(s, t, r->metric);
+        if (rule_compare(r, *value)) {
+            *pid = t->pid;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * alert_emit - Deliver one alert to every configured destination
+ * @ae: Alert engine
+ * @ev: State change
+ * @scratch: Arena for the hook's environment
+ */
+static void alert_emit(const struct alert_engine *ae, const struct alert_event *ev,
+                       struct arena *scratch)
+{
+    const struct rule *r = &ae->rules[ev->rule];
+    char line[ALERT_LINE_LEN];
+    char val[32];
+    const char *state = ev->firing ? "FIRING" : "RESOLVED";
+    double value = ev->value;
+    int pid = ev->pid;
+    time_t now = time(NULL);
+    struct tm tm;
+    int len;
+
+    snprintf(val, sizeof(val), "%g", value);
+    localtime_r(&now, &tm);
+    len = snprintf(line, sizeof(line), "%04d-%02d-%02d %02d:%02d:%02d ALERT %s: %s (value=%s",
+                   tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                   tm.tm_hour, tm.tm_min, tm.tm_sec, state, r->text, val);
+    if (pid && len < (int)sizeof(line))
+        len += snprintf(line + len, sizeof(line) - len, ", pid=%d", pid);
+    if (len < (int)sizeof(line) - 2)
+        len += snprintf(line + len, sizeof(line) - len, ")\n");
+    else
+        len = sizeof(line) - 1;
+
+    if (write(STDERR_FILENO, line, len) < 0) {
+        /* Nothing sensible to do if stderr is gone */
+    }
+    if (ae->fd >= 0 && write(ae->fd, line, len) < 0)
+        fprintf(stderr, "Error: Failed to write alert: %s\n", strerror(errno));
+
+    if (ae->exec) {
+        /*
+         * Other threads may hold allocator locks at fork time, so the
+         * environment is built here and the child only calls execve().
+         */
+        char env_state[32], env_rule[RULE_TEXT_LEN + 16], env_value[48];
+        char *argv[] = { "sh", "-c", (char *)ae->exec, NULL };
+        char **envp;
+        size_t n = 0, i;
+        pid_t child;
+
+        while (environ[n])
+            n++;
+        envp = arena_alloc(scratch, (n + 4) * sizeof(*envp));
+        if (!envp) {
+            fprintf(stderr, "Error: Failed to run alert hook: Environment too large\n");
+            return;
+        }
+        snprintf(env_state, sizeof(env_state), "KM_ALERT_STATE=%s", state);
+        snprintf(env_rule, sizeof(env_rule), "KM_ALERT_RULE=%s", r->text);
+        snprintf(env_value, sizeof(env_value), "KM_ALERT_VALUE=%s", val);
+        for (i = 0; i < n; i++)
+            envp[i] = environ[i];
+        envp[n++] = env_state;
+        envp[n++] = env_rule;
+        envp[n++] = env_value;
+        envp[n] = NULL;
+
+        child = fork();
+        if (child == 0) {
+            execve("/bin/sh", argv, envp);
+            _exit(127);
+        } else if (child < 0) {
+            fprintf(stderr, "Error: Failed to run alert hook: %s\n", strerror(errno));
+        }
+    }
+}
+
+/**
+ * alert_record - Note a state change in the sample
+ * @s: Sample
+ * @rule: Rule index
+ * @firing: New state
+ * @value: Value that caused the change
+ * @pid: Matching process, 0 if none
+ */
+static void alert_record(struct km_sample *s, int rule, int firing, double value, int pid)
+{
+    struct alert_event *ev = &s->alert_events[s->nr_alert_events++];
+
+    ev->rule = rule;
+    ev->firing = firing;
+    ev->value = value;
+    ev->pid = pid;
+}
+
+/**
+ * alert_evaluate - Run every rule against a sample
+ * @ae: Alert engine
+ * @s: Latest sample, annotated with the firing rules and state changes
+ *
+ * Alerts fire once a condition has held for the rule's duration and
+ * resolve as soon as it stops holding. Only rule state is updated here;
+ * alert_deliver() sends the notifications.
+ */
+static void alert_evaluate(struct alert_engine *ae, struct km_sample *s)
+{
+    int i;
+
+    s->alerts_firing = 0;
+    s->nr_alert_events = 0;
+    for (i = 0; i < ae->nr_rules; i++) {
+        struct rule *r = &ae->rules[i];
+        double value;
+        int pid;
+        int holds = rule_eval(r, s, &value, &pid);
+
+        if (!holds) {
+            r->since = -1.0;
+            if (r->firing) {
+                r->firing = 0;
+                alert_record(s, i, 0, value, pid);
+            }
+            continue;
+        }
+
+        if (r->since < 0.0)
+            r->since = s->timestamp;
+        if (!r->firing && s->timestamp - r->since >= r->hold) {
+            r->firing = 1;
+            alert_record(s, i, 1, value, pid);
+        }
+        if (r->firing)
+            s->alerts_firing |= 1ull << i;
+    }
+}
+
+/**
+ * alert_deliver - Send the notifications for a sample's state changes
+ * @ae: Alert engine
+ * @s: Sample annotated by alert_evaluate()
+ * @scratch: Arena for the alert hooks
+ */
+static void alert_deliver(const struct alert_engine *ae, const struct km_sample *s,
+                          struct arena *scratch)
+{
+    int i;
+
+    /* Reap finished alert hooks */
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;
+
+    for (i = 0; i < s->nr_alert_events; i++)
+        alert_emit(ae, &s->alert_events[i], scratch);
+}
+
+/**
+ * tb_reserve - Allocate a buffer's memory up front
+ * @tb: Empty buffer
+ * @cap: Bytes to reserve
+ *
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int tb_reserve(struct text_buf *tb, size_t cap)
+{
+    tb->data = mem_alloc(cap);
+    if (!tb->data)
+        return -1;
+    tb->cap = cap;
+    return 0;
+}
+
+/**
+ * tb_printf - Append formatted text to a buffer
+ * @tb: Buffer
+ * @fmt: printf-style format
+ */
+static void tb_printf(struct text_buf *tb, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void tb_printf(struct text_buf *tb, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;) {
+        size_t room = tb->cap - tb->len;
+
+        va_start(ap, fmt);
+        n = vsnprintf(tb->data ? tb->data + tb->len : NULL, room, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            tb->failed = 1;
+            return;
+        }
+        if ((size_t)n < room) {
+            tb->len += n;
+            return;
+        }
+
+        /* Grow and retry; only if the reservation was too small */
+        {
+            size_t new_cap = tb->cap ? tb->cap * 2 : BUFFER_SIZE;
+            char *p;
+
+            while (new_cap - tb->len <= (size_t)n)
+                new_cap *= 2;
+            p = mem_realloc(tb->data, new_cap);
+            if (!p) {
+                tb->failed = 1;
+                return;
+            }
+            tb->data = p;
+            tb->cap = new_cap;
+        }
+    }
+}
+
+/**
+ * tb_label - Append a quoted, escaped OpenMetrics label value
+ * @tb: Buffer
+ * @val: Raw label value
+ */
+static void tb_label(struct text_buf *tb, const char *val)
+{
+    char esc[2 * RULE_TEXT_LEN + 3];
+    size_t n = 0;
+
+    esc[n++] = '"';
+    for (; *val && n < sizeof(esc) - 3; val++) {
+        if (*val == '\\' || *val == '"') {
+            esc[n++] = '\\';
+            esc[n++] = *val;
+        } else if (*val == '\n') {
+            esc[n++] = '\\';
+            esc[n++] = 'n';
+        } else {
+            esc[n++] = *val;
+        }
+    }
+    esc[n++] = '"';
+    esc[n] = '\0';
+    tb_printf(tb, "%s", esc);
+}
+
+/**
+ * render_family - Append the metadata lines of a metric family
+ * @tb: Buffer
+ * @fmt: Output format
+ * @name: Family name
+ * @type: OpenMetrics type
+ * @unit: Unit, NULL if none
+ * @help: Help text
+ *
+ * The Prometheus format has no UNIT line and names counters by their
+ * sample name, including the _total suffix.
+ */
+static void render_family(struct text_buf *tb, enum metrics_format fmt,
+                          const char *name, const char *type,
+                          const char *unit, const char *help)
+{
+    const char *suffix = "";
+
+    if (fmt == FORMAT_PROMETHEUS && strcmp(type, "counter") == 0)
+        suffix = "_total";
+    tb_printf(tb, "# HELP %s%s %s\n", name, suffix, help);
+    tb_printf(tb, "# TYPE %s%s %s\n", name, suffix, type);
+    if (unit && fmt == FORMAT_OPENMETRICS)
+        tb_printf(tb, "# UNIT %s %s\n", name, unit);
+}
+
+/**
+ * render_task_labels - Append the label set identifying a task
+ * @tb: Buffer
+ * @t: Task
+ */
+static void render_task_labels(struct text_buf *tb, const struct km_task *t)
+{
+    tb_printf(tb, "{pid=\"%d\",comm=", t->pid);
+    tb_label(tb, t->comm);
+    tb_printf(tb, "}");
+}
+
+/**
+ * render_processes - Render the memory and CPU usage of every process
+ * @tb: Buffer to append to
+ * @fmt: Output format
+ * @s: Sample
+ */
+static void render_processes(struct text_buf *tb, enum metrics_format fmt,
+                             const struct km_sample *s)
+{
+    const char *p = "kernel_monitor";
+    size_t i;
+
+    render_family(tb, fmt, "kernel_monitor_process_virtual_bytes", "gauge", "bytes",
+                  "Virtual memory size of each process.");
+    for (i = 0; i < s->nr_tasks; i++) {
+        tb_printf(tb, "%s_process_virtual_bytes", p);
+        render_task_labels(tb, &s->tasks[i]);
+        tb_printf(tb, " %lu\n", s->tasks[i].mem_kb * 1024);
+    }
+    if (s->has_rss) {
+        render_family(tb, fmt, "kernel_monitor_process_resident_bytes", "gauge", "bytes",
+                      "Resident set size of each process.");
+        for (i = 0; i < s->nr_tasks; i++) {
+            tb_printf(tb, "%s_process_resident_bytes", p);
+            render_task_labels(tb, &s->tasks[i]);
+            tb_printf(tb, " %lu\n", s->tasks[i].rss_kb * 1024);
+        }
+    }
+    if (s->has_cpu) {
+        render_family(tb, fmt, "kernel_monitor_process_cpu_ratio", "gauge", "ratio",
+                      "Share of one CPU each process used since the previous sample.");
+        for (i = 0; i < s->nr_tasks; i++) {
+            if (!(s->tasks[i].flags & TASK_RATES))
+                continue;
+            tb_printf(tb, "%s_process_cpu_ratio", p);
+            render_task_labels(tb, &s->tasks[i]);
+            tb_printf(tb, " %.4f\n", s->tasks[i].cpu_pct / 100.0);
+        }
+    }
+    render_family(tb, fmt, "kernel_monitor_process_memory_growth_bytes_per_second", "gauge",
+                  NULL, "Memory growth of each process since the previous sample.");
+    for (i = 0; i < s->nr_tasks; i++) {
+        if (!(s->tasks[i].flags & TASK_RATES))
+            continue;
+        tb_printf(tb, "%s_process_memory_growth_bytes_per_second", p);
+        render_task_labels(tb, &s->tasks[i]);
+        tb_printf(tb, " %.1f\n", s->tasks[i].mem_rate * 1024.0);
+    }
+}
+
+/**
+ * render_groups - Render the memory and CPU usage of every process name
+ * @tb: Buffer to append to
+ * @fmt: Output format
+ * @s: Sample with its tasks grouped
+ *
+ * Replaces the per-process series when grouping is on, so the number of
+ * series follows the distinct names rather than the number of processes.
+ */
+static void render_groups(struct text_buf *tb, enum metrics_format fmt,
+                          const struct km_sample *s)
+{
+    const char *p = "kernel_monitor_group";
+    size_t i;
+
+    render_family(tb, fmt, "kernel_monitor_group_processes", "gauge", NULL,
+                  "Processes with each name.");
+    for (i = 0; i < s->nr_groups; i++) {
+        tb_printf(tb, "%s_processes{comm=", p);
+        tb_label(tb, s->groups[i].comm);
+        tb_printf(tb, "} %u\n", s->groups[i].count);
+    }
+    render_family(tb, fmt, "kernel_monitor_group_memory_bytes", "gauge", "bytes",
+                  "Combined memory of the processes with each name.");
+    for (i = 0; i < s->nr_groups; i++) {
+        tb_printf(tb, "%s_memory_bytes{comm=", p);
+        tb_label(tb, s->groups[i].comm);
+        tb_printf(tb, "} %lu\n", s->groups[i].mem_kb * 1024);
+    }
+    render_family(tb, fmt, "kernel_monitor_group_memory_max_bytes", "gauge", "bytes",
+                  "Memory of the largest process with each name.");
+    for (i = 0; i < s->nr_groups; i++) {
+        tb_printf(tb, "%s_memory_max_bytes{comm=", p);
+        tb_label(tb, s->groups[i].comm);
+        tb_printf(tb, "} %lu\n", s->groups[i].max_kb * 1024);
+    }
+    if (s->has_cpu) {
+        render_family(tb, fmt, "kernel_monitor_group_cpu_ratio", "gauge", "ratio",
+                      "Share of one CPU the processes with each name used since the "
+                      "previous sample.");
+        for (i = 0; i < s->nr_groups; i++) {
+            if (s->groups[i].cpu_pct < 0.0f)
+                continue;
+            tb_printf(tb, "%s_cpu_ratio{comm=", p);
+            tb_label(tb, s->groups[i].comm);
+            tb_printf(tb, "} %.4f\n", s->groups[i].cpu_pct / 100.0);
+        }
+    }
+}
+
+/**
+ * metrics_size - Buffer size to reserve for rendered metrics
+ * @max_tasks: Task capacity of the samples
+ *
+ * Return: Estimate that tb_printf() should never have to grow
+ */
+static size_t metrics_size(size_t max_tasks)
+{
+    return METRICS_BASE_BYTES + max_tasks * METRICS_TASK_BYTES;
+}
+
+/**
+ * render_metrics - Render a sample in a text exposition format
+ * @tb: Buffer, overwritten
+ * @fmt: Output format
+ * @s: Sample
+ * @ae: Alert engine, NULL if no rules are configured
+ *
+ * Return: 0 on success, -1 if the buffer could not grow
+ */
+static int render_metrics(struct text_buf *tb, enum metrics_format fmt,
+                          const struct km_sample *s, const struct alert_engine *ae)
+{
+    static const char *const series_names[SERIES_MAX] = {
+        [SERIES_CPU] = "cpu_busy",
+        [SERIES_FREE_RAM] = "free_ram",
+    };
+    const char *p = "kernel_monitor";
+    size_t i;
+    int r;
+
+    tb->len = 0;
+    tb->failed = 0;
+
+    render_family(tb, fmt, "kernel_monitor_cpu_seconds", "counter", "seconds",
+                  "Time CPU 0 spent in each mode.");
+    tb_printf(tb, "%s_cpu_seconds_total{mode=\"user\"} %.9f\n", p, s->cpu_user / 1e9);
+    tb_printf(tb, "%s_cpu_seconds_total{mode=\"system\"} %.9f\n", p, s->cpu_system / 1e9);
+    tb_printf(tb, "%s_cpu_seconds_total{mode=\"idle\"} %.9f\n", p, s->cpu_idle / 1e9);
+    if (s->cpu_busy >= 0.0) {
+        render_family(tb, fmt, "kernel_monitor_cpu_busy_ratio", "gauge", "ratio",
+                      "Share of CPU 0 time not idle since the previous sample.");
+        tb_printf(tb, "%s_cpu_busy_ratio %.4f\n", p, s->cpu_busy / 100.0);
+    }
+
+    render_family(tb, fmt, "kernel_monitor_memory_total_bytes", "gauge", "bytes",
+                  "Total usable RAM.");
+    tb_printf(tb, "%s_memory_total_bytes %lu\n", p, s->total_ram * page_kb * 1024);
+    render_family(tb, fmt, "kernel_monitor_memory_free_bytes", "gauge", "bytes",
+                  "Free RAM.");
+    tb_printf(tb, "%s_memory_free_bytes %lu\n", p, s->free_ram * page_kb * 1024);
+    render_family(tb, fmt, "kernel_monitor_memory_shared_bytes", "gauge", "bytes",
+                  "Shared RAM.");
+    tb_printf(tb, "%s_memory_shared_bytes %lu\n", p, s->shared_ram * page_kb * 1024);
+    render_family(tb, fmt, "kernel_monitor_memory_buffer_bytes", "gauge", "bytes",
+                  "RAM used by buffers.");
+    tb_printf(tb, "%s_memory_buffer_bytes %lu\n", p, s->buffer_ram * page_kb * 1024);
+    render_family(tb, fmt, "kernel_monitor_memory_free_trend_bytes_per_second", "gauge", NULL,
+                  "Smoothed rate of change of free RAM.");
+    tb_printf(tb, "%s_memory_free_trend_bytes_per_second %.1f\n", p,
+              s->free_trend * page_kb * 1024);
+    render_family(tb, fmt, "kernel_monitor_memory_exhaustion_seconds", "gauge", "seconds",
+                  "Forecast time until free RAM runs out, +Inf if it is not shrinking.");
+    if (s->oom_eta > 0.0)
+        tb_printf(tb, "%s_memory_exhaustion_seconds %.0f\n", p, s->oom_eta);
+    else
+        tb_printf(tb, "%s_memory_exhaustion_seconds +Inf\n", p);
+
+    render_family(tb, fmt, "kernel_monitor_processes", "gauge", NULL,
+                  "Processes with an address space.");
+    tb_printf(tb, "%s_processes %lu\n", p, s->total_processes);
+    render_family(tb, fmt, "kernel_monitor_anomaly", "gauge", NULL,
+                  "1 if the latest sample of a system series is outside its EWMA band.");
+    for (i = 0; i < SERIES_MAX; i++)
+        tb_printf(tb, "%s_anomaly{series=\"%s\"} %d\n", p, series_names[i],
+                  !!(s->sys_anomaly & (1u << i)));
+
+    if (s->nr_groups)
+        render_groups(tb, fmt, s);
+    else
+        render_processes(tb, fmt, s);
+    render_family(tb, fmt, "kernel_monitor_process_leak_bytes_per_second", "gauge", NULL,
+                  "Memory growth of processes flagged as leaking.");
+    for (i = 0; i < s->nr_tasks; i++) {
+        if (!(s->tasks[i].flags & TASK_LEAKING))
+            continue;
+        tb_printf(tb, "%s_process_leak_bytes_per_second", p);
+        render_task_labels(tb, &s->tasks[i]);
+        tb_printf(tb, " %.1f\n", s->tasks[i].leak_rate * 1024.0);
+    }
+    render_family(tb, fmt, "kernel_monitor_process_memory_zscore", "gauge", NULL,
+                  "Z-score of processes whose memory is outside its EWMA band.");
+    for (i = 0; i < s->nr_tasks; i++) {
+        if (!(s->tasks[i].flags & TASK_ANOMALY))
+            continue;
+        tb_printf(tb, "%s_process_memory_zscore", p);
+        render_task_labels(tb, &s->tasks[i]);
+        tb_printf(tb, " %.2f\n", s->tasks[i].mem_z);
+    }
+
+    if (ae && ae->nr_rules) {
+        render_family(tb, fmt, "kernel_monitor_alert_firing", "gauge", NULL,
+                      "1 while an alert rule is firing.");
+        for (r = 0; r < ae->nr_rules; r++) {
+            tb_printf(tb, "%s_alert_firing{rule=", p);
+            tb_label(tb, ae->rules[r].text);
+            tb_printf(tb, "} %d\n", !!(s->alerts_firing & (1ull << r)));
+        }
+    }
+
+    if (s->sink_mask) {
+        render_family(tb, fmt, "kernel_monitor_sink_queue_depth", "gauge", NULL,
+                      "Samples waiting for an output sink.");
+        for (r = 0; r < SINK_MAX; r++)
+            if (s->sink_mask & (1u << r))
+                tb_printf(tb, "%s_sink_queue_depth{sink=\"%s\"} %u\n", p,
+                          sink_names[r], s->sinks[r].depth);
+        render_family(tb, fmt, "kernel_monitor_sink_dropped", "counter", NULL,
+                      "Samples an output sink missed because its queue was full.");
+        for (r = 0; r < SINK_MAX; r++)
+            if (s->sink_mask & (1u << r))
+                tb_printf(tb, "%s_sink_dropped_total{sink=\"%s\"} %lu\n", p,
+                          sink_names[r], s->sinks[r].dropped);
+    }
+
+    render_family(tb, fmt, "kernel_monitor_self_cpu_seconds", "counter", "seconds",
+                  "CPU time used by the monitor itself.");
+    tb_printf(tb, "%s_self_cpu_seconds_total{mode=\"user\"} %.6f\n", p, s->self.cpu_user);
+    tb_printf(tb, "%s_self_cpu_seconds_total{mode=\"system\"} %.6f\n", p, s->self.cpu_system);
+    render_family(tb, fmt, "kernel_monitor_self_resident_bytes", "gauge", "bytes",
+                  "Resident set size of the monitor itself.");
+    tb_printf(tb, "%s_self_resident_bytes %lu\n", p, s->self.rss_kb * 1024);
+    render_family(tb, fmt, "kernel_monitor_self_sample_syscalls", "gauge", NULL,
+                  "System calls made to read the latest sample.");
+    tb_printf(tb, "%s_self_sample_syscalls %lu\n", p, s->self.syscalls);
+    render_family(tb, fmt, "kernel_monitor_self_sample_read_bytes", "gauge", "bytes",
+                  "Bytes read to get the latest sample.");
+    tb_printf(tb, "%s_self_sample_read_bytes %zu\n", p, s->self.bytes);
+    render_family(tb, fmt, "kernel_monitor_self_heap_allocations", "counter", NULL,
+                  "Heap allocations the monitor made since sampling started.");
+    tb_printf(tb, "%s_self_heap_allocations_total %lu\n", p, s->self.allocs);
+    if (s->self.collections) {
+        render_family(tb, fmt, "kernel_monitor_module_last_collection_seconds", "gauge",
+                      "seconds", "Time the module took to collect the latest sample.");
+        tb_printf(tb, "%s_module_last_collection_seconds %.9f\n", p,
+                  s->self.collect_ns / 1e9);
+        render_family(tb, fmt, "kernel_monitor_module_collections", "counter", NULL,
+                      "Samples the module has collected for all readers.");
+        tb_printf(tb, "%s_module_collections_total %llu\n", p, s->self.collections);
+        render_family(tb, fmt, "kernel_monitor_module_collection_seconds", "counter",
+                      "seconds", "Time the module spent collecting samples.");
+        tb_printf(tb, "%s_module_collection_seconds_total %.9f\n", p,
+                  s->self.collect_total_ns / 1e9);
+    }
+
+    if (s->latency[STAGE_READ].count) {
+        render_family(tb, fmt, "kernel_monitor_stage_latency_seconds", "histogram", "seconds",
+                      "Time samples spend in each stage; age runs from collection to display.");
+        for (r = 0; r < STAGE_MAX; r++) {
+            const struct latency_hist *h = &s->latency[r];
+            uint64_t cum = 0;
+            int b;
+
+            if (!h->count)
+                continue;
+            for (b = 0; b <= LATENCY_BUCKETS; b++) {
+                cum += h->buckets[b];
+                if (b < LATENCY_BUCKETS)
+                    tb_printf(tb, "%s_stage_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} "
+                              "%llu\n", p, stage_names[r], latency_bounds[b],
+                              (unsigned long long)cum);
+                else
+                    tb_printf(tb, "%s_stage_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} "
+                              "%llu\n", p, stage_names[r], (unsigned long long)cum);
+            }
+            tb_printf(tb, "%s_stage_latency_seconds_sum{stage=\"%s\"} %.6f\n", p,
+                      stage_names[r], h->sum);
+            tb_printf(tb, "%s_stage_latency_seconds_count{stage=\"%s\"} %llu\n", p,
+                      stage_names[r], (unsigned long long)h->count);
+        }
+    }
+
+    if (fmt == FORMAT_OPENMETRICS)
+        tb_printf(tb, "# EOF\n");
+    return tb->failed ? -1 : 0;
+}
+
+/**
+ * tb_field - Append a tab-separated field, replacing characters that would
+ *            break the record
+ * @tb: Buffer
+ * @val: Raw field value
+ */
+static void tb_field(struct text_buf *tb, const char *val)
+{
+    char out[KMON_COMM_LEN];
+    size_t n = 0;
+
+    for (; *val && n < sizeof(out) - 1; val++)
+        out[n++] = (unsigned char)*val < ' ' || *val == 0x7f ? '?' : *val;
+    out[n] = '\0';
+    tb_printf(tb, "\t%s", n ? out : "-");
+}
+
+/**
+ * render_batch - Render a sample as tab-separated records for batch mode
+ * @tb: Buffer, overwritten
+ * @s: Sample
+ * @cfg: Monitor settings, which select the view
+ * @nr: Sample number, counted from 1
+ * @wall: Wall clock time of the sample, in seconds since the epoch
+ * @header: Start with comment lines describing the records
+ *
+ * Every line is one record: its type, the sample number and the fields
+ * of the type, "-" where a value is not known yet. The records follow the
+ * selected view: "group" with --group, "node" with --tree, "change" with
+ * --diff (none for the first sample) and "proc" otherwise.
+ *
+ * Return: 0 on success, -1 if the buffer could not grow
+ */
+static int render_batch(struct text_buf *tb, const struct km_sample *s,
+                        const struct monitor_config *cfg, unsigned long nr, double wall,
+                        int header)
+{
+    static const char *const kinds[] = {
+        [CHANGE_NEW] = "started",
+        [CHANGE_EXITED] = "exited",
+        [CHANGE_MEMORY] = "memory",
+    };
+    size_t i;
+
+    tb->len = 0;
+    tb->failed = 0;
+
+    if (header) {
+        tb_printf(tb, "# sample\tN\tTIME\tCPU_BUSY_PCT\tMEM_TOTAL_KB\tMEM_FREE_KB\t"
+                  "PROCESSES\tHIDDEN\tDROPPED\n");
+        if (cfg->group)
+            tb_printf(tb, "# group\tN\tCOMM\tCOUNT\tMEM_KB\tMAX_KB\tCPU_PCT\n");
+        else if (cfg->tree)
+            tb_printf(tb, "# node\tN\tDEPTH\tPID\tPPID\tCOMM\tDESCENDANTS\tSUBTREE_KB\t"
+                      "SUBTREE_CPU_PCT\n");
+        else if (cfg->diff)
+            tb_printf(tb, "# change\tN\tKIND\tPID\tCOMM\tMEM_KB\tDELTA_KB\n");
+        else
+            tb_printf(tb, "# proc\tN\tPID\tPPID\tUID\tCOMM\tVSZ_KB\tRSS_KB\tCPU_PCT\t"
+                      "MEM_KBPS\tLEAKING\n");
+    }
+
+    tb_printf(tb, "sample\t%lu\t%.3f\t", nr, wall);
+    if (s->cpu_busy >= 0.0)
+        tb_printf(tb, "%.1f", s->cpu_busy);
+    else
+        tb_printf(tb, "-");
+    tb_printf(tb, "\t%lu\t%lu\t%lu\t%lu\t%lu\n", s->total_ram * page_kb,
+              s->free_ram * page_kb, s->total_processes, s->filtered_tasks,
+              s->dropped_tasks);
+
+    if (cfg->group) {
+        for (i = 0; i < s->nr_groups; i++) {
+            const struct km_group *g = &s->groups[i];
+
+            tb_printf(tb, "group\t%lu", nr);
+            tb_field(tb, g->comm);
+            tb_printf(tb, "\t%u\t%lu\t%lu\t", g->count, g->mem_kb, g->max_kb);
+            if (g->cpu_pct >= 0.0f)
+                tb_printf(tb, "%.1f\n", g->cpu_pct);
+            else
+                tb_printf(tb, "-\n");
+        }
+    } else if (cfg->tree) {
+        for (i = 0; i < s->nr_nodes; i++) {
+            const struct km_node *n = &s->nodes[i];
+            const struct km_task *t = &s->tasks[n->row];
+
+            tb_printf(tb, "node\t%lu\t%u\t%d\t%d", nr, n->depth, t->pid, t->ppid);
+            tb_field(tb, t->comm);
+            tb_printf(tb, "\t%u\t%lu\t", n->descendants, n->subtree_kb);
+            if (n->subtree_cpu >= 0.0f)
+                tb_printf(tb, "%.1f\n", n->subtree_cpu);
+            else
+                tb_printf(tb, "-\n");
+        }
+    } else if (cfg->diff) {
+        for (i = 0; i < s->nr_changes; i++) {
+            const struct km_change *c = &s->changes[i];
+
+            tb_printf(tb, "change\t%lu\t%s\t%d", nr, kinds[c->kind], c->pid);
+            tb_field(tb, c->comm);
+            tb_printf(tb, "\t%lu\t%ld\n", c->mem_kb, c->delta_kb);
+        }
+    } else {
+        for (i = 0; i < s->nr_tasks; i++) {
+            const struct km_task *t = &s->tasks[i];
+
+            tb_printf(tb, "proc\t%lu\t%d\t%d\t", nr, t->pid, t->ppid);
+            if (s->has_uid)
+                tb_printf(tb, "%u", t->uid);
+            else
+                tb_printf(tb, "-");
+            tb_field(tb, t->comm);
+            tb_printf(tb, "\t%lu\t", t->mem_kb);
+            if (s->has_rss)
+                tb_printf(tb, "%lu\t", t->rss_kb);
+            else
+                tb_printf(tb, "-\t");
+            if ((t->flags & TASK_RATES) && s->has_cpu)
+                tb_printf(tb, "%.1f\t", t->cpu_pct);
+            else
+                tb_printf(tb, "-\t");
+            if (t->flags & TASK_RATES)
+                tb_printf(tb, "%.1f\t", t->mem_rate);
+            else
+                tb_printf(tb, "-\t");
+            tb_printf(tb, "%d\n", !!(t->flags & TASK_LEAKING));
+        }
+    }
+    return tb->failed ? -1 : 0;
+}
+
+/**
+ * http_init - Open the exporter's listening socket
+ * @ex: Exporter to initialize
+ * @spec: [ADDR:]PORT to listen on; ADDR defaults to all interfaces
+ * @max_tasks: Task capacity of the samples, which sizes the payloads
+ *
+ * Return: 0 on success, -1 on failure (reported on stderr)
+ */
+static int http_init(struct http_exporter *ex, const char *spec, size_t max_tasks)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    const char *colon = strrchr(spec, ':');
+    const char *port_str = colon ? colon + 1 : spec;
+    char host[64];
+    long port;
+    int one = 1;
+    int i;
+
+    memset(ex, 0, sizeof(*ex));
+    ex->listen_fd = -1;
+    ex->current = -1;
+    for (i = 0; i < MAX_HTTP_CLIENTS; i++)
+        ex->clients[i].fd = -1;
+    if (tb_reserve(&ex->body[0], metrics_size(max_tasks)) < 0 ||
+        tb_reserve(&ex->body[1], metrics_size(max_tasks)) < 0) {
+        err_printf(COLOR_RED, "Error: Out of memory\n");
+        return -1;
+    }
+
+    port = strtol(port_str, NULL, 10);
+    if (port <= 0 || port > 65535) {
+        fprintf(stderr, "Error: Invalid exporter port '%s'\n", port_str);
+        return -1;
+    }
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (colon) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+        if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+            fprintf(stderr, "Error: Invalid exporter address '%s'\n", host);
+            return -1;
+        }
+    }
+
+    ex->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ex->listen_fd < 0 ||
+        setsockopt(ex->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(ex->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(ex->listen_fd, MAX_HTTP_CLIENTS) < 0) {
+        err_printf(COLOR_RED, "Error: Failed to listen on %s: %s\n",
+                   spec, strerror(errno));
+        if (ex->listen_fd >= 0)
+            close(ex->listen_fd);
+        ex->listen_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * http_close_client - Drop a connection and free its slot
+ * @c: Client slot
+ */
+static void http_close_client(struct http_client *c)
+{
+    close(c->fd);
+    c->fd = -1;
+}
+
+/**
+ * http_free - Close the exporter and release its buffers
+ * @ex: Exporter
+ */
+static void http_free(struct http_exporter *ex)
+{
+    int i;
+
+    for (i = 0; i < MAX_HTTP_CLIENTS; i++)
+        if (ex->clients[i].fd >= 0)
+            http_close_client(&ex->clients[i]);
+    if (ex->listen_fd >= 0)
+        close(ex->listen_fd);
+    free(ex->body[0].data);
+    free(ex->body[1].data);
+    ex->body[0].data = ex->body[1].data = NULL;
+}
+
+/**
+ * http_publish - Render a new sample for the exporter
+ * @ex: Exporter
+ * @s: Sample
+ * @ae: Alert engine, NULL if no rules are configured
+ *
+ * The spare payload is overwritten. A scrape still sending it has been
+ * stalled for a whole sampling interval and is dropped.
+ */
+static void http_publish(struct http_exporter *ex, const struct km_sample *s,
+                         const struct alert_engine *ae)
+{
+    int spare = ex->current == 0 ? 1 : 0;
+    int i;
+
+    for (i = 0; i < MAX_HTTP_CLIENTS; i++) {
+        struct http_client *c = &ex->clients[i];
+
+        if (c->fd >= 0 && c->writing && c->body == spare)
+            http_close_client(c);
+    }
+    if (render_metrics(&ex->body[spare], FORMAT_OPENMETRICS, s, ae) == 0)
+        ex->current = spare;
+    else
+        err_printf(COLOR_RED, "Error: Out of memory rendering metrics\n");
+}
+
+/**
+ * http_respond - Queue the reply to a complete request
+ * @ex: Exporter
+ * @c: Client whose request head has been received
+ */
+static void http_respond(struct http_exporter *ex, struct http_client *c)
+{
+    const char *status = "200 OK";
+    const char *type = OPENMETRICS_TYPE;
+    int head = strncmp(c->req, "HEAD ", 5) == 0;
+    const char *path = c->req + (head ? 5 : 4);
+
+    c->body = -1;
+    c->body_len = 0;
+    if (!head && strncmp(c->req, "GET ", 4) != 0) {
+        status = "405 Method Not Allowed";
+        type = "text/plain";
+    } else if (strncmp(path, "/metrics ", 9) != 0 && strncmp(path, "/ ", 2) != 0) {
+        status = "404 Not Found";
+        type = "text/plain";
+    } else if (ex->current < 0) {
+        status = "503 Service Unavailable";
+        type = "text/plain";
+    } else {
+        c->body = ex->current;
+        c->body_len = ex->body[ex->current].len;
+    }
+
+    c->hdr_len = snprintf(c->hdr, sizeof(c->hdr),
+                          "HTTP/1.1 %s\r\nContent-Type: %s\r\n"
+                          "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                          status, type, c->body_len);
+    if (head)
+        c->body_len = 0;
+    c->sent = 0;
+    c->writing = 1;
+}
+
+/**
+ * http_send - Send as much of a queued reply as the socket accepts
+ * @ex: Exporter
+ * @c: Client in the writing state
+ */
+static void http_send(struct http_exporter *ex, struct http_client *c)
+{
+    while (c->sent < c->hdr_len + c->body_len) {
+        struct iovec iov[2];
+        struct msghdr msg = { .msg_iov = iov };
+        ssize_t n;
+
+        if (c->sent < c->hdr_len) {
+            iov[0].iov_base = c->hdr + c->sent;
+            iov[0].iov_len = c->hdr_len - c->sent;
+            iov[1].iov_base = c->body >= 0 ? ex->body[c->body].data : NULL;
+            iov[1].iov_len = c->body_len;
+            msg.msg_iovlen = c->body_len ? 2 : 1;
+        } else {
+            iov[0].iov_base = ex->body[c->body].data + (c->sent - c->hdr_len);
+            iov[0].iov_len = c->hdr_len + c->body_len - c->sent;
+            msg.msg_iovlen = 1;
+        }
+
+        n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        c->sent += n;
+    }
+    http_close_client(c);
+}
+
+/**
+ * http_receive - Read request data from a client
+ * @ex: Exporter
+ * @c: Client in the reading state
+ */
+static void http_receive(struct http_exporter *ex, struct http_client *c)
+{
+    ssize_t n = recv(c->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len, 0);
+
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        http_close_client(c);
+        return;
+    }
+    c->req_len += n;
+    c->req[c->req_len] = '\0';
+
+    if (strstr(c->req, "\r\n\r\n") || strstr(c->req, "\n\n")) {
+        http_respond(ex, c);
+        http_send(ex, c);
+    } else if (c->req_len == sizeof(c->req) - 1) {
+        http_close_client(c);
+    }
+}
+
+/**
+ * http_accept - Accept every pending connection
+ * @ex: Exporter
+ */
+static void http_accept(struct http_exporter *ex)
+{
+    for (;;) {
+        int fd = accept4(ex->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        int i;
+
+        if (fd < 0)
+            return;
+        for (i = 0; i < MAX_HTTP_CLIENTS; i++)
+            if (ex->clients[i].fd < 0)
+                break;
+        if (i == MAX_HTTP_CLIENTS) {
+            close(fd);
+            continue;
+        }
+        ex->clients[i].fd = fd;
+        ex->clients[i].writing = 0;
+        ex->clients[i].req_len = 0;
+    }
+}
+
+/**
+ * http_pollfds - Describe the exporter's sockets for poll()
+ * @ex: Exporter
+ * @pfd: Array to fill, with room for MAX_HTTP_CLIENTS + 1 entries
+ * @slot: Filled with the client slot of each entry, -1 for the listener
+ *
+ * Return: Number of entries filled
+ */
+static int http_pollfds(const struct http_exporter *ex, struct pollfd *pfd, int *slot)
+{
+    int n = 0, i;
+
+    pfd[n].fd = ex->listen_fd;
+    pfd[n].events = POLLIN;
+    slot[n++] = -1;
+    for (i = 0; i < MAX_HTTP_CLIENTS; i++) {
+        if (ex->clients[i].fd < 0)
+            continue;
+        pfd[n].fd = ex->clients[i].fd;
+        pfd[n].events = ex->clients[i].writing ? POLLOUT : POLLIN;
+        slot[n++] = i;
+    }
+    return n;
+}
+
+/**
+ * http_dispatch - Handle the poll() results for the exporter's sockets
+ * @ex: Exporter
+ * @pfd: Entries filled by http_pollfds()
+ * @slot: Client slots filled by http_pollfds()
+ * @n: Number of entries
+ */
+static void http_dispatch(struct http_exporter *ex, const struct pollfd *pfd,
+                          const int *slot, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        struct http_client *c;
+
+        if (!pfd[i].revents || slot[i] < 0)
+            continue;
+        c = &ex->clients[slot[i]];
+        if (c->writing)
+            http_send(ex, c);
+        else
+            http_receive(ex, c);
+    }
+    if (pfd[0].revents & POLLIN)
+        http_accept(ex);
+}
+
+/**
+ * textfile_init - Prepare the textfile exporter
+ * @tf: Exporter to initialize
+ * @dir: Directory watched by the textfile collector
+ * @max_tasks: Task capacity of the samples, which sizes the buffer
+ *
+ * Return: 0 on success, -1 if @dir is unusable (reported on stderr)
+ */
+static int textfile_init(struct textfile_exporter *tf, const char *dir, size_t max_tasks)
+{
+    memset(tf, 0, sizeof(*tf));
+    if (tb_reserve(&tf->buf, metrics_size(max_tasks)) < 0) {
+        err_printf(COLOR_RED, "Error: Out of memory\n");
+        return -1;
+    }
+    if (access(dir, W_OK) < 0) {
+        err_printf(COLOR_RED, "Error: Cannot write to %s: %s\n",
+                   dir, strerror(errno));
+        return -1;
+    }
+    if (snprintf(tf->path, sizeof(tf->path), "%s/%s", dir, TEXTFILE_NAME) >=
+            (int)sizeof(tf->path) ||
+        snprintf(tf->tmp, sizeof(tf->tmp), "%s/.%s.%d", dir, TEXTFILE_NAME,
+                 (int)getpid()) >= (int)sizeof(tf->tmp)) {
+        fprintf(stderr, "Error: Textfile directory name too long\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * textfile_write - Replace the textfile with a new sample
+ * @tf: Exporter
+ * @s: Sample
+ * @ae: Alert engine, NULL if no rules are configured
+ *
+ * Return: 0 on success, -1 on failure (reported on stderr)
+ */
+static int textfile_write(struct textfile_exporter *tf, const struct km_sample *s,
+                          const struct alert_engine *ae)
+{
+    size_t off = 0;
+    int fd;
+
+    if (render_metrics(&tf->buf, FORMAT_PROMETHEUS, s, ae) < 0) {
+        err_printf(COLOR_RED, "Error: Out of memory rendering metrics\n");
+        return -1;
+    }
+
+    fd = open(tf->tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        goto fail;
+    while (off < tf->buf.len) {
+        ssize_t n = write(fd, tf->buf.data + off, tf->buf.len - off);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            goto fail_unlink;
+        }
+        off += n;
+    }
+    if (close(fd) < 0 || rename(tf->tmp, tf->path) < 0)
+        goto fail_unlink;
+    return 0;
+
+fail_unlink:
+    unlink(tf->tmp);
+fail:
+    err_printf(COLOR_RED, "Error: Failed to write %s: %s\n",
+               tf->path, strerror(errno));
+    return -1;
+}
+
+/**
+ * wire_size - Size of an encoded sample
+ * @nr_tasks: Number of task records
+ *
+ * Return: Header plus task records, in bytes
+ */
+static size_t wire_size(size_t nr_tasks)
+{
+    return sizeof(struct kmon_wire_header) + nr_tasks * sizeof(struct kmon_wire_task);
+}
+
+/**
+ * wire_encode - Encode a sample in the fan-out protocol format
+ * @h: Destination, with room for wire_size(@nr_tasks) bytes
+ * @s: Sample
+ * @seq: Sample sequence number
+ * @nr_tasks: Task records to write, at most @s->nr_tasks
+ *
+ * Tasks that do not fit are counted in the header's dropped_tasks.
+ */
+static void wire_encode(struct kmon_wire_header *h, const struct km_sample *s,
+                        uint64_t seq, size_t nr_tasks)
+{
+    struct kmon_wire_task *wt = (struct kmon_wire_task *)(h + 1);
+    size_t i;
+
+    memset(h, 0, sizeof(*h));
+    h->magic = KMON_WIRE_MAGIC;
+    h->version = KMON_WIRE_VERSION;
+    h->header_size = sizeof(*h);
+    h->task_size = sizeof(*wt);
+    h->nr_tasks = nr_tasks;
+    h->seq = seq;
+    h->timestamp = s->timestamp;
+    h->collected = s->trace.collected;
+    h->collect_ns = s->self.collect_ns;
+    h->collections = s->self.collections;
+    h->collect_total_ns = s->self.collect_total_ns;
+    h->cpu_user = s->cpu_user;
+    h->cpu_system = s->cpu_system;
+    h->cpu_idle = s->cpu_idle;
+    h->total_ram = s->total_ram;
+    h->free_ram = s->free_ram;
+    h->shared_ram = s->shared_ram;
+    h->buffer_ram = s->buffer_ram;
+    h->total_processes = s->total_processes;
+    h->has_rss = s->has_rss;
+    h->has_cpu = s->has_cpu;
+    h->has_uid = s->has_uid;
+    h->dropped_tasks = s->dropped_tasks + (s->nr_tasks - nr_tasks);
+
+    for (i = 0; i < nr_tasks; i++) {
+        memset(&wt[i], 0, sizeof(wt[i]));
+        memcpy(wt[i].comm, s->tasks[i].comm, sizeof(wt[i].comm));
+        wt[i].pid = s->tasks[i].pid;
+        wt[i].mem_kb = s->tasks[i].mem_kb;
+        wt[i].rss_kb = s->tasks[i].rss_kb;
+        wt[i].start_time = s->tasks[i].start_time;
+        wt[i].cpu_ns = s->tasks[i].cpu_ns;
+        wt[i].ppid = s->tasks[i].ppid;
+        wt[i].uid = s->tasks[i].uid;
+    }
+}
+
+/**
+ * fanout_init - Create the daemon's listening socket
+ * @fs: Server to initialize
+ * @path: Socket path; a stale socket left at @path is replaced
+ * @max_tasks: Task capacity of the samples, which sizes the frames
+ *
+ * Return: 0 on success, -1 on failure (reported on stderr)
+ */
+static int fanout_init(struct fanout_server *fs, const char *path, size_t max_tasks)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+    int i;
+
+    memset(fs, 0, sizeof(*fs));
+    fs->listen_fd = -1;
+    for (i = 0; i < MAX_FANOUT_CLIENTS; i++)
+        fs->clients[i].fd = -1;
+
+    if (arena_init(&fs->pool, FANOUT_FRAMES * wire_size(max_tasks)) < 0) {
+        err_printf(COLOR_RED, "Error: Out of memory\n");
+        return -1;
+    }
+    for (i = 0; i < FANOUT_FRAMES; i++) {
+        fs->frames[i].data = arena_alloc(&fs->pool, wire_size(max_tasks));
+        fs->frames[i].cap = wire_size(max_tasks);
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(fs->path, path);
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    fs->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fs->listen_fd < 0 ||
+        bind(fs->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fs->listen_fd, MAX_FANOUT_CLIENTS) < 0) {
+        err_printf(COLOR_RED, "Error: Failed to listen on %s: %s\n",
+                   path, strerror(errno));
+        if (fs->listen_fd >= 0)
+            close(fs->listen_fd);
+        fs->listen_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * fanout_close_client - Drop a subscriber
+ * @c: Client slot
+ */
+static void fanout_close_client(struct fanout_client *c)
+{
+    close(c->fd);
+    c->fd = -1;
+}
+
+/**
+ * fanout_free - Shut the daemon down and remove its socket
+ * @fs: Server
+ */
+static void fanout_free(struct fanout_server *fs)
+{
+    int i;
+
+    for (i = 0; i < MAX_FANOUT_CLIENTS; i++)
+        if (fs->clients[i].fd >= 0)
+            fanout_close_client(&fs->clients[i]);
+    arena_free(&fs->pool);
+    if (fs->listen_fd >= 0) {
+        close(fs->listen_fd);
+        unlink(fs->path);
+    }
+}
+
+/**
+ * fanout_encode - Encode a sample as one protocol frame
+ * @tb: Frame buffer, overwritten
+ * @s: Sample
+ * @seq: Frame sequence number
+ *
+ * Return: 0 on success, -1 if the sample is larger than the frame
+ */
+static int fanout_encode(struct text_buf *tb, const struct km_sample *s, uint64_t seq)
+{
+    size_t len = wire_size(s->nr_tasks);
+
+    if (tb->cap < len)
+        return -1;
+    tb->len = len;
+    wire_encode((struct kmon_wire_header *)tb->data, s, seq, s->nr_tasks);
+    return 0;
+}
+
+/**
+ * fanout_send - Send queued frames to a subscriber until its socket is full
+ * @fs: Server
+ * @c: Client
+ */
+static void fanout_send(struct fanout_server *fs, struct fanout_client *c)
+{
+    while (c->next_seq < fs->seq) {
+        const struct text_buf *f = &fs->frames[c->next_seq % FANOUT_FRAMES];
+        ssize_t n = send(c->fd, f->data + c->off, f->len - c->off,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fanout_close_client(c);
+            return;
+        }
+        c->off += n;
+        if (c->off < f->len)
+            continue;
+
+        /* Frame complete: skip ahead past anything dropped meanwhile */
+        c->off = 0;
+        c->next_seq++;
+        if (c->resume_seq > c->next_seq) {
+            c->dropped += c->resume_seq - c->next_seq;
+            c->next_seq = c->resume_seq;
+        }
+    }
+}
+
+/**
+ * fanout_publish - Encode a sample and queue it for every subscriber
+ * @fs: Server
+ * @s: Sample
+ */
+static void fanout_publish(struct fanout_server *fs, const struct km_sample *s)
+{
+    uint64_t seq = fs->seq;
+    int i;
+
+    for (i = 0; i < MAX_FANOUT_CLIENTS; i++) {
+        struct fanout_client *c = &fs->clients[i];
+        uint64_t pending = seq + 1 - c->next_seq;
+
+        if (c->fd < 0)
+            continue;
+        if (c->off && seq >= FANOUT_FRAMES && c->next_seq == seq - FANOUT_FRAMES) {
+            /* The frame in flight is about to be overwritten */
+            fanout_close_client(c);
+            continue;
+        }
+        if (pending <= FANOUT_QUEUE)
+            continue;
+        if (c->off) {
+            c->resume_seq = seq + 1 - (FANOUT_QUEUE - 1);
+        } else {
+            c->dropped += pending - FANOUT_QUEUE;
+            c->next_seq = seq + 1 - FANOUT_QUEUE;
+        }
+    }
+
+    if (fanout_encode(&fs->frames[seq % FANOUT_FRAMES], s, seq + 1) < 0) {
+        err_printf(COLOR_RED, "Error: Sample does not fit into a fan-out frame\n");
+        return;
+    }
+    fs->seq++;
+
+    for (i = 0; i < MAX_FANOUT_CLIENTS; i++)
+        if (fs->clients[i].fd >= 0)
+            fanout_send(fs, &fs->clients[i]);
+}
+
+/**
+ * fanout_accept - Accept every pending subscriber
+ * @fs: Server
+ *
+ * New subscribers start with the latest sample.
+ */
+static void fanout_accept(struct fanout_server *fs)
+{
+    for (;;) {
+        int fd = accept4(fs->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        struct fanout_client *c = NULL;
+        int i;
+
+        if (fd < 0)
+            return;
+        for (i = 0; i < MAX_FANOUT_CLIENTS && !c; i++)
+            if (fs->clients[i].fd < 0)
+                c = &fs->clients[i];
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        c->next_seq = fs->seq ? fs->seq - 1 : 0;
+        fanout_send(fs, c);
+    }
+}
+
+/**
+ * fanout_pollfds - Describe the daemon's sockets for poll()
+ * @fs: Server
+ * @pfd: Array to fill, with room for MAX_FANOUT_CLIENTS + 1 entries
+ * @slot: Filled with the client slot of each entry, -1 for the listener
+ *
+ * Return: Number of entries filled
+ */
+static int fanout_pollfds(const struct fanout_server *fs, struct pollfd *pfd, int *slot)
+{
+    int n = 0, i;
+
+    pfd[n].fd = fs->listen_fd;
+    pfd[n].events = POLLIN;
+    slot[n++] = -1;
+    for (i = 0; i < MAX_FANOUT_CLIENTS; i++) {
+        const struct fanout_client *c = &fs->clients[i];
+
+        if (c->fd < 0)
+            continue;
+        pfd[n].fd = c->fd;
+        pfd[n].events = POLLIN | (c->next_seq < fs->seq ? POLLOUT : 0);
+        slot[n++] = i;
+    }
+    return n;
+}
+
+/**
+ * fanout_dispatch - Handle the poll() results for the daemon's sockets
+ * @fs: Server
+ * @pfd: Entries filled by fanout_pollfds()
+ * @slot: Client slots filled by fanout_pollfds()
+ * @n: Number of entries
+ *
+ * Subscribers never send anything, so readable means they hung up.
+ */
+static void fanout_dispatch(struct fanout_server *fs, const struct pollfd *pfd,
+                            const int *slot, int n)
+{
+    char scratch[256];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        struct fanout_client *c;
+
+        if (!pfd[i].revents || slot[i] < 0)
+            continue;
+        c = &fs->clients[slot[i]];
+        if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (recv(c->fd, scratch, sizeof(scratch), MSG_DONTWAIT) <= 0) {
+                fanout_close_client(c);
+                continue;
+            }
+        }
+        if (pfd[i].revents & POLLOUT)
+            fanout_send(fs, c);
+    }
+    if (pfd[0].revents & POLLIN)
+        fanout_accept(fs);
+}
+
+/**
+ * shm_object_name - Turn a user-supplied name into a POSIX shm object name
+ * @buf: Destination, NAME_MAX + 1 bytes
+ * @name: Name, with or without the leading slash
+ *
+ * Return: 0 on success, -1 if the name is invalid (reported on stderr)
+ */
+static int shm_object_name(char *buf, const char *name)
+{
+    int n = snprintf(buf, NAME_MAX + 1, "%s%s", name[0] == '/' ? "" : "/", name);
+
+    if (n < 2 || n > NAME_MAX || strchr(buf + 1, '/')) {
+        fprintf(stderr, "Error: Invalid shared memory name: %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * shm_init - Create the shared memory snapshot segment
+ * @sp: Publisher to initialize
+ * @name: Object name
+ * @capacity: Task records to make room for
+ *
+ * Return: 0 on success, -1 on failure (reported on stderr)
+ */
+static int shm_init(struct shm_publisher *sp, const char *name, size_t capacity)
+{
+    int fd;
+    void *p;
+
+    memset(sp, 0, sizeof(*sp));
+    if (shm_object_name(sp->name, name) < 0)
+        return -1;
+    sp->size = sizeof(struct kmon_shm_header) + wire_size(capacity);
+
+    fd = shm_open(sp->name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, sp->size) < 0) {
+        err_printf(COLOR_RED, "Error: Failed to create shared memory %s: %s\n",
+                   sp->name, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(sp->name);
+        }
+        return -1;
+    }
+    p = mmap(NULL, sp->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        err_printf(COLOR_RED, "Error: Failed to map shared memory %s: %s\n",
+                   sp->name, strerror(errno));
+        shm_unlink(sp->name);
+        return -1;
+    }
+
+    sp->hdr = p;
+    sp->hdr->header_size = sizeof(*sp->hdr);
+    sp->hdr->capacity = capacity;
+    sp->hdr->version = KMON_SHM_VERSION;
+    /* Readers check the magic last, once the rest of the header is valid */
+    __atomic_store_n(&sp->hdr->magic, KMON_SHM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * shm_free - Unmap and remove the snapshot segment
+ * @sp: Publisher
+ */
+static void shm_free(struct shm_publisher *sp)
+{
+    if (!sp->hdr)
+        return;
+    munmap(sp->hdr, sp->size);
+    shm_unlink(sp->name);
+    sp->hdr = NULL;
+}
+
+/**
+ * shm_publish - Rewrite the snapshot under the seqlock
+ * @sp: Publisher
+ * @s: Sample
+ */
+static void shm_publish(struct shm_publisher *sp, const struct km_sample *s)
+{
+    struct kmon_shm_header *hdr = sp->hdr;
+    uint32_t seq = __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED);
+    size_t n = s->nr_tasks < hdr->capacity ? s->nr_tasks : hdr->capacity;
+
+    __atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    wire_encode((struct kmon_wire_header *)(hdr + 1), s, s->seq, n);
+    __atomic_store_n(&hdr->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * wait_for - Serve the publishers until a deadline or until input arrives
+ * @deadline: CLOCK_MONOTONIC time to return at, in seconds; negative waits
+ *            for @fd only
+ * @fd: Descriptor to wait for, -1 for none
+ * @pub: Servers to run meanwhile
+ *
+ * Return: 1 if @fd became readable, 0 if the deadline passed
+ */
+static int wait_for(double deadline, int fd, struct publishers *pub)
+{
+    struct pollfd pfd[MAX_HTTP_CLIENTS + MAX_FANOUT_CLIENTS + 3];
+    int slot[MAX_HTTP_CLIENTS + MAX_FANOUT_CLIENTS + 3];
+
+    for (;;) {
+        int n = 0, nh = 0, nf = 0;
+        int ms = -1;
+
+        if (deadline >= 0.0) {
+            double left = deadline - monotonic_seconds();
+
+            if (left <= 0.0)
+                return 0;
+            ms = (int)(left * 1000.0) + 1;
+        }
+
+        if (fd >= 0) {
+            pfd[n].fd = fd;
+            pfd[n].events = POLLIN;
+            slot[n++] = -1;
+        }
+        if (pub->http) {
+            nh = http_pollfds(pub->http, pfd + n, slot + n);
+            n += nh;
+        }
+        if (pub->fanout) {
+            nf = fanout_pollfds(pub->fanout, pfd + n, slot + n);
+            n += nf;
+        }
+
+        if (poll(pfd, n, ms) <= 0)
+            continue;
+
+        n = fd >= 0 ? 1 : 0;
+        if (pub->http)
+            http_dispatch(pub->http, pfd + n, slot + n, nh);
+        if (pub->fanout)
+            fanout_dispatch(pub->fanout, pfd + n + nh, slot + n + nh, nf);
+        if (fd >= 0 && pfd[0].revents)
+            return 1;
+    }
+}
+
+/**
+ * print_cost - Display what monitoring costs
+ * @c: Cost figures of a sample
+ */
+static void print_cost(const struct self_cost *c)
+{
+    printf("\nMonitor Cost: CPU ");
+    if (c->cpu_pct >= 0.0)
+        printf("%.1f%%, ", c->cpu_pct);
+    printf("%.2f s total, RSS %.1f MB, %lu syscalls and %.1f KB read per sample\n",
+           c->cpu_user + c->cpu_system, c->rss_kb / 1024.0, c->syscalls,
+           c->bytes / 1024.0);
+    if (c->collections)
+        printf("Module Cost:  %.1f us per collection, %llu collections, %.3f s total\n",
+               c->collect_ns / 1e3, c->collections, c->collect_total_ns / 1e9);
+    if (c->allocs)
+        printf(COLOR_YELLOW "Heap Growth:  %lu allocations since sampling started; "
+               "raise --max-procs\n" COLOR_RESET, c->allocs);
+}
+
+/**
+ * print_trace - Display the stage latencies of a sample
+ * @s: Sample
+ *
+ * Render and age can only be known once the frame is on screen, so they
+ * are those of the previous frame. The second line gives the p99 of each
+ * stage over the whole run, rounded up to a histogram bucket.
+ */
+static void print_trace(const struct km_sample *s)
+{
+    const struct sample_trace *t = &s->trace;
+    int i;
+
+    printf("\nLatency (ms):  read %.2f  parse %.2f", (t->read_done - t->read_start) * 1e3,
+           (t->parsed - t->read_done) * 1e3);
+    if (t->queued)
+        printf("  analyze %.2f", (t->queued - t->parsed) * 1e3);
+    if (s->latency[STAGE_RENDER].count)
+        printf("  render %.2f  age %.2f", s->latency[STAGE_RENDER].last * 1e3,
+               s->latency[STAGE_AGE].last * 1e3);
+    printf("\n");
+
+    if (!s->latency[STAGE_READ].count)
+        return;
+    printf("  p99 (ms):    ");
+    for (i = 0; i < STAGE_MAX; i++)
+        if (s->latency[i].count)
+            printf("%s%s %.2f", i ? "  " : "", stage_names[i],
+                   latency_quantile(&s->latency[i], 0.99) * 1e3);
+    printf("\n");
+}
+
+/**
+ * print_tasks - Display the process table
+ * @s: Sample
+ * @rates: Show the CPU and growth columns
+ * @history: Show the memory sparklines
+ */
+static void print_tasks(const struct km_sample *s, int rates, int history)
+{
+    size_t i;
+
+    printf("Process Information:\n");
+    printf("%-20s %-8s %-12s %-12s", "Name", "PID", "Memory (KB)", "RSS (KB)");
+    if (rates)
+        printf(" %-7s %-12s", "CPU %", "Growth KB/s");
+    if (history)
+        printf(" %s", "Memory History");
+    printf("\n-------------------------------------------\n");
+    for (i = 0; i < s->nr_tasks; i++) {
+        const struct km_task *t = &s->tasks[i];
+
+        printf("%-20s %-8d %-12lu %-12lu", t->comm, t->pid, t->mem_kb, t->rss_kb);
+        if (rates && (t->flags & TASK_RATES) && t->cpu_pct >= 0.0f)
+            printf(" %-7.1f %+-12.1f", t->cpu_pct, t->mem_rate);
+        else if (rates && (t->flags & TASK_RATES))
+            printf(" %-7s %+-12.1f", "-", t->mem_rate);
+        else if (rates && (t->flags & TASK_HISTORY))
+            printf(" %-7s %-12s", "", "");
+        if (t->flags & TASK_HISTORY) {
+            printf(" ");
+            spark_print(t->spark);
+        }
+        printf("\n");
+    }
+}
+
+/**
+ * print_groups - Display the processes aggregated by name
+ * @s: Sample with its tasks grouped
+ * @rates: Show the CPU column
+ */
+static void print_groups(const struct km_sample *s, int rates)
+{
+    size_t i;
+
+    printf("Process Groups:\n");
+    printf("%-20s %-8s %-12s %-12s %-12s", "Name", "Count", "Total (KB)", "Avg (KB)",
+           "Max (KB)");
+    if (rates)
+        printf(" %s", "CPU %");
+    printf("\n-------------------------------------------\n");
+    for (i = 0; i < s->nr_groups; i++) {
+        const struct km_group *g = &s->groups[i];
+
+        printf("%-20s %-8u %-12lu %-12lu %-12lu", g->comm, g->count, g->mem_kb,
+               g->mem_kb / g->count, g->max_kb);
+        if (rates && g->cpu_pct >= 0.0f)
+            printf(" %.1f", g->cpu_pct);
+        printf("\n");
+    }
+}
+
+/**
+ * print_tree - Display the process tree
+ * @s: Sample with its tree built
+ * @rates: Show the CPU column
+ */
+static void print_tree(const struct km_sample *s, int rates)
+{
+    size_t i;
+
+    printf("Process Tree:\n");
+    printf("%-24s %-8s %-12s %-12s %-8s", "Name", "PID", "Memory (KB)", "Subtree (KB)",
+           "Procs");
+    if (rates)
+        printf(" %s", "CPU %");
+    printf("\n-------------------------------------------\n");
+    for (i = 0; i < s->nr_nodes; i++) {
+        const struct km_node *n = &s->nodes[i];
+        const struct km_task *t = &s->tasks[n->row];
+        /* Children that are not listed were collapsed into this node */
+        int collapsed = n->descendants &&
+            (i + 1 == s->nr_nodes || s->nodes[i + 1].depth <= n->depth);
+        char name[64];
+
+        snprintf(name, sizeof(name), "%*s%s%s", (int)(2 * (n->depth < 16 ? n->depth : 16)),
+                 "", collapsed ? "+" : "", t->comm);
+        printf("%-24s %-8d %-12lu %-12lu %-8u", name, t->pid, task_memory(s, t),
+               n->subtree_kb, n->descendants + 1);
+        if (rates && n->subtree_cpu >= 0.0f)
+            printf(" %.1f", n->subtree_cpu);
+        printf("\n");
+    }
+}
+
+/**
+ * print_changes - Display the lifecycle diff
+ * @s: Sample compared with the previous one
+ */
+static void print_changes(const struct km_sample *s)
+{
+    static const char *const kind_names[] = {
+        [CHANGE_NEW] = COLOR_GREEN "started" COLOR_RESET,
+        [CHANGE_EXITED] = COLOR_RED "exited " COLOR_RESET,
+        [CHANGE_MEMORY] = COLOR_YELLOW "changed" COLOR_RESET,
+    };
+    size_t counts[3] = { 0 }, i;
+
+    for (i = 0; i < s->nr_changes; i++)
+        counts[s->changes[i].kind]++;
+    printf("Process Changes: %zu started, %zu exited, %zu changed\n",
+           counts[CHANGE_NEW], counts[CHANGE_EXITED], counts[CHANGE_MEMORY]);
+    printf("%-20s %-8s %-8s %-12s %s\n", "Name", "PID", "Change", "Memory (KB)",
+           "Delta (KB)");
+    printf("-------------------------------------------\n");
+    for (i = 0; i < s->nr_changes; i++) {
+        const struct km_change *c = &s->changes[i];
+
+        printf("%-20s %-8d %s  %-12lu %+ld\n", c->comm, c->pid, kind_names[c->kind],
+               c->mem_kb, c->delta_kb);
+    }
+    if (s->dropped_changes)
+        printf(COLOR_YELLOW "(%zu changes not shown)\n" COLOR_RESET, s->dropped_changes);
+}
+
+/**
+ * print_sample - Display a parsed sample
+ * @s: Sample to display
+ * @trace: Also display the stage latencies
+ */
+static void print_sample(const struct km_sample *s, int trace)
+{
+    size_t i, leaks = 0, anomalies = 0;
+    int rates = 0, history = 0;
+
+    printf("CPU Statistics (CPU 0):\n");
+    printf("  User Time:   %llu ns\n", s->cpu_user);
+    printf("  System Time: %llu ns\n", s->cpu_system);
+    printf("  Idle Time:   %llu ns\n", s->cpu_idle);
+    if (s->cpu_busy >= 0.0) {
+        printf("  Busy:        %.1f%%  ", s->cpu_busy);
+        spark_print(s->sys_spark[SERIES_CPU]);
+        if (s->sys_anomaly & (1u << SERIES_CPU))
+            printf(COLOR_BOLD COLOR_RED "  anomaly (z=%+.1f)" COLOR_RESET,
+                   s->sys_z[SERIES_CPU]);
+        printf("\n");
+    }
+    printf("\n");
+
+    printf("Memory Statistics:\n");
+    printf("  Total RAM:   %lu pages (%lu MB)\n",
+           s->total_ram, s->total_ram * page_kb / 1024);
+    printf("  Free RAM:    %lu pages (%lu MB)",
+           s->free_ram, s->free_ram * page_kb / 1024);
+    if (s->sys_spark[SERIES_FREE_RAM][HISTORY_LEN - 1]) {
+        /* The one-shot view has no history */
+        printf("  ");
+        spark_print(s->sys_spark[SERIES_FREE_RAM]);
+    }
+    if (s->sys_anomaly & (1u << SERIES_FREE_RAM))
+        printf(COLOR_BOLD COLOR_RED "  anomaly (z=%+.1f)" COLOR_RESET,
+               s->sys_z[SERIES_FREE_RAM]);
+    printf("\n");
+    printf("  Shared RAM:  %lu pages\n", s->shared_ram);
+    printf("  Buffer RAM:  %lu pages\n", s->buffer_ram);
+    if (s->oom_eta > 0.0) {
+        char eta[32];
+
+        format_duration(eta, sizeof(eta), s->oom_eta);
+        printf("  Free Trend:  %.1f KB/s, " COLOR_BOLD "%s%s until out of memory\n"
+               COLOR_RESET, s->free_trend * page_kb,
+               s->oom_eta < 3600 ? COLOR_RED : COLOR_YELLOW, eta);
+    } else if (s->free_trend != 0.0) {
+        printf("  Free Trend:  %+.1f KB/s\n", s->free_trend * page_kb);
+    }
+    printf("\n");
+
+    /* Rates and history need earlier samples, so the one-shot view has none */
+    for (i = 0; i < s->nr_tasks; i++) {
+        rates |= !!(s->tasks[i].flags & TASK_RATES);
+        history |= !!(s->tasks[i].flags & TASK_HISTORY);
+        leaks += !!(s->tasks[i].flags & TASK_LEAKING);
+        anomalies += !!(s->tasks[i].flags & TASK_ANOMALY);
+    }
+
+    if (s->has_changes)
+        print_changes(s);
+    else if (s->nr_nodes)
+        print_tree(s, rates);
+    else if (s->nr_groups)
+        print_groups(s, rates);
+    else
+        print_tasks(s, rates, history);
+    printf("\nTotal Processes: %lu\n", s->total_processes);
+    if (s->filtered_tasks)
+        printf("(%zu processes hidden by --filter)\n", s->filtered_tasks);
+    if (s->dropped_tasks)
+        printf(COLOR_YELLOW "(%zu tasks not shown, raise --max-procs)\n" COLOR_RESET,
+               s->dropped_tasks);
+
+    if (leaks) {
+        printf(COLOR_BOLD COLOR_RED "\nPossible Memory Leaks:\n" COLOR_RESET);
+        printf("%-20s %-8s %-12s %-12s\n", "Name", "PID", "Memory (KB)", "Growth KB/s");
+        for (i = 0; i < s->nr_tasks; i++) {
+            const struct km_task *t = &s->tasks[i];
+
+            if (t->flags & TASK_LEAKING)
+                printf("%-20s %-8d %-12lu %-12.2f\n", t->comm, t->pid,
+                       task_memory(s, t), t->leak_rate);
+        }
+    }
+
+    if (anomalies) {
+        printf(COLOR_BOLD COLOR_YELLOW "\nMemory Anomalies:\n" COLOR_RESET);
+        printf("%-20s %-8s %-12s %-12s\n", "Name", "PID", "Memory (KB)", "Z-Score");
+        for (i = 0; i < s->nr_tasks; i++) {
+            const struct km_task *t = &s->tasks[i];
+
+            if (t->flags & TASK_ANOMALY)
+                printf("%-20s %-8d %-12lu %+-12.1f\n", t->comm, t->pid,
+                       task_memory(s, t), t->mem_z);
+        }
+    }
+
+    if (s->sink_mask & ~(1u << SINK_DISPLAY)) {
+        const char *sep = "";
+
+        printf("\nSinks: ");
+        for (i = 0; i < SINK_MAX; i++) {
+            if (!(s->sink_mask & (1u << i)))
+                continue;
+            printf("%s%s %u queued", sep, sink_names[i], s->sinks[i].depth);
+            if (s->sinks[i].dropped)
+                printf(COLOR_YELLOW " %lu dropped" COLOR_RESET, s->sinks[i].dropped);
+            sep = ", ";
+        }
+        printf("\n");
+    } else if (s->sinks[SINK_DISPLAY].dropped) {
+        printf(COLOR_YELLOW "\n%lu samples not shown, the terminal fell behind\n"
+               COLOR_RESET, s->sinks[SINK_DISPLAY].dropped);
+    }
+
+    print_cost(&s->self);
+    if (trace)
+        print_trace(s);
+}
+
 /**
- * print_usage - Display usage information
- * @prog_name: Name of the program
+ * source_open - Open the sample source selected on the command line
+ * @km: Handle to initialize
+ * @cfg: Monitor settings
+ *
+ * Return: 0 on success, -1 on failure (reported on stderr)
  */
-static void print_usage(const char *prog_name)
+static int source_open(struct kmon *km, const struct monitor_config *cfg)
 {
-    printf("Usage: %s [OPTIONS]\n", prog_name);
-    printf("Read and display Linux kernel monitoring data\n\n");
-    printf("Options:\n");
-    printf("  -h, --help       Display this help message\n");
-    printf("  -v, --version    Display version information\n");
-    printf("  -r, --raw        Display raw output without formatting\n");
-    printf("  -w, --watch SEC  Continuously display data every SEC seconds\n");
-    printf("\nExamples:\n");
-    printf("  %s              Display current system statistics\n", prog_name);
-    printf("  %s -w 2         Update display every 2 seconds\n", prog_name);
+    char spec[PATH_MAX + 8];
+
+    if (cfg->connect_shm)
+        snprintf(spec, sizeof(spec), "shm:%s", cfg->connect_shm);
+    else if (cfg->connect_path)
+        snprintf(spec, sizeof(spec), "unix:%s", cfg->connect_path);
+    else if (cfg->procfs)
+        snprintf(spec, sizeof(spec), "procfs:");
+
+    if (kmon_open(km, cfg->connect_shm || cfg->connect_path || cfg->procfs ?
+                      spec : NULL) == 0)
+        return 0;
+
+    if (cfg->connect_shm) {
+        err_printf(COLOR_RED, "Error: Failed to open shared memory %s: %s\n", cfg->connect_shm,
+                   errno == EPROTO ? "Not a compatible snapshot" : strerror(errno));
+        fprintf(stderr, "Make sure a daemon is running (monitor_app --shm %s)\n",
+                cfg->connect_shm);
+    } else if (cfg->connect_path) {
+        err_printf(COLOR_RED, "Error: Failed to connect to %s: %s\n",
+                   cfg->connect_path, strerror(errno));
+        fprintf(stderr, "Make sure a daemon is running (monitor_app --daemon %s)\n",
+                cfg->connect_path);
+    } else if (cfg->procfs) {
+        err_printf(COLOR_RED, "Error: Failed to open /proc: %s\n",
+                   strerror(errno));
+    } else {
+        err_printf(COLOR_RED, "Error: %s\n", strerror(errno));
+    }
+    return -1;
 }
 
 /**
- * print_version - Display version information
+ * source_error - Report a failed read, described by errno
+ * @cfg: Monitor settings naming the source
  */
-static void print_version(void)
+static void source_error(const struct monitor_config *cfg)
 {
-    printf("Kernel Monitor Application v%s\n", APP_VERSION);
-    printf("Copyright (C) 2025 Mahmoud Ezzat\n");
+    int daemon = cfg->connect_path || cfg->connect_shm;
+
+    switch (errno) {
+    case EPROTO:
+        if (daemon)
+            err_printf(COLOR_RED, "Error: Daemon speaks an incompatible protocol\n");
+        else if (cfg->procfs)
+            err_printf(COLOR_RED, "Error: Unrecognized data format in /proc/stat "
+                       "or /proc/meminfo\n");
+        else
+            err_printf(COLOR_RED, "Error: Unrecognized data format in %s\n", KMON_PROC_PATH);
+        break;
+    case ECONNRESET:
+        err_printf(COLOR_RED, "Error: Lost connection to the daemon\n");
+        break;
+    case ENODATA:
+        err_printf(COLOR_RED, "Error: No snapshot in shared memory yet\n");
+        break;
+    case EAGAIN:
+        err_printf(COLOR_RED, "Error: Shared memory snapshot is not being updated "
+                   "consistently\n");
+        break;
+    default:
+        if (daemon) {
+            err_printf(COLOR_RED, "Error: Failed to read from the daemon: %s\n",
+                       strerror(errno));
+            break;
+        }
+        if (cfg->procfs) {
+            err_printf(COLOR_RED, "Error: Failed to read /proc: %s\n",
+                       strerror(errno));
+            break;
+        }
+        err_printf(COLOR_RED, "Error: Failed to read %s: %s\n",
+                   KMON_PROC_PATH, strerror(errno));
+        fprintf(stderr, "Make sure the kernel module is loaded (insmod kernel_monitor.ko)\n");
+        break;
+    }
 }
 
 /**
- * read_kernel_data - Read data from kernel module
- * @buffer: Buffer to store read data
- * @size: Size of buffer
+ * read_buf_grow - Make room in the read buffer
+ * @rb: Buffer, grown by doubling and never shrunk
+ * @need: Minimum size
  *
- * Return: Number of bytes read on success, -1 on failure
+ * Return: 0 on success, -1 on allocation failure (reported on stderr)
  */
-static ssize_t read_kernel_data(char *buffer, size_t size)
+static int read_buf_grow(struct read_buf *rb, size_t need)
 {
-    int fd;
-    ssize_t bytes_read;
+    size_t new_cap = rb->cap ? rb->cap * 2 : BUFFER_SIZE;
+    char *p;
 
-    /* Open proc file */
-    fd = open(PROC_PATH, O_RDONLY);
-    if (fd < 0) {
-        fprintf(stderr, COLOR_RED "Error: Failed to open %s: %s\n" COLOR_RESET,
-                PROC_PATH, strerror(errno));
-        fprintf(stderr, "Make sure the kernel module is loaded (insmod kernel_monitor.ko)\n");
+    while (new_cap < need)
+        new_cap *= 2;
+    p = mem_realloc(rb->data, new_cap);
+    if (!p) {
+        err_printf(COLOR_RED, "Error: Out of memory\n");
         return -1;
     }
+    rb->data = p;
+    rb->cap = new_cap;
+    return 0;
+}
+
+/**
+ * raw_read - Read the module's text output without parsing it
+ * @km: Text source
+ * @cfg: Monitor settings
+ * @rb: Read buffer, NUL-terminated text on success
+ *
+ * Return: 0 on success, -1 on failure (reported on stderr)
+ */
+static int raw_read(struct kmon *km, const struct monitor_config *cfg, struct read_buf *rb)
+{
+    ssize_t n;
+
+    while ((n = kmon_read_raw(km, rb->data, rb->cap)) < 0) {
+        if (errno != ENOBUFS) {
+            source_error(cfg);
+            return -1;
+        }
+        if (read_buf_grow(rb, 0) < 0)
+            return -1;
+    }
+    rb->len = n;
+    return 0;
+}
 
-    /* Read data from proc file */
-    bytes_read = read(fd, buffer, size - 1);
-    if (bytes_read < 0) {
-        fprintf(stderr, COLOR_RED "Error: Failed to read from %s: %s\n" COLOR_RESET,
-                PROC_PATH, strerror(errno));
-        close(fd);
-        return -1;
+/**
+ * sample_read - Take one sample from a source
+ * @km: Source
+ * @cfg: Monitor settings
+ * @rb: Read buffer; keeps its size between calls, so steady-state
+ *      sampling does not allocate
+ * @s: Sample to fill; tasks beyond its capacity are counted as dropped
+ *
+ * Return: 0 on success, -1 on failure (reported on stderr)
+ */
+static int sample_read(struct kmon *km, const struct monitor_config *cfg,
+                       struct read_buf *rb, struct km_sample *s)
+{
+    struct kmon_snapshot snap;
+    struct kmon_task kt;
+    int tries = 0;
+
+    s->trace.read_start = monotonic_seconds();
+retry:
+    /* Shared memory is decoded in place, without copying it into @rb */
+    while (kmon_read(km, cfg->connect_shm ? NULL : rb->data, rb->cap, &snap) < 0) {
+        if (errno != ENOBUFS) {
+            source_error(cfg);
+            return -1;
+        }
+        if (read_buf_grow(rb, snap.needed) < 0)
+            return -1;
     }
 
-    /* Null-terminate the buffer */
-    buffer[bytes_read] = '\0';
-    close(fd);
+    s->trace.read_done = monotonic_seconds();
+    s->trace.collected = snap.collected ? snap.collected : s->trace.read_start;
+    s->trace.queued = 0.0;
+    s->self.syscalls = snap.syscalls;
+    s->self.bytes = snap.bytes;
+    s->self.collect_ns = snap.collect_ns;
+    s->self.collections = snap.collections;
+    s->self.collect_total_ns = snap.collect_total_ns;
+    s->seq = snap.seq;
+    s->timestamp = snap.timestamp;
+    s->cpu_user = snap.cpu_user;
+    s->cpu_system = snap.cpu_system;
+    s->cpu_idle = snap.cpu_idle;
+    s->total_ram = snap.total_ram;
+    s->free_ram = snap.free_ram;
+    s->shared_ram = snap.shared_ram;
+    s->buffer_ram = snap.buffer_ram;
+    s->total_processes = snap.total_processes;
+    s->has_rss = snap.has_rss;
+    s->has_cpu = snap.has_cpu;
+    s->has_uid = snap.has_uid;
+    s->dropped_tasks = snap.dropped_tasks;
+    s->filtered_tasks = 0;
+    s->nr_tasks = 0;
+
+    while (kmon_next_task(&snap, &kt) > 0) {
+        struct km_task *t;
 
-    return bytes_read;
+        /* Rows that are filtered out never take a slot */
+        if (cfg->filter && !filter_match(cfg->filter, &kt, snap.has_uid)) {
+            s->filtered_tasks++;
+            continue;
+        }
+        if (s->nr_tasks == s->max_tasks) {
+            s->dropped_tasks++;
+            continue;
+        }
+        t = &s->tasks[s->nr_tasks++];
+        memcpy(t->comm, kt.comm, sizeof(t->comm));
+        t->pid = kt.pid;
+        t->mem_kb = kt.mem_kb;
+        t->rss_kb = kt.rss_kb;
+        t->start_time = kt.start_time;
+        t->cpu_ns = kt.cpu_ns;
+        t->ppid = kt.ppid;
+        t->uid = kt.uid;
+        t->cpu_pct = 0.0f;
+        t->mem_rate = 0.0f;
+        t->leak_rate = 0.0f;
+        t->mem_z = 0.0f;
+        t->flags = 0;
+    }
+    if (!kmon_snapshot_valid(&snap)) {
+        /* The publisher rewrote the sample while it was being decoded */
+        if (++tries < SHM_DECODE_RETRIES)
+            goto retry;
+        errno = EAGAIN;
+        source_error(cfg);
+        return -1;
+    }
+    s->trace.parsed = monotonic_seconds();
+    return 0;
 }
 
 /**
  * display_data - Display kernel data with formatting
  * @raw: If true, display raw output; otherwise, add formatting
+ * @cfg: Monitor settings
+ *
+ * Return: 0 on success, -1 on failure
  */
-static void display_data(int raw)
+static int display_data(int raw, const struct monitor_config *cfg)
 {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
+    struct kmon km;
+    struct read_buf rb = { 0 };
+    struct km_sample sample;
+    struct comm_table names = { .slots = NULL };
+    struct proc_tree tree = { .slots = NULL };
+    int ret = -1;
 
-    /* Read data from kernel */
-    bytes_read = read_kernel_data(buffer, BUFFER_SIZE);
-    if (bytes_read < 0) {
-        return;
+    if (sample_init(&sample, cfg->max_procs, NULL) < 0 ||
+        (cfg->group && comm_table_init(&names, cfg->max_procs) < 0) ||
+        (cfg->tree && tree_init(&tree, cfg->max_procs) < 0)) {
+        err_printf(COLOR_RED, "Error: Out of memory\n");
+        comm_table_free(&names);
+        sample_free(&sample);
+        return -1;
+    }
+    if (source_open(&km, cfg) < 0) {
+        tree_free(&tree);
+        comm_table_free(&names);
+        sample_free(&sample);
+        return -1;
     }
 
-    /* Display data */
-    if (raw) {
-        printf("%s", buffer);
-    } else {
-        /* Clear screen for formatted output */
-        printf("\033[2J\033[H");
+    /* Read data from kernel */
+    if (raw && !cfg->connect_path && !cfg->connect_shm && !cfg->procfs) {
+        if (raw_read(&km, cfg, &rb) == 0) {
+            printf("%s", rb.data);
+            ret = 0;
+        }
+    } else if (sample_read(&km, cfg, &rb, &sample) == 0) {
+        struct self_meter meter;
+
+        if (cfg->group)
+            group_tasks(&names, &sample);
+        if (cfg->tree)
+            tree_build(&tree, &sample, cfg->tree_depth);
+        self_meter_init(&meter);
+        self_measure(&meter, &sample);
+        self_meter_free(&meter);
         printf(COLOR_BOLD COLOR_BLUE);
         printf("╔════════════════════════════════════════════════════════╗\n");
         printf("║         Linux Kernel Monitor - Live View              ║\n");
         printf("╚════════════════════════════════════════════════════════╝\n");
-        printf(COLOR_RESET);
-        printf("\n%s\n", buffer);
+        printf(COLOR_RESET "\n");
+        print_sample(&sample, cfg->trace);
+        ret = 0;
+    }
+
+    kmon_close(&km);
+    free(rb.data);
+    tree_free(&tree);
+    comm_table_free(&names);
+    sample_free(&sample);
+    return ret;
+}
+
+/**
+ * sample_copy - Copy a sample, including its per-task tables
+ * @dst: Destination with the same task capacity as @src
+ * @src: Sample to copy
+ */
+static void sample_copy(struct km_sample *dst, const struct km_sample *src)
+{
+    struct km_task *tasks = dst->tasks;
+    struct km_group *groups = dst->groups;
+    struct km_node *nodes = dst->nodes;
+    struct km_change *changes = dst->changes;
+
+    *dst = *src;
+    dst->tasks = tasks;
+    dst->groups = groups;
+    dst->nodes = nodes;
+    dst->changes = changes;
+    memcpy(tasks, src->tasks, src->nr_tasks * sizeof(*tasks));
+    memcpy(groups, src->groups, src->nr_groups * sizeof(*groups));
+    memcpy(nodes, src->nodes, src->nr_nodes * sizeof(*nodes));
+    memcpy(changes, src->changes, src->nr_changes * sizeof(*changes));
+}
+
+/**
+ * draw_live_view - Redraw the terminal with a sample
+ * @s: Sample
+ * @trace: Also display the stage latencies
+ */
+static void draw_live_view(const struct km_sample *s, int trace)
+{
+    /* Clear screen for formatted output */
+    printf("\033[2J\033[H");
+    printf(COLOR_BOLD COLOR_BLUE);
+    printf("╔════════════════════════════════════════════════════════╗\n");
+    printf("║         Linux Kernel Monitor - Live View              ║\n");
+    printf("╚════════════════════════════════════════════════════════╝\n");
+    printf(COLOR_RESET "\n");
+    print_sample(s, trace);
+    fflush(stdout);
+}
+
+/**
+ * sink_consume - Hand one sample to a sink's output
+ * @sk: Sink
+ * @s: Sample
+ */
+static void sink_consume(struct sink *sk, const struct km_sample *s)
+{
+    struct pipeline *pl = sk->pl;
+    double now;
+
+    arena_reset(&sk->scratch);
+    switch (sk->kind) {
+    case SINK_DISPLAY:
+        draw_live_view(s, pl->cfg->trace);
+        now = monotonic_seconds();
+        latency_record(&pl->latency[STAGE_RENDER], now - s->trace.queued);
+        latency_record(&pl->latency[STAGE_AGE], now - s->trace.collected);
+        break;
+    case SINK_ALERTS:
+        alert_deliver(pl->cfg->alerts, s, &sk->scratch);
+        break;
+    case SINK_TEXTFILE:
+        textfile_write(pl->textfile, s, pl->cfg->alerts);
+        break;
+    case SINK_SERVER:
+        if (pl->pub->fanout)
+            fanout_publish(pl->pub->fanout, s);
+        if (pl->pub->http)
+            http_publish(pl->pub->http, s, pl->cfg->alerts);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * sink_main - Consumer thread
+ * @arg: Sink
+ *
+ * The server sink keeps serving its sockets while it waits for samples.
+ *
+ * Return: NULL
+ */
+static void *sink_main(void *arg)
+{
+    struct sink *sk = arg;
+    struct sink_queue *q = &sk->q;
+    struct publishers none = { NULL, NULL };
+    struct publishers *pub = sk->kind == SINK_SERVER ? sk->pl->pub : &none;
+    unsigned int tail = q->tail;
+
+    for (;;) {
+        unsigned int head;
+        uint64_t n;
+
+        wait_for(-1.0, q->efd, pub);
+        if (read(q->efd, &n, sizeof(n)) < 0 && errno != EINTR)
+            break;
+
+        head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        while (tail != head) {
+            sink_consume(sk, &q->slots[tail % SINK_QUEUE_DEPTH]);
+            __atomic_store_n(&q->tail, ++tail, __ATOMIC_RELEASE);
+        }
+        if (__atomic_load_n(&sk->pl->stop, __ATOMIC_ACQUIRE))
+            break;
+    }
+    return NULL;
+}
+
+/**
+ * sink_push - Queue a sample for a sink without waiting
+ * @sk: Sink
+ * @s: Sample
+ */
+static void sink_push(struct sink *sk, const struct km_sample *s)
+{
+    struct sink_queue *q = &sk->q;
+    unsigned int head = q->head;
+    uint64_t one = 1;
+
+    if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == SINK_QUEUE_DEPTH) {
+        q->dropped++;
+        return;
+    }
+    sample_copy(&q->slots[head % SINK_QUEUE_DEPTH], s);
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    if (write(q->efd, &one, sizeof(one)) < 0) {
+        /* The counter cannot overflow at one increment per sample */
+    }
+}
+
+/**
+ * pipeline_start - Start one thread per enabled sink
+ * @pl: Pipeline to initialize
+ * @mask: Bitmask of sinks to run
+ * @cfg: Monitor settings
+ * @textfile: Textfile exporter, if SINK_TEXTFILE is enabled
+ * @pub: Servers, if SINK_SERVER is enabled
+ *
+ * Return: 0 on success, -1 on failure (reported on stderr)
+ */
+static int pipeline_start(struct pipeline *pl, unsigned int mask,
+                          const struct monitor_config *cfg,
+                          struct textfile_exporter *textfile, struct publishers *pub)
+{
+    int i, j, n = 0;
+
+    memset(pl, 0, sizeof(*pl));
+    pl->cfg = cfg;
+    pl->textfile = textfile;
+    pl->pub = pub;
+
+    for (i = 0; i < SINK_MAX; i++)
+        if (mask & (1u << i))
+            n++;
+    if (arena_init(&pl->pool, n * SINK_QUEUE_DEPTH *
+                   (cfg->max_procs * (sizeof(struct km_task) + sizeof(struct km_group) +
+                                      sizeof(struct km_node) + sizeof(struct km_change)) +
+                    4 * ARENA_ALIGN)) < 0) {
+        err_printf(COLOR_RED, "Error: Out of memory\n");
+        return -1;
+    }
+
+    for (i = 0; i < SINK_MAX; i++) {
+        struct sink *sk = &pl->sinks[i];
+
+        if (!(mask & (1u << i)))
+            continue;
+        sk->pl = pl;
+        sk->kind = i;
+        for (j = 0; j < SINK_QUEUE_DEPTH; j++) {
+            if (sample_init(&sk->q.slots[j], cfg->max_procs, &pl->pool) < 0) {
+                err_printf(COLOR_RED, "Error: Out of memory\n");
+                return -1;
+            }
+        }
+        if (arena_init(&sk->scratch, SINK_SCRATCH_SIZE) < 0) {
+            err_printf(COLOR_RED, "Error: Out of memory\n");
+            return -1;
+        }
+        sk->q.efd = eventfd(0, EFD_CLOEXEC);
+        if (sk->q.efd < 0 || pthread_create(&sk->thread, NULL, sink_main, sk) != 0) {
+            err_printf(COLOR_RED, "Error: Failed to start the %s sink\n",
+                       sink_names[i]);
+            return -1;
+        }
+        pl->mask |= 1u << i;
+    }
+    return 0;
+}
+
+/**
+ * pipeline_push - Hand a sample to every sink
+ * @pl: Pipeline
+ * @s: Sample, annotated with the queue state and latencies first
+ */
+static void pipeline_push(struct pipeline *pl, struct km_sample *s)
+{
+    int i;
+
+    s->trace.queued = monotonic_seconds();
+    latency_record(&pl->latency[STAGE_READ], s->trace.read_done - s->trace.read_start);
+    latency_record(&pl->latency[STAGE_PARSE], s->trace.parsed - s->trace.read_done);
+    latency_record(&pl->latency[STAGE_ANALYZE], s->trace.queued - s->trace.parsed);
+    for (i = 0; i < STAGE_MAX; i++)
+        latency_copy(&s->latency[i], &pl->latency[i]);
+
+    s->sink_mask = pl->mask;
+    for (i = 0; i < SINK_MAX; i++) {
+        const struct sink_queue *q = &pl->sinks[i].q;
+
+        if (!(pl->mask & (1u << i)))
+            continue;
+        s->sinks[i].depth = q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        s->sinks[i].dropped = q->dropped;
+    }
+    for (i = 0; i < SINK_MAX; i++)
+        if (pl->mask & (1u << i))
+            sink_push(&pl->sinks[i], s);
+}
+
+/**
+ * pipeline_stop - Let the sinks finish their queues and join them
+ * @pl: Pipeline
+ */
+static void pipeline_stop(struct pipeline *pl)
+{
+    uint64_t one = 1;
+    int i;
+
+    __atomic_store_n(&pl->stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < SINK_MAX; i++) {
+        struct sink *sk = &pl->sinks[i];
+
+        if (!(pl->mask & (1u << i)))
+            continue;
+        if (write(sk->q.efd, &one, sizeof(one)) == sizeof(one))
+            pthread_join(sk->thread, NULL);
+        close(sk->q.efd);
+        arena_free(&sk->scratch);
     }
+    arena_free(&pl->pool);
+    pl->mask = 0;
 }
 
 /**
  * watch_mode - Continuously display data at specified intervals
  * @interval: Time in seconds between updates
+ * @display: Draw the live view; exporters and alerts run either way
+ * @cfg: Monitor settings
+ *
+ * This thread only reads and analyzes samples. Display, alert delivery
+ * and the exporters run as sinks on their own threads, so a stalled
+ * terminal or slow disk costs that sink samples instead of delaying the
+ * sampling loop.
+ *
+ * Return: EXIT_FAILURE if the monitor could not be set up
  */
-static void watch_mode(int interval)
+static int watch_mode(int interval, int display, const struct monitor_config *cfg)
 {
-    printf(COLOR_GREEN "Starting watch mode (updating every %d seconds)...\n", interval);
-    printf("Press Ctrl+C to exit\n" COLOR_RESET);
-    sleep(2);
+    struct kmon km;
+    struct read_buf rb = { 0 };
+    struct km_sample sample;
+    struct proc_tracker tracker;
+    struct comm_table names = { .slots = NULL };
+    struct proc_tree tree = { .slots = NULL };
+    struct proc_diff diff = { .prev = NULL };
+    struct sys_state sys;
+    struct http_exporter http;
+    struct textfile_exporter textfile;
+    static struct fanout_server fanout;
+    struct shm_publisher shm = { .hdr = NULL };
+    struct publishers pub = { NULL, NULL };
+    struct publishers none = { NULL, NULL };
+    static struct pipeline pipeline;
+    struct self_meter meter;
+    unsigned int sinks = 0;
+    double next;
+
+    if (sample_init(&sample, cfg->max_procs, NULL) < 0 ||
+        tracker_init(&tracker, cfg->max_procs) < 0 ||
+        (cfg->group && comm_table_init(&names, cfg->max_procs) < 0) ||
+        (cfg->tree && tree_init(&tree, cfg->max_procs) < 0) ||
+        (cfg->diff && diff_init(&diff, cfg->max_procs) < 0) ||
+        sys_state_init(&sys) < 0) {
+        err_printf(COLOR_RED, "Error: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    tracker.sparklines = display;
+    if (read_buf_grow(&rb, BUFFER_SIZE + cfg->max_procs * READ_TASK_BYTES) < 0)
+        return EXIT_FAILURE;
+    if (source_open(&km, cfg) < 0)
+        return EXIT_FAILURE;
+    if (cfg->export_http) {
+        if (http_init(&http, cfg->export_http, cfg->max_procs) < 0)
+            return EXIT_FAILURE;
+        pub.http = &http;
+    }
+    if (cfg->textfile_dir && textfile_init(&textfile, cfg->textfile_dir, cfg->max_procs) < 0)
+        return EXIT_FAILURE;
+    if (cfg->daemon_path) {
+        if (fanout_init(&fanout, cfg->daemon_path, cfg->max_procs) < 0)
+            return EXIT_FAILURE;
+        pub.fanout = &fanout;
+    }
+    if (cfg->shm_name && shm_init(&shm, cfg->shm_name, cfg->max_procs) < 0)
+        return EXIT_FAILURE;
 
+    if (display)
+        sinks |= 1u << SINK_DISPLAY;
+    if (cfg->alerts)
+        sinks |= 1u << SINK_ALERTS;
+    if (cfg->textfile_dir)
+        sinks |= 1u << SINK_TEXTFILE;
+    if (pub.http || pub.fanout)
+        sinks |= 1u << SINK_SERVER;
+
+    if (display) {
+        printf(COLOR_GREEN "Starting watch mode (updating every %d seconds)...\n", interval);
+        printf("Press Ctrl+C to exit\n" COLOR_RESET);
+        sleep(2);
+    }
+    if (pipeline_start(&pipeline, sinks, cfg, &textfile, &pub) < 0)
+        return EXIT_FAILURE;
+    self_meter_init(&meter);
+
+    next = monotonic_seconds();
     while (1) {
-        display_data(0);
-        sleep(interval);
+        /* A daemon source blocks in the read and sets the pace */
+        if (sample_read(&km, cfg, &rb, &sample) < 0) {
+            if (kmon_fd(&km) >= 0)
+                break;
+        } else {
+            if (shm.hdr)
+                shm_publish(&shm, &sample);
+            analyze_processes(&tracker, &sample, cfg);
+            if (cfg->group)
+                group_tasks(&names, &sample);
+            if (cfg->tree)
+                tree_build(&tree, &sample, cfg->tree_depth);
+            if (cfg->diff)
+                diff_processes(&diff, &sample);
+            analyze_system(&sys, &sample, cfg);
+            if (cfg->alerts)
+                alert_evaluate(cfg->alerts, &sample);
+            self_measure(&meter, &sample);
+            pipeline_push(&pipeline, &sample);
+        }
+
+        if (kmon_fd(&km) >= 0)
+            continue;
+
+        /* Keep a fixed cadence regardless of how long the sample took */
+        next += interval;
+        if (next < monotonic_seconds())
+            next = monotonic_seconds();
+        wait_for(next, -1, &none);
+    }
+
+    pipeline_stop(&pipeline);
+    self_meter_free(&meter);
+    shm_free(&shm);
+    if (pub.fanout)
+        fanout_free(pub.fanout);
+    if (pub.http)
+        http_free(pub.http);
+    if (cfg->textfile_dir)
+        free(textfile.buf.data);
+    sys_state_free(&sys);
+    diff_free(&diff);
+    tree_free(&tree);
+    comm_table_free(&names);
+    tracker_free(&tracker);
+    sample_free(&sample);
+    kmon_close(&km);
+    free(rb.data);
+    return EXIT_FAILURE;
+}
+
+/**
+ * batch_mode - Write a fixed number of samples for scripts
+ * @count: Samples to take, 0 to run until killed
+ * @interval: Time in seconds between samples
+ * @cfg: Monitor settings
+ *
+ * Samples are analyzed as in watch mode and written to stdout as records
+ * of render_batch(), without colors or terminal control codes. Each sample
+ * is rendered into a buffer reserved up front and leaves in a single write,
+ * so a reader never sees half a sample and the loop does not allocate.
+ * Alerts still go to stderr and the alert hooks.
+ *
+ * Return: EXIT_SUCCESS once @count samples are written, EXIT_FAILURE on failure
+ */
+static int batch_mode(unsigned long count, double interval, const struct monitor_config *cfg)
+{
+    struct kmon km;
+    struct read_buf rb = { 0 };
+    struct text_buf out = { 0 };
+    struct km_sample sample;
+    struct proc_tracker tracker;
+    struct comm_table names = { .slots = NULL };
+    struct proc_tree tree = { .slots = NULL };
+    struct proc_diff diff = { .prev = NULL };
+    struct sys_state sys;
+    struct arena scratch = { 0 };
+    struct publishers none = { NULL, NULL };
+    unsigned long nr;
+    int ret = EXIT_FAILURE;
+    double next;
+
+    if (sample_init(&sample, cfg->max_procs, NULL) < 0 ||
+        tracker_init(&tracker, cfg->max_procs) < 0 ||
+        (cfg->group && comm_table_init(&names, cfg->max_procs) < 0) ||
+        (cfg->tree && tree_init(&tree, cfg->max_procs) < 0) ||
+        (cfg->diff && diff_init(&diff, cfg->max_procs) < 0) ||
+        sys_state_init(&sys) < 0 ||
+        (cfg->alerts && arena_init(&scratch, SINK_SCRATCH_SIZE) < 0) ||
+        tb_reserve(&out, metrics_size(cfg->max_procs)) < 0 ||
+        read_buf_grow(&rb, BUFFER_SIZE + cfg->max_procs * READ_TASK_BYTES) < 0) {
+        err_printf(COLOR_RED, "Error: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    if (source_open(&km, cfg) < 0)
+        return EXIT_FAILURE;
+
+    next = monotonic_seconds();
+    for (nr = 1; !count || nr <= count; nr++) {
+        struct timespec wall;
+        size_t off = 0;
+
+        if (sample_read(&km, cfg, &rb, &sample) < 0)
+            goto out;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        analyze_processes(&tracker, &sample, cfg);
+        if (cfg->group)
+            group_tasks(&names, &sample);
+        if (cfg->tree)
+            tree_build(&tree, &sample, cfg->tree_depth);
+        if (cfg->diff)
+            diff_processes(&diff, &sample);
+        analyze_system(&sys, &sample, cfg);
+        if (cfg->alerts) {
+            alert_evaluate(cfg->alerts, &sample);
+            arena_reset(&scratch);
+            alert_deliver(cfg->alerts, &sample, &scratch);
+        }
+
+        if (render_batch(&out, &sample, cfg, nr, wall.tv_sec + wall.tv_nsec / 1e9,
+                         nr == 1) < 0) {
+            err_printf(COLOR_RED, "Error: Out of memory rendering a sample\n");
+            goto out;
+        }
+        while (off < out.len) {
+            ssize_t n = write(STDOUT_FILENO, out.data + off, out.len - off);
+
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                err_printf(COLOR_RED, "Error: Failed to write output: %s\n", strerror(errno));
+                goto out;
+            }
+            off += n;
+        }
+
+        if (nr == count || kmon_fd(&km) >= 0)
+            continue;
+        next += interval;
+        if (next < monotonic_seconds())
+            next = monotonic_seconds();
+        wait_for(next, -1, &none);
+    }
+    ret = EXIT_SUCCESS;
+
+out:
+    kmon_close(&km);
+    arena_free(&scratch);
+    sys_state_free(&sys);
+    diff_free(&diff);
+    tree_free(&tree);
+    comm_table_free(&names);
+    tracker_free(&tracker);
+    sample_free(&sample);
+    free(out.data);
+    free(rb.data);
+    return ret;
+}
+
+/**
+ * bench_tracker - Time the per-process tracking on synthetic samples
+ * @n: Processes per sample
+ * @cfg: Monitor settings; the detectors use their thresholds
+ *
+ * Every sample replaces one process in BENCH_CHURN: half of them exit and
+ * are followed by new pids, the other half reuse their pid with a new
+ * start time. The hash lookups alone and the whole per-process analysis
+ * are timed separately.
+ *
+ * Return: EXIT_SUCCESS, or EXIT_FAILURE on allocation failure
+ */
+static int bench_tracker(size_t n, const struct monitor_config *cfg)
+{
+    struct proc_tracker tr;
+    struct km_sample s;
+    double lookup = 0.0, analyze = 0.0, worst = 0.0;
+    unsigned long long start = 1;
+    uint32_t rnd = 1;
+    size_t probes = 0, i, k;
+    int next_pid = 300, r;
+
+    if (sample_init(&s, n, NULL) < 0 || tracker_init(&tr, n) < 0) {
+        err_printf(COLOR_RED, "Error: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < n; i++) {
+        struct km_task *t = &s.tasks[i];
+
+        snprintf(t->comm, sizeof(t->comm), "task%zu", i % 1000);
+        t->pid = next_pid;
+        next_pid += 1 + i % 3;
+        t->start_time = start++;
+        t->mem_kb = 4096 + (i * 37) % 65536;
+        t->rss_kb = t->mem_kb / 2;
+    }
+    s.nr_tasks = n;
+    s.has_rss = 1;
+
+    /* Sample 0 fills the tracker and is not timed */
+    for (r = 0; r <= BENCH_SAMPLES; r++) {
+        double t0, t1, t2;
+
+        s.timestamp = r;
+        for (k = 0; r && k < n / BENCH_CHURN + 1; k++) {
+            struct km_task *t;
+
+            rnd = rnd * 1664525u + 1013904223u;
+            t = &s.tasks[rnd % n];
+            if (k & 1)
+                t->pid = next_pid++;
+            t->start_time = start++;
+        }
+        for (i = 0; i < n; i++) {
+            s.tasks[i].mem_kb += (i + r) & 1;
+            s.tasks[i].flags = 0;
+        }
+
+        t0 = monotonic_seconds();
+        for (i = 0; i < n; i++) {
+            size_t slot = tracker_find_slot(&tr, s.tasks[i].pid);
+
+            if (r == BENCH_SAMPLES && tr.slots[slot].pid)
+                probes += (slot - pid_hash(s.tasks[i].pid, tr.mask)) & tr.mask;
+        }
+        t1 = monotonic_seconds();
+        analyze_processes(&tr, &s, cfg);
+        t2 = monotonic_seconds();
+        if (!r)
+            continue;
+        lookup += t1 - t0;
+        analyze += t2 - t1;
+        if (t2 - t1 > worst)
+            worst = t2 - t1;
     }
+
+    printf("Tracker: %zu processes, %zu replaced per sample, %d samples\n",
+           n, n / BENCH_CHURN + 1, BENCH_SAMPLES);
+    printf("  Table:   %zu slots, load %.2f, %.2f extra probes per lookup\n",
+           tr.mask + 1, (double)tr.count / (tr.mask + 1), (double)probes / n);
+    printf("  Lookup:  %.3f ms per sample, %.1f ns per process\n",
+           lookup / BENCH_SAMPLES * 1e3, lookup / BENCH_SAMPLES / n * 1e9);
+    printf("  Analyze: %.3f ms per sample, %.1f ns per process, worst %.3f ms\n",
+           analyze / BENCH_SAMPLES * 1e3, analyze / BENCH_SAMPLES / n * 1e9, worst * 1e3);
+
+    tracker_free(&tr);
+    sample_free(&s);
+    return EXIT_SUCCESS;
 }
 
 /**
@@ -152,18 +6002,93 @@ int main(int argc, char *argv[])
     int opt;
     int raw_mode = 0;
     int watch_interval = 0;
+    long batch_count = -1;
+    double batch_interval = 0.0;
+    long max_procs;
+    long bench_procs = 0;
+    long page_size;
+    char *end;
+    static struct alert_engine alerts = { .fd = -1 };
+    static struct task_filter filter;
+    struct monitor_config cfg = {
+        .max_procs = DEFAULT_MAX_PROCS,
+        .leak = {
+            .horizon = DEFAULT_LEAK_HORIZON,
+            .rate = DEFAULT_LEAK_RATE,
+        },
+        .forecast_window = DEFAULT_FORECAST_WINDOW,
+        .anomaly = {
+            .alpha = DEFAULT_EWMA_ALPHA,
+            .zscore = DEFAULT_ZSCORE,
+        },
+    };
+
+    enum {
+        OPT_LEAK_HORIZON = 256,
+        OPT_LEAK_RATE,
+        OPT_FORECAST_WINDOW,
+        OPT_EWMA_ALPHA,
+        OPT_ZSCORE,
+        OPT_RULE,
+        OPT_RULES,
+        OPT_ALERT_FILE,
+        OPT_ALERT_EXEC,
+        OPT_EXPORT_HTTP,
+        OPT_TEXTFILE_DIR,
+        OPT_DAEMON,
+        OPT_CONNECT,
+        OPT_SHM,
+        OPT_CONNECT_SHM,
+        OPT_PROCFS,
+        OPT_TRACE,
+        OPT_BENCH_TRACKER,
+        OPT_TREE_DEPTH,
+        OPT_DIFF,
+        OPT_FILTER,
+    };
 
     /* Define long options */
     static struct option long_options[] = {
-        {"help",    no_argument,       0, 'h'},
-        {"version", no_argument,       0, 'v'},
-        {"raw",     no_argument,       0, 'r'},
-        {"watch",   required_argument, 0, 'w'},
+        {"help",         no_argument,       0, 'h'},
+        {"version",      no_argument,       0, 'v'},
+        {"raw",          no_argument,       0, 'r'},
+        {"watch",        required_argument, 0, 'w'},
+        {"max-procs",    required_argument, 0, 'm'},
+        {"count",        required_argument, 0, 'n'},
+        {"delay",        required_argument, 0, 'd'},
+        {"group",        no_argument,       0, 'g'},
+        {"tree",         no_argument,       0, 't'},
+        {"tree-depth",   required_argument, 0, OPT_TREE_DEPTH},
+        {"diff",         no_argument,       0, OPT_DIFF},
+        {"filter",       required_argument, 0, OPT_FILTER},
+        {"leak-horizon", required_argument, 0, OPT_LEAK_HORIZON},
+        {"leak-rate",    required_argument, 0, OPT_LEAK_RATE},
+        {"forecast-window", required_argument, 0, OPT_FORECAST_WINDOW},
+        {"ewma-alpha",   required_argument, 0, OPT_EWMA_ALPHA},
+        {"zscore",       required_argument, 0, OPT_ZSCORE},
+        {"rule",         required_argument, 0, OPT_RULE},
+        {"rules",        required_argument, 0, OPT_RULES},
+        {"alert-file",   required_argument, 0, OPT_ALERT_FILE},
+        {"alert-exec",   required_argument, 0, OPT_ALERT_EXEC},
+        {"export-http",  required_argument, 0, OPT_EXPORT_HTTP},
+        {"textfile-dir", required_argument, 0, OPT_TEXTFILE_DIR},
+        {"daemon",       required_argument, 0, OPT_DAEMON},
+        {"connect",      required_argument, 0, OPT_CONNECT},
+        {"shm",          required_argument, 0, OPT_SHM},
+        {"connect-shm",  required_argument, 0, OPT_CONNECT_SHM},
+        {"procfs",       no_argument,       0, OPT_PROCFS},
+        {"trace",        no_argument,       0, OPT_TRACE},
+        {"bench-tracker", required_argument, 0, OPT_BENCH_TRACKER},
         {0, 0, 0, 0}
     };
 
+    stderr_colors = isatty(STDERR_FILENO);
+    page_size = sysconf(_SC_PAGESIZE);
+    if (page_size >= 1024)
+        page_kb = page_size / 1024;
+
     /* Parse command line options */
-    while ((opt = getopt_long(argc, argv, "hvrw:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hvrw:m:n:d:gt", long_options, NULL)) != -1) {
         switch (opt) {
             case 'h':
                 print_usage(argv[0]);
@@ -181,17 +6106,191 @@ int main(int argc, char *argv[])
                     return EXIT_FAILURE;
                 }
                 break;
+            case 'm':
+                max_procs = atol(optarg);
+                if (max_procs <= 0 || max_procs > (1L << 24)) {
+                    fprintf(stderr, "Error: Invalid process limit\n");
+                    return EXIT_FAILURE;
+                }
+                cfg.max_procs = max_procs;
+                break;
+            case 'n':
+                /* A typo must not turn a bounded run into an endless one */
+                errno = 0;
+                batch_count = strtol(optarg, &end, 10);
+                if (errno || end == optarg || *end || batch_count < 0) {
+                    fprintf(stderr, "Error: Invalid sample count '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                errno = 0;
+                batch_interval = strtod(optarg, &end);
+                if (errno || end == optarg || *end || !(batch_interval > 0) ||
+                    !isfinite(batch_interval)) {
+                    fprintf(stderr, "Error: Invalid batch interval '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'g':
+                cfg.group = 1;
+                break;
+            case 't':
+                cfg.tree = 1;
+                break;
+            case OPT_LEAK_HORIZON:
+                cfg.leak.horizon = atof(optarg);
+                if (cfg.leak.horizon <= 0) {
+                    fprintf(stderr, "Error: Invalid leak horizon\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_LEAK_RATE:
+                cfg.leak.rate = atof(optarg);
+                if (cfg.leak.rate <= 0) {
+                    fprintf(stderr, "Error: Invalid leak rate\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_FORECAST_WINDOW:
+                cfg.forecast_window = atof(optarg);
+                if (cfg.forecast_window <= 0) {
+                    fprintf(stderr, "Error: Invalid forecast window\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_EWMA_ALPHA:
+                cfg.anomaly.alpha = atof(optarg);
+                if (cfg.anomaly.alpha <= 0 || cfg.anomaly.alpha > 1) {
+                    fprintf(stderr, "Error: Invalid EWMA weight\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_ZSCORE:
+                cfg.anomaly.zscore = atof(optarg);
+                if (cfg.anomaly.zscore <= 0) {
+                    fprintf(stderr, "Error: Invalid z-score band\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_RULE:
+                if (alert_add_rule(&alerts, optarg) < 0)
+                    return EXIT_FAILURE;
+                cfg.alerts = &alerts;
+                break;
+            case OPT_RULES:
+                if (alert_load_rules(&alerts, optarg) < 0)
+                    return EXIT_FAILURE;
+                cfg.alerts = &alerts;
+                break;
+            case OPT_ALERT_FILE:
+                if (alerts.fd >= 0)
+                    close(alerts.fd);
+                alerts.fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                if (alerts.fd < 0) {
+                    fprintf(stderr, "Error: Failed to open %s: %s\n",
+                            optarg, strerror(errno));
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_ALERT_EXEC:
+                alerts.exec = optarg;
+                break;
+            case OPT_EXPORT_HTTP:
+                cfg.export_http = optarg;
+                break;
+            case OPT_TEXTFILE_DIR:
+                cfg.textfile_dir = optarg;
+                break;
+            case OPT_DAEMON:
+                cfg.daemon_path = optarg;
+                break;
+            case OPT_CONNECT:
+                cfg.connect_path = optarg;
+                break;
+            case OPT_SHM:
+                cfg.shm_name = optarg;
+                break;
+            case OPT_CONNECT_SHM:
+                cfg.connect_shm = optarg;
+                break;
+            case OPT_PROCFS:
+                cfg.procfs = 1;
+                break;
+            case OPT_TRACE:
+                cfg.trace = 1;
+                break;
+            case OPT_BENCH_TRACKER:
+                bench_procs = atol(optarg);
+                if (bench_procs <= 0 || bench_procs > (1L << 24)) {
+                    fprintf(stderr, "Error: Invalid process count\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_TREE_DEPTH:
+                if (atoi(optarg) <= 0) {
+                    fprintf(stderr, "Error: Invalid tree depth\n");
+                    return EXIT_FAILURE;
+                }
+                cfg.tree_depth = atoi(optarg);
+                cfg.tree = 1;
+                break;
+            case OPT_DIFF:
+                cfg.diff = 1;
+                break;
+            case OPT_FILTER:
+                if (filter_add(&filter, optarg) < 0)
+                    return EXIT_FAILURE;
+                cfg.filter = &filter;
+                break;
             default:
                 print_usage(argv[0]);
                 return EXIT_FAILURE;
         }
     }
 
+    if (bench_procs)
+        return bench_tracker(bench_procs, &cfg);
+    filter_finish(&filter);
+
+    /* Load the time zone now; localtime_r() would allocate on the first alert */
+    if (cfg.alerts)
+        tzset();
+    if (cfg.group + cfg.tree + cfg.diff > 1) {
+        fprintf(stderr, "Error: Choose only one of --group, --tree and --diff\n");
+        return EXIT_FAILURE;
+    }
+    /* Batch output is captured by scripts, usually along with stderr */
+    if (batch_count >= 0 || batch_interval > 0)
+        stderr_colors = 0;
+    if ((batch_count >= 0 || batch_interval > 0) &&
+        (watch_interval || raw_mode || cfg.export_http || cfg.textfile_dir ||
+         cfg.daemon_path || cfg.shm_name)) {
+        fprintf(stderr, "Error: -n and -d cannot be combined with -w, -r, "
+                "the exporters or daemon operation\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Without the module, the same records can still be built from procfs */
+    if (!cfg.connect_path && !cfg.connect_shm && !cfg.procfs && !raw_mode &&
+        access(KMON_PROC_PATH, F_OK) < 0 && errno == ENOENT) {
+        err_printf(COLOR_YELLOW, "Note: %s not found, reading standard procfs "
+                   "files instead\n", KMON_PROC_PATH);
+        cfg.procfs = 1;
+    }
+
     /* Execute based on mode */
-    if (watch_interval > 0) {
-        watch_mode(watch_interval);
-    } else {
-        display_data(raw_mode);
+    if (batch_count >= 0 || batch_interval > 0) {
+        return batch_mode(batch_count > 0 ? batch_count : 0,
+                          batch_interval > 0 ? batch_interval : 1.0, &cfg);
+    } else if (cfg.daemon_path || cfg.shm_name) {
+        return watch_mode(watch_interval > 0 ? watch_interval : 1, 0, &cfg);
+    } else if (watch_interval > 0) {
+        return watch_mode(watch_interval, 1, &cfg);
+    } else if (cfg.export_http || cfg.textfile_dir) {
+        return watch_mode(1, 0, &cfg);
+    } else if (display_data(raw_mode, &cfg) < 0) {
+        return EXIT_FAILURE;
     }
 
     return EXIT_SUCCESS;